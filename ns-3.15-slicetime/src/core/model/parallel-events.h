@@ -0,0 +1,69 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright (c) 2009 RWTH Aachen University
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef PARALLEL_EVENTS_H
+#define PARALLEL_EVENTS_H
+
+#include "ns3/core-config.h"
+#include <stdint.h>
+
+namespace ns3 {
+
+/**
+ * \brief Reference counting of data shared between threads that execute events
+ *
+ * If ns-3 is configured with --enable-parallel-events (NS3_PARALLEL_EVENTS), a simulator
+ * implementation may execute the events of different nodes in several threads at the same
+ * time (see SyncSimulatorImpl). Objects and packets are then handed from one thread to another,
+ * so the reference counts of SimpleRefCount and of the data which copies of a packet share
+ * (buffer, metadata and tags) are changed with atomic operations, the free lists of that
+ * data are not used and shared data is never written in place. Otherwise these functions are
+ * plain increments and decrements.
+ */
+
+/**
+ * \param count the reference count
+ * \returns the incremented count
+ */
+inline uint32_t
+RefCountIncrement (uint32_t &count)
+{
+#ifdef NS3_PARALLEL_EVENTS
+  return __sync_add_and_fetch (&count, 1);
+#else
+  return ++count;
+#endif
+}
+
+/**
+ * \param count the reference count
+ * \returns the decremented count (the data may be freed if it is 0)
+ */
+inline uint32_t
+RefCountDecrement (uint32_t &count)
+{
+#ifdef NS3_PARALLEL_EVENTS
+  return __sync_sub_and_fetch (&count, 1);
+#else
+  return --count;
+#endif
+}
+
+} // namespace ns3
+
+#endif /* PARALLEL_EVENTS_H */
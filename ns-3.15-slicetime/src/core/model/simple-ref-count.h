@@ -25,6 +25,7 @@
 #include "empty.h"
 #include "default-deleter.h"
 #include "assert.h"
+#include "parallel-events.h"
 #include <stdint.h>
 #include <limits>
 
@@ -82,7 +83,7 @@ public:
   inline void Ref (void) const
   {
     NS_ASSERT (m_count < std::numeric_limits<uint32_t>::max());
-    m_count++;
+    RefCountIncrement (m_count);
   }
   /**
    * Decrement the reference count. This method should not be called
@@ -92,8 +93,7 @@ public:
    */
   inline void Unref (void) const
   {
-    m_count--;
-    if (m_count == 0)
+    if (RefCountDecrement (m_count) == 0)
       {
         DELETER::Delete (static_cast<T*> (const_cast<SimpleRefCount *> (this)));
       }
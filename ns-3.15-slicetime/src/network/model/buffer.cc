@@ -251,13 +251,12 @@ Buffer::operator = (Buffer const&o)
   if (m_data != o.m_data) 
     {
       // not assignment to self.
-      m_data->m_count--;
-      if (m_data->m_count == 0) 
+      if (RefCountDecrement (m_data->m_count) == 0)
         {
           Recycle (m_data);
         }
       m_data = o.m_data;
-      m_data->m_count++;
+      RefCountIncrement (m_data->m_count);
     }
   g_recommendedStart = std::max (g_recommendedStart, m_maxZeroAreaStart);
   m_maxZeroAreaStart = o.m_maxZeroAreaStart;
@@ -274,8 +273,7 @@ Buffer::~Buffer ()
   NS_LOG_FUNCTION (this);
   NS_ASSERT (CheckInternalState ());
   g_recommendedStart = std::max (g_recommendedStart, m_maxZeroAreaStart);
-  m_data->m_count--;
-  if (m_data->m_count == 0) 
+  if (RefCountDecrement (m_data->m_count) == 0)
     {
       Recycle (m_data);
     }
@@ -298,7 +296,12 @@ Buffer::AddAtStart (uint32_t start)
   NS_LOG_FUNCTION (this << start);
   bool dirty;
   NS_ASSERT (CheckInternalState ());
+#ifdef NS3_PARALLEL_EVENTS
+  // other threads may use the shared data, so it is never written in place
+  bool isDirty = m_data->m_count > 1;
+#else
   bool isDirty = m_data->m_count > 1 && m_start > m_data->m_dirtyStart;
+#endif
   if (m_start >= start && !isDirty)
     {
       /* enough space in the buffer and not dirty. 
@@ -317,8 +320,7 @@ Buffer::AddAtStart (uint32_t start)
       uint32_t newSize = GetInternalSize () + start;
       struct Buffer::Data *newData = Buffer::Create (newSize);
       memcpy (newData->m_data + start, m_data->m_data + m_start, GetInternalSize ());
-      m_data->m_count--;
-      if (m_data->m_count == 0)
+      if (RefCountDecrement (m_data->m_count) == 0)
         {
           Buffer::Recycle (m_data);
         }
@@ -349,7 +351,11 @@ Buffer::AddAtEnd (uint32_t end)
   NS_LOG_FUNCTION (this << end);
   bool dirty;
   NS_ASSERT (CheckInternalState ());
+#ifdef NS3_PARALLEL_EVENTS
+  bool isDirty = m_data->m_count > 1;
+#else
   bool isDirty = m_data->m_count > 1 && m_end < m_data->m_dirtyEnd;
+#endif
   if (GetInternalEnd () + end <= m_data->m_size && !isDirty)
     {
       /* enough space in buffer and not dirty
@@ -370,8 +376,7 @@ Buffer::AddAtEnd (uint32_t end)
       uint32_t newSize = GetInternalSize () + end;
       struct Buffer::Data *newData = Buffer::Create (newSize);
       memcpy (newData->m_data, m_data->m_data + m_start, GetInternalSize ());
-      m_data->m_count--;
-      if (m_data->m_count == 0) 
+      if (RefCountDecrement (m_data->m_count) == 0)
         {
           Buffer::Recycle (m_data);
         }
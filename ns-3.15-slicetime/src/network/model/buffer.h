@@ -628,6 +628,7 @@ private:
 } // namespace ns3
 
 #include "ns3/assert.h"
+#include "ns3/parallel-events.h"
 #include <string.h>
 
 namespace ns3 {
@@ -861,7 +862,7 @@ Buffer::Buffer (Buffer const&o)
     m_start (o.m_start),
     m_end (o.m_end)
 {
-  m_data->m_count++;
+  RefCountIncrement (m_data->m_count);
   NS_ASSERT (CheckInternalState ());
 }
 
@@ -19,12 +19,16 @@
  */
 #include "byte-tag-list.h"
 #include "ns3/log.h"
+#include "ns3/parallel-events.h"
 #include <vector>
 #include <string.h>
 
 NS_LOG_COMPONENT_DEFINE ("ByteTagList");
 
+#ifndef NS3_PARALLEL_EVENTS
+// (the free list is not shared between threads)
 #define USE_FREE_LIST 1
+#endif
 #define FREE_LIST_SIZE 1000
 #define OFFSET_MAX (2147483647)
 
@@ -129,7 +133,7 @@ ByteTagList::ByteTagList (const ByteTagList &o)
   NS_LOG_FUNCTION (this << &o);
   if (m_data != 0)
     {
-      m_data->count++;
+      RefCountIncrement (m_data->count);
     }
 }
 ByteTagList &
@@ -146,7 +150,7 @@ ByteTagList::operator = (const ByteTagList &o)
   m_used = o.m_used;
   if (m_data != 0)
     {
-      m_data->count++;
+      RefCountIncrement (m_data->count);
     }
   return *this;
 }
@@ -169,8 +173,14 @@ ByteTagList::Add (TypeId tid, uint32_t bufferSize, int32_t start, int32_t end)
       m_data = Allocate (spaceNeeded);
       m_used = 0;
     } 
+#ifdef NS3_PARALLEL_EVENTS
+  // other threads may use the shared data, so it is never written in place
+  else if (m_data->size < spaceNeeded ||
+           m_data->count != 1)
+#else
   else if (m_data->size < spaceNeeded ||
            (m_data->count != 1 && m_data->dirty != m_used))
+#endif
     {
       struct ByteTagListData *newData = Allocate (spaceNeeded);
       memcpy (&newData->data, &m_data->data, m_used);
@@ -370,8 +380,7 @@ ByteTagList::Deallocate (struct ByteTagListData *data)
       return;
     }
   g_maxSize = std::max (g_maxSize, data->size);
-  data->count--;
-  if (data->count == 0)
+  if (RefCountDecrement (data->count) == 0)
     {
       if (g_freeList.size () > FREE_LIST_SIZE ||
           data->size < g_maxSize)
@@ -408,8 +417,7 @@ ByteTagList::Deallocate (struct ByteTagListData *data)
     {
       return;
     }
-  data->count--;
-  if (data->count == 0)
+  if (RefCountDecrement (data->count) == 0)
     {
       uint8_t *buffer = (uint8_t *)data;
       delete [] buffer;
@@ -73,8 +73,7 @@ PacketMetadata::ReserveCopy (uint32_t size)
   struct PacketMetadata::Data *newData = PacketMetadata::Create (m_used + size);
   memcpy (newData->m_data, m_data->m_data, m_used);
   newData->m_dirtyEnd = m_used;
-  m_data->m_count--;
-  if (m_data->m_count == 0) 
+  if (RefCountDecrement (m_data->m_count) == 0)
     {
       PacketMetadata::Recycle (m_data);
     }
@@ -95,10 +94,16 @@ void
 PacketMetadata::Reserve (uint32_t size)
 {
   NS_ASSERT (m_data != 0);
+#ifdef NS3_PARALLEL_EVENTS
+  // other threads may use the shared data, so it is never written in place
+  if (m_data->m_size >= m_used + size &&
+      m_data->m_count == 1)
+#else
   if (m_data->m_size >= m_used + size &&
       (m_head == 0xffff ||
        m_data->m_count == 1 ||
        m_data->m_dirtyEnd == m_used))
+#endif
     {
       /* enough room, not dirty. */
     }
@@ -366,10 +371,15 @@ PacketMetadata::AddSmall (const struct PacketMetadata::SmallItem *item)
   uint32_t typeUidSize = GetUleb128Size (item->typeUid);
   uint32_t sizeSize = GetUleb128Size (item->size);
   uint32_t n =  2 + 2 + typeUidSize + sizeSize + 2;
+#ifdef NS3_PARALLEL_EVENTS
+  if (m_used + n > m_data->m_size ||
+      m_data->m_count != 1)
+#else
   if (m_used + n > m_data->m_size ||
       (m_head != 0xffff &&
        m_data->m_count != 1 &&
        m_used != m_data->m_dirtyEnd))
+#endif
     {
       ReserveCopy (n);
     }
@@ -404,10 +414,15 @@ PacketMetadata::AddBig (uint32_t next, uint32_t prev,
   uint32_t fragEndSize = GetUleb128Size (extraItem->fragmentEnd);
   uint32_t n = 2 + 2 + typeUidSize + sizeSize + 2 + fragStartSize + fragEndSize + 4;
 
+#ifdef NS3_PARALLEL_EVENTS
+  if (m_used + n > m_data->m_size ||
+      m_data->m_count != 1)
+#else
   if (m_used + n > m_data->m_size ||
       (m_head != 0xffff &&
        m_data->m_count != 1 &&
        m_used != m_data->m_dirtyEnd))
+#endif
     {
       ReserveCopy (n);
     }
@@ -566,6 +581,10 @@ struct PacketMetadata::Data *
 PacketMetadata::Create (uint32_t size)
 {
   NS_LOG_LOGIC ("create size="<<size<<", max="<<m_maxSize);
+#ifdef NS3_PARALLEL_EVENTS
+  // the free list is not shared between threads
+  return PacketMetadata::Allocate (size);
+#else
   if (size > m_maxSize)
     {
       m_maxSize = size;
@@ -585,11 +604,17 @@ PacketMetadata::Create (uint32_t size)
     }
   NS_LOG_LOGIC ("create alloc size="<<m_maxSize);
   return PacketMetadata::Allocate (m_maxSize);
+#endif
 }
 
 void
 PacketMetadata::Recycle (struct PacketMetadata::Data *data)
 {
+#ifdef NS3_PARALLEL_EVENTS
+  // the free list is not shared between threads
+  PacketMetadata::Deallocate (data);
+  return;
+#endif
   if (!m_enable)
     {
       PacketMetadata::Deallocate (data);
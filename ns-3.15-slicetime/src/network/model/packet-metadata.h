@@ -26,6 +26,7 @@
 #include "ns3/callback.h"
 #include "ns3/assert.h"
 #include "ns3/type-id.h"
+#include "ns3/parallel-events.h"
 #include "buffer.h"
 
 namespace ns3 {
@@ -385,7 +386,7 @@ PacketMetadata::PacketMetadata (PacketMetadata const &o)
 {
   NS_ASSERT (m_data != 0);
   NS_ASSERT (m_data->m_count < std::numeric_limits<uint32_t>::max());
-  m_data->m_count++;
+  RefCountIncrement (m_data->m_count);
 }
 PacketMetadata &
 PacketMetadata::operator = (PacketMetadata const& o)
@@ -394,14 +395,13 @@ PacketMetadata::operator = (PacketMetadata const& o)
     {
       // not self assignment
       NS_ASSERT (m_data != 0);
-      m_data->m_count--;
-      if (m_data->m_count == 0) 
+      if (RefCountDecrement (m_data->m_count) == 0)
         {
           PacketMetadata::Recycle (m_data);
         }
       m_data = o.m_data;
       NS_ASSERT (m_data != 0);
-      m_data->m_count++;
+      RefCountIncrement (m_data->m_count);
     }
   m_head = o.m_head;
   m_tail = o.m_tail;
@@ -412,8 +412,7 @@ PacketMetadata::operator = (PacketMetadata const& o)
 PacketMetadata::~PacketMetadata ()
 {
   NS_ASSERT (m_data != 0);
-  m_data->m_count--;
-  if (m_data->m_count == 0) 
+  if (RefCountDecrement (m_data->m_count) == 0)
     {
       PacketMetadata::Recycle (m_data);
     }
@@ -58,7 +58,7 @@ int main (int argc, char *argv[])
   // setup synchronization
   GlobalValue::Bind ("SimulatorImplementationType", StringValue ("ns3::RealtimeSimulatorImpl"));
   //GlobalValue::Bind ("SimulatorImplementationType", StringValue ("ns3::SyncSimulatorImpl"));
-  Config::SetDefault ("ns3::SyncClient::RecvTimeout", UintegerValue(0));
+  Config::SetDefault ("ns3::SyncClient::RecvTimeout", TimeValue (Seconds (0)));
   Config::SetDefault ("ns3::SyncClient::ClientDescription", StringValue ("ns-3 client"));
   Config::SetDefault ("ns3::SyncClient::ServerAddress", Ipv4AddressValue("10.0.0.4"));
   Config::SetDefault ("ns3::SyncClient::ServerPort", UintegerValue(17543));
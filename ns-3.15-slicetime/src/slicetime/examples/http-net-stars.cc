@@ -111,7 +111,7 @@ int main (int argc, char *argv[])
   //GlobalValue::Bind ("SimulatorImplementationType", StringValue ("ns3::RealtimeSimulatorImpl"));
 
   // setup synchronization
-  Config::SetDefault ("ns3::SyncClient::RecvTimeout", UintegerValue(0));
+  Config::SetDefault ("ns3::SyncClient::RecvTimeout", TimeValue (Seconds (0)));
   Config::SetDefault ("ns3::SyncClient::ClientDescription", StringValue ("ns-3 client"));
   Config::SetDefault ("ns3::SyncClient::ServerAddress", Ipv4AddressValue("10.0.0.4"));
   Config::SetDefault ("ns3::SyncClient::ServerPort", UintegerValue(17543));
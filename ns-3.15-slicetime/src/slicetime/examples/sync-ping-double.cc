@@ -50,7 +50,7 @@ int main(int argc, char *argv[])
   //  sends to one port only and therefore the two instance have to be either on different
   //  machines or on the same one in which case they can only receive on the same port if it
   //  is on a broadcast address)
-  Config::SetDefault ("ns3::SyncClient::RecvTimeout", UintegerValue(0)); // disable resending of packets
+  Config::SetDefault ("ns3::SyncClient::RecvTimeout", TimeValue (Seconds (0))); // disable resending of packets
   Config::SetDefault ("ns3::SyncClient::ClientDescription", StringValue ("ns-3 client"));
   Config::SetDefault ("ns3::SyncClient::ServerAddress", Ipv4AddressValue("10.0.0.4"));
   Config::SetDefault ("ns3::SyncClient::ServerPort", UintegerValue(17543));
@@ -21,17 +21,28 @@
 
 
 #include "sync-client.h"
+#include "synchronization.h"
 #include "ns3/assert.h"
 #include "ns3/abort.h"
 #include "ns3/log.h"
 #include "ns3/uinteger.h"
 #include "ns3/string.h"
+#include "ns3/boolean.h"
+#include "ns3/nstime.h"
+#include "ns3/trace-source-accessor.h"
 
 #include <string.h>
 #include <stdio.h>
 #include <cstring>
 #include <errno.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 NS_LOG_COMPONENT_DEFINE ("SyncClient");
 
@@ -47,7 +58,7 @@ SyncClient::GetTypeId (void)
     .SetParent<Object> ()
     .AddConstructor<SyncClient> ()
     .AddAttribute ("ClientAddress",
-                   "The address on which the client listens for sync data",
+                   "The address on which the client listens for sync data (a multicast group is joined)",
                    Ipv4AddressValue ("0.0.0.0"),
                    MakeIpv4AddressAccessor (&SyncClient::m_clientAddress),
                    MakeIpv4AddressChecker ())
@@ -77,10 +88,57 @@ SyncClient::GetTypeId (void)
                    MakeStringAccessor (&SyncClient::m_clientDescription),
                    MakeStringChecker ())
     .AddAttribute ("RecvTimeout",
-                   "The number of seconds after which the finish packets shall be resent if no run permission is received. 0 means don't resend.",
-                   UintegerValue (0),
-                   MakeUintegerAccessor (&SyncClient::m_recvTimeout),
-                   MakeUintegerChecker<uint16_t> ())
+                   "The time after which the last packet is resent if no run permission is received, until the "
+                   "round trip time to the server has been measured (see AdaptiveTimeout). 0 means don't resend.",
+                   TimeValue (MilliSeconds (10)),
+                   MakeTimeAccessor (&SyncClient::m_recvTimeout),
+                   MakeTimeChecker ())
+    .AddAttribute ("AdaptiveTimeout",
+                   "Derive the resend timeout from the measured time between sending a packet and receiving "
+                   "the next run permission (smoothed round trip time plus four times its variation).",
+                   BooleanValue (true),
+                   MakeBooleanAccessor (&SyncClient::m_adaptiveTimeout),
+                   MakeBooleanChecker ())
+    .AddAttribute ("MinRecvTimeout",
+                   "The lower bound of the adaptive resend timeout.",
+                   TimeValue (MicroSeconds (100)),
+                   MakeTimeAccessor (&SyncClient::m_minRecvTimeout),
+                   MakeTimeChecker ())
+    .AddAttribute ("MaxRecvTimeout",
+                   "The upper bound of the resend timeout, which is doubled with every resend of the same packet.",
+                   TimeValue (Seconds (1)),
+                   MakeTimeAccessor (&SyncClient::m_maxRecvTimeout),
+                   MakeTimeChecker ())
+    .AddAttribute ("SharedMemory",
+                   "Ask the server to use its shared memory page instead of UDP (only if it runs on the same host).",
+                   BooleanValue (false),
+                   MakeBooleanAccessor (&SyncClient::m_sharedMemory),
+                   MakeBooleanChecker ())
+    .AddAttribute ("SpinTime",
+                   "Poll for the run permission without blocking for this long before sleeping until it arrives "
+                   "(burns a core, but saves the wake-up latency of the scheduler). 0 means don't spin.",
+                   TimeValue (Seconds (0)),
+                   MakeTimeAccessor (&SyncClient::m_spinTime),
+                   MakeTimeChecker ())
+    .AddAttribute ("BusyPoll",
+                   "Let the kernel busy poll the network device for this long in blocking receives on the sync "
+                   "socket (SO_BUSY_POLL, values above net.core.busy_read need CAP_NET_ADMIN). 0 means don't.",
+                   TimeValue (Seconds (0)),
+                   MakeTimeAccessor (&SyncClient::m_busyPoll),
+                   MakeTimeChecker ())
+    .AddAttribute ("ProtocolVersion",
+                   "The version of the wire format the client sends (1 for servers that do not know version 2).",
+                   UintegerValue (SW_VERSION),
+                   MakeUintegerAccessor (&SyncClient::m_protocolVersion),
+                   MakeUintegerChecker<uint8_t> (1, SW_VERSION))
+    .AddTraceSource ("Retransmission",
+                     "A packet was resent to the server (the period id and the timeout that expired, "
+                     "0 if the server repeated the run permission of a finished period).",
+                     MakeTraceSourceAccessor (&SyncClient::m_retransmissionTrace))
+    .AddTraceSource ("WakeupLatency",
+                     "The time between the arrival of a run permission at the socket (kernel timestamp) "
+                     "and its handling by the client.",
+                     MakeTraceSourceAccessor (&SyncClient::m_wakeupLatencyTrace))
     ;
   return tid;
 }
@@ -93,32 +151,31 @@ SyncClient::SyncClient ()
   m_seqNr = 0;
   m_periodId = 0;
   m_lastPacket = NULL;
+  m_lastPacketLen = 0;
+  m_waiting = false;
+  m_waitTime = 0;
+  m_rto = 0;
+  m_srtt = 0;
+  m_rttvar = 0;
+  m_rttPending = false;
+  m_resent = 0;
+  m_recvStamped = false;
+  m_shmHeader = NULL;
+  m_shmSlot = NULL;
+  m_shmLen = 0;
   
   // create buffers for packets so they don't have to be malloced each time
-  m_regPacket_len = sizeof (SyncCom::SyncPacket) + sizeof (SyncCom::RegisterClient);
-  m_regPacket = (struct SyncCom::SyncPacket*) malloc (m_regPacket_len);
+  // (a datagram never gets bigger than SW_MAX_DATAGRAM, whatever version is used)
+  m_regPacket_len = 0;
+  m_regPacket = (uint8_t*) malloc (SW_MAX_DATAGRAM);
   NS_ABORT_MSG_IF(m_regPacket == NULL, "SyncClient::SyncClient(): malloc failed");
-  m_regPacket->packetType = SyncCom::PACKETTYPE_REGISTER;
-  m_regPacket_data = (SyncCom::RegisterClient*)&(m_regPacket->data);
-  m_unregPacket_len = sizeof (SyncCom::SyncPacket) + sizeof (SyncCom::UnregisterClient);
-  m_unregPacket = (struct SyncCom::SyncPacket*) malloc (m_unregPacket_len);
+  m_unregPacket_len = 0;
+  m_unregPacket = (uint8_t*) malloc (SW_MAX_DATAGRAM);
   NS_ABORT_MSG_IF(m_unregPacket == NULL, "SyncClient::SyncClient(): malloc failed");
-  m_unregPacket->packetType = SyncCom::PACKETTYPE_UNREGISTER;
-  m_unregPacket_data = (SyncCom::UnregisterClient*)&(m_unregPacket->data);
-  m_finishedPacket_len = sizeof (SyncCom::SyncPacket) + sizeof (SyncCom::Finished);
-  m_finishedPacket = (struct SyncCom::SyncPacket*) malloc (m_finishedPacket_len);
+  m_finishedPacket = (uint8_t*) malloc (SW_MAX_DATAGRAM);
   NS_ABORT_MSG_IF(m_finishedPacket == NULL, "SyncClient::SyncClient(): malloc failed");
-  m_finishedPacket->packetType = SyncCom::PACKETTYPE_FINISHED;
-  m_finishedPacket_data = (struct SyncCom::Finished*)&(m_finishedPacket->data);
-
-  // create buffer for runperm-packet with maximum packet size
-  // (the buffer has the biggest size of all four packet types, 
-  //  in case some other type of packet is received (which should not happen))
-  m_runpermPacket_real_len = sizeof (SyncCom::SyncPacket) + sizeof (SyncCom::RunPermission);
-  m_runpermPacket_recv_len = MAX4(m_regPacket_len, m_unregPacket_len, m_runpermPacket_real_len, m_finishedPacket_len);
-  m_runpermPacket = (struct SyncCom::SyncPacket*) malloc (m_runpermPacket_recv_len);
-  NS_ABORT_MSG_IF(m_runpermPacket == NULL, "SyncClient::SyncClient(): malloc failed");
-  m_runpermPacket_data = (struct SyncCom::RunPermission*)&(m_runpermPacket->data);
+  m_recvPacket = (uint8_t*) malloc (SW_MAX_DATAGRAM);
+  NS_ABORT_MSG_IF(m_recvPacket == NULL, "SyncClient::SyncClient(): malloc failed");
 }
 
 SyncClient::~SyncClient ()
@@ -128,7 +185,7 @@ SyncClient::~SyncClient ()
   // free the packet memory
   free(m_regPacket);
   free(m_unregPacket);
-  free(m_runpermPacket);
+  free(m_recvPacket);
   free(m_finishedPacket);
 }
 
@@ -155,18 +212,74 @@ void SyncClient::ConnectAndSendRegister ()
 
     int bound = bind (m_sock, (struct sockaddr *)&sa, sizeof (struct sockaddr));
     NS_ABORT_MSG_IF(bound < 0, "SyncClient::ConnectAndSendRegister(): Could not bind socket!");
+
+    // let the kernel timestamp the received packets to measure the wake-up latency
+    int stamped = setsockopt(m_sock, SOL_SOCKET, SO_TIMESTAMPNS, &val_on, sizeof(val_on));
+    if (stamped != 0)
+      NS_LOG_WARN("SyncClient::ConnectAndSendRegister(): Could not enable receive timestamps, no WakeupLatency");
+
+    if (m_busyPoll.IsStrictlyPositive ())
+      {
+#ifdef SO_BUSY_POLL
+        int busyPoll = m_busyPoll.GetMicroSeconds ();
+        int polling = setsockopt(m_sock, SOL_SOCKET, SO_BUSY_POLL, &busyPoll, sizeof(busyPoll));
+        if (polling != 0)
+          NS_LOG_WARN("SyncClient::ConnectAndSendRegister(): Could not enable busy polling (" << strerror(errno) << ")");
+#else
+        NS_LOG_WARN("SyncClient::ConnectAndSendRegister(): Busy polling is not supported on this system");
+#endif
+      }
+
+    // if the server sends its run permissions to a multicast group, join it
+    if (m_clientAddress.IsMulticast ())
+      {
+        struct ip_mreq mreq;
+        mreq.imr_multiaddr.s_addr = htonl(m_clientAddress.Get ());
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        int joined = setsockopt(m_sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+        NS_ABORT_MSG_IF(joined != 0, "SyncClient::ConnectAndSendRegister(): Could not join multicast group!");
+      }
   }
 
   // init struct for sending
   m_dest.sin_family = AF_INET;
   m_dest.sin_port = htons(m_serverPort);
   m_dest.sin_addr.s_addr = htonl(m_serverAddress.Get ());
+  m_resent = 0;
+  m_srtt = 0;
+  m_rto = m_recvTimeout.GetNanoSeconds ();
 
-  NS_LOG_LOGIC("Sending register packet to sync server");
+  NS_LOG_LOGIC("Sending register packet to sync server (version " << (int) m_protocolVersion << ")");
   // send register packet
-  m_regPacket_data->clientID = htons(m_clientId);
-  m_regPacket_data->clientType = SyncCom::CLIENT_TYPE_REMOTE_SIMULATION;
-  snprintf(m_regPacket_data->client_Description, SyncCom::CLIENT_DESCR_LENGTH, "%s", m_clientDescription.c_str());
+  if (m_protocolVersion == SW_VERSION)
+    {
+      size_t descriptionLength = m_clientDescription.size () < CLIENT_DESCR_LENGTH - 1 ? m_clientDescription.size () : CLIENT_DESCR_LENGTH - 1;
+      sw_begin (m_regPacket, 0);
+      SW_Register *reg = (SW_Register*) sw_add (m_regPacket, SW_MSG_REGISTER, sizeof (SW_Register) + descriptionLength);
+      reg->clientId = htons(m_clientId);
+      reg->clientType = CLIENT_TYPE_REMOTE_SIMULATION;
+      // ask for the shared memory transport, the server answers with a grant
+      reg->flags = m_sharedMemory ? SW_REGISTER_SHM : 0;
+      memcpy (reg->description, m_clientDescription.c_str (), descriptionLength);
+      m_regPacket_len = sw_size (m_regPacket);
+    }
+  else
+    {
+      COM_SyncPacket *packet = (COM_SyncPacket*) m_regPacket;
+      COM_RegisterClient *reg = (COM_RegisterClient*) &(packet->data);
+      packet->packetType = PACKETTYPE_REGISTER;
+      reg->clientID = htons(m_clientId);
+      reg->clientType = CLIENT_TYPE_REMOTE_SIMULATION;
+      snprintf(reg->client_Description, CLIENT_DESCR_LENGTH, "%s", m_clientDescription.c_str());
+      m_regPacket_len = sizeof (COM_SyncPacket) + sizeof (COM_RegisterClient);
+      if (m_sharedMemory)
+        {
+          // ask for the shared memory transport, the server answers with a grant
+          COM_ShmRequest *request = (COM_ShmRequest*)(packet->data + sizeof (COM_RegisterClient));
+          request->magic = htonl(SHM_MAGIC);
+          m_regPacket_len += sizeof (COM_ShmRequest);
+        }
+    }
   SendPacket(m_regPacket, m_regPacket_len);
 }
 
@@ -178,8 +291,23 @@ void SyncClient::SendUnregAndDisconnect()
 
   NS_LOG_LOGIC("Sending unregister packet to sync server");
   // send unregister packet
-  m_unregPacket_data->clientID = htons(m_clientId);
-  m_unregPacket_data->reason = SyncCom::UNREGISTER_REASON_REGULAR;
+  if (m_protocolVersion == SW_VERSION)
+    {
+      sw_begin (m_unregPacket, 0);
+      SW_Unregister *ureg = (SW_Unregister*) sw_add (m_unregPacket, SW_MSG_UNREGISTER, sizeof (SW_Unregister));
+      ureg->clientId = htons(m_clientId);
+      ureg->reason = UNREGISTER_REASON_REGULAR;
+      m_unregPacket_len = sw_size (m_unregPacket);
+    }
+  else
+    {
+      COM_SyncPacket *packet = (COM_SyncPacket*) m_unregPacket;
+      COM_UnregisterClient *ureg = (COM_UnregisterClient*) &(packet->data);
+      packet->packetType = PACKETTYPE_UNREGISTER;
+      ureg->clientID = htons(m_clientId);
+      ureg->reason = UNREGISTER_REASON_REGULAR;
+      m_unregPacket_len = sizeof (COM_SyncPacket) + sizeof (COM_UnregisterClient);
+    }
   SendPacket(m_unregPacket, m_unregPacket_len);
 
   NS_LOG_LOGIC("Closing the socket used for synchronization");
@@ -188,19 +316,86 @@ void SyncClient::SendUnregAndDisconnect()
   m_sock = -1;
   m_seqNr = 0;
   m_periodId = 0;
+
+  if (m_shmHeader != NULL)
+    {
+      munmap(m_shmHeader, m_shmLen);
+      m_shmHeader = NULL;
+      m_shmSlot = NULL;
+    }
 }
 
 void SyncClient::SendFinished (uint32_t runTime, uint32_t realTime)
 {
   NS_LOG_FUNCTION (runTime << realTime);
 
-  // construct and send finished packet
+  if (m_shmSlot != NULL)
+    {
+      SendFinishedShm (runTime, realTime, 0, 0, 0);
+      return;
+    }
+
   NS_LOG_LOGIC("Sending Finished packet (periodid = " << m_periodId << ")");
-  m_finishedPacket_data->clientId = htons(m_clientId);
-  m_finishedPacket_data->periodId = htonl(m_periodId);
-  m_finishedPacket_data->runTime = htonl(runTime);
-  m_finishedPacket_data->realTime = htonl(realTime);
-  SendPacket(m_finishedPacket, m_finishedPacket_len);
+  SendFinishedUdp (runTime, realTime, 0, 0, false);
+}
+
+void SyncClient::SendFinished (uint32_t runTime, uint32_t realTime, uint32_t nextEvent, uint32_t lookahead)
+{
+  NS_LOG_FUNCTION (runTime << realTime << nextEvent << lookahead);
+
+  if (m_shmSlot != NULL)
+    {
+      SendFinishedShm (runTime, realTime, nextEvent, lookahead, SHM_FINISHED_NEXTEVENT);
+      return;
+    }
+
+  NS_LOG_LOGIC("Sending Finished packet (periodid = " << m_periodId << ", next event in " << nextEvent << "us)");
+  SendFinishedUdp (runTime, realTime, nextEvent, lookahead, true);
+}
+
+void SyncClient::SendFinishedUdp (uint32_t runTime, uint32_t realTime, uint32_t nextEvent, uint32_t lookahead, bool announce)
+{
+  size_t len;
+  if (m_protocolVersion == SW_VERSION)
+    {
+      // the next event and the statistics travel in the same datagram
+      sw_begin (m_finishedPacket, 0);
+      SW_Finished *fin = (SW_Finished*) sw_add (m_finishedPacket, SW_MSG_FINISHED, sizeof (SW_Finished));
+      fin->periodId = htonl(m_periodId);
+      fin->runTime = htonl(runTime);
+      fin->realTime = htonl(realTime);
+      fin->clientId = htons(m_clientId);
+      if (announce)
+        {
+          SW_NextEvent *next = (SW_NextEvent*) sw_add (m_finishedPacket, SW_MSG_NEXTEVENT, sizeof (SW_NextEvent));
+          next->nextEvent = htonl(nextEvent);
+          next->lookahead = htonl(lookahead);
+        }
+      SW_ClientStats *stats = (SW_ClientStats*) sw_add (m_finishedPacket, SW_MSG_CLIENTSTATS, sizeof (SW_ClientStats));
+      stats->waitTime = htonl(m_waitTime);
+      stats->resent = htonl(m_resent);
+      len = sw_size (m_finishedPacket);
+    }
+  else
+    {
+      // the next event is appended to the finished struct (same packet type, longer payload)
+      COM_SyncPacket *packet = (COM_SyncPacket*) m_finishedPacket;
+      COM_Finished *fin = (COM_Finished*) &(packet->data);
+      packet->packetType = PACKETTYPE_FINISHED;
+      fin->clientId = htons(m_clientId);
+      fin->periodId = htonl(m_periodId);
+      fin->runTime = htonl(runTime);
+      fin->realTime = htonl(realTime);
+      len = sizeof (COM_SyncPacket) + sizeof (COM_Finished);
+      if (announce)
+        {
+          COM_NextEvent *next = (COM_NextEvent*)(packet->data + sizeof (COM_Finished));
+          next->nextEvent = htonl(nextEvent);
+          next->lookahead = htonl(lookahead);
+          len += sizeof (COM_NextEvent);
+        }
+    }
+  SendPacket(m_finishedPacket, len);
 }
 
 uint32_t SyncClient::WaitForRunPermission ()
@@ -209,7 +404,214 @@ uint32_t SyncClient::WaitForRunPermission ()
 
   NS_ASSERT_MSG (m_sock >= 0, "SyncClient::WaitForRunPermission(): Socket is not connected!");
 
-  if (m_recvTimeout == 0) // don't resend packets
+  // the time spent waiting is reported with the next finished packet
+  StartWaiting ();
+  uint32_t runTime = ReceiveRunPermission ();
+  StopWaiting ();
+  return runTime;
+}
+
+bool SyncClient::TryGetRunPermission (uint32_t &runTime)
+{
+  NS_LOG_FUNCTION_NOARGS ();
+
+  NS_ASSERT_MSG (m_sock >= 0, "SyncClient::TryGetRunPermission(): Socket is not connected!");
+
+  if (!m_waiting)
+    StartWaiting ();
+
+  if (!PollRunPermission (runTime))
+    return false;
+  StopWaiting ();
+  return true;
+}
+
+bool SyncClient::PollRunPermission (uint32_t &runTime)
+{
+  if (m_shmHeader != NULL)
+    return CheckRunPermissionShm (runTime);
+
+  // handle everything that has arrived so far
+  for (;;)
+    {
+      int bytes_received = ReceivePacket (MSG_DONTWAIT);
+      if (bytes_received < 0)
+        {
+          NS_ABORT_MSG_IF(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR,
+                          "SyncClient::TryGetRunPermission(): Could not read from sync socket!");
+          if (errno != EINTR)
+            break;
+          continue;
+        }
+      NS_LOG_LOGIC("Received something");
+
+      if (HandlePacket (bytes_received, runTime)
+          || (m_shmHeader != NULL && CheckRunPermissionShm (runTime)))
+        return true;
+    }
+
+  // resend the last packet if its answer is overdue
+  if (GetTimeToResend () == 0)
+    ResendOnTimeout ();
+  return false;
+}
+
+bool SyncClient::SpinForRunPermission (uint32_t &runTime)
+{
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  do
+    {
+      if (PollRunPermission (runTime))
+        return true;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+    }
+  while ((int64_t)(now.tv_sec - start.tv_sec) * 1000000000LL + (now.tv_nsec - start.tv_nsec) < m_spinTime.GetNanoSeconds ());
+  return false;
+}
+
+int SyncClient::ReceivePacket (int flags)
+{
+  // the kernel timestamp of the packet comes as control message
+  char control[CMSG_SPACE(sizeof (struct timespec))];
+  struct iovec iov;
+  iov.iov_base = m_recvPacket;
+  iov.iov_len = SW_MAX_DATAGRAM;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof (msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof (control);
+
+  int bytes_received = recvmsg(m_sock, &msg, flags);
+  m_recvStamped = false;
+  if (bytes_received < 0)
+    return bytes_received;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+        {
+          memcpy(&m_recvStamp, CMSG_DATA(cmsg), sizeof (m_recvStamp));
+          m_recvStamped = true;
+        }
+    }
+  return bytes_received;
+}
+
+Time SyncClient::GetSpinTime () const
+{
+  return m_spinTime;
+}
+
+int SyncClient::GetFd () const
+{
+  return m_shmHeader != NULL ? -1 : m_sock;
+}
+
+Time SyncClient::GetPollTimeout () const
+{
+  int64_t left = GetTimeToResend ();
+  return left < 0 ? Time (-1) : NanoSeconds (left);
+}
+
+uint32_t SyncClient::GetRetransmissions () const
+{
+  return m_resent;
+}
+
+int64_t SyncClient::GetTimeToResend () const
+{
+  if (m_rto == 0 || m_lastPacket == NULL || m_shmHeader != NULL)
+    return -1;
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  int64_t left = m_rto - ((int64_t)(now.tv_sec - m_lastSent.tv_sec) * 1000000000LL + (now.tv_nsec - m_lastSent.tv_nsec));
+  return left > 0 ? left : 0;
+}
+
+void SyncClient::ResendOnTimeout ()
+{
+  NS_LOG_LOGIC("Timeout of " << m_rto / 1000 << "us occured while waiting for run permission, resending last packet");
+  m_retransmissionTrace (m_periodId, NanoSeconds (m_rto));
+  ResendLastPacket ();
+
+  // back off until the next run permission arrives
+  m_rto *= 2;
+  if (m_rto > m_maxRecvTimeout.GetNanoSeconds ())
+    m_rto = m_maxRecvTimeout.GetNanoSeconds ();
+}
+
+void SyncClient::UpdateTimeout ()
+{
+  if (m_recvTimeout.IsZero ())
+    {
+      m_rto = 0;
+      return;
+    }
+
+  // only packets that were not resent give an unambiguous sample (Karn's algorithm)
+  if (m_adaptiveTimeout && m_rttPending)
+    {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      int64_t rtt = (int64_t)(now.tv_sec - m_lastSent.tv_sec) * 1000000000LL + (now.tv_nsec - m_lastSent.tv_nsec);
+
+      // smoothed round trip time and its variation as in RFC 6298
+      if (m_srtt == 0)
+        {
+          m_srtt = rtt;
+          m_rttvar = rtt / 2;
+        }
+      else
+        {
+          int64_t delta = m_srtt > rtt ? m_srtt - rtt : rtt - m_srtt;
+          m_rttvar = (3 * m_rttvar + delta) / 4;
+          m_srtt = (7 * m_srtt + rtt) / 8;
+        }
+    }
+  m_rttPending = false;
+
+  if (!m_adaptiveTimeout || m_srtt == 0)
+    {
+      m_rto = m_recvTimeout.GetNanoSeconds ();
+      return;
+    }
+  m_rto = m_srtt + 4 * m_rttvar;
+  if (m_rto < m_minRecvTimeout.GetNanoSeconds ())
+    m_rto = m_minRecvTimeout.GetNanoSeconds ();
+  if (m_rto > m_maxRecvTimeout.GetNanoSeconds ())
+    m_rto = m_maxRecvTimeout.GetNanoSeconds ();
+}
+
+void SyncClient::StartWaiting ()
+{
+  m_waiting = true;
+  clock_gettime(CLOCK_MONOTONIC, &m_waitStart);
+}
+
+void SyncClient::StopWaiting ()
+{
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  int64_t waited = (int64_t)(end.tv_sec - m_waitStart.tv_sec) * 1000000 + (end.tv_nsec - m_waitStart.tv_nsec) / 1000;
+  m_waitTime = waited > UINT_MAX ? UINT_MAX : (uint32_t) waited;
+  m_waiting = false;
+}
+
+uint32_t SyncClient::ReceiveRunPermission ()
+{
+  uint32_t runTime;
+
+  // the run permission of a short timeslice often arrives before the spin time is over
+  if (m_spinTime.IsStrictlyPositive () && SpinForRunPermission (runTime))
+    return runTime;
+
+  if (m_shmHeader != NULL)
+    return WaitForRunPermissionShm ();
+
+  if (m_rto == 0) // don't resend packets
     {
     // go into infite loop and wait for runpermission packet
     for(;;)
@@ -217,31 +619,13 @@ uint32_t SyncClient::WaitForRunPermission ()
       NS_LOG_LOGIC("Waiting for run permission packet");
  
       // receive data
-      int bytes_received = recvfrom(m_sock, m_runpermPacket, m_runpermPacket_recv_len, 0, NULL, 0);
+      int bytes_received = ReceivePacket (0);
       NS_LOG_LOGIC("Received something");
 
-      if (bytes_received == m_runpermPacket_real_len)
-        {
-        if (m_runpermPacket->packetType == SyncCom::PACKETTYPE_RUNPERMISSION)
-          {
-          uint32_t runTime = ntohl(m_runpermPacket_data->runTime);
-          uint32_t recvPeriodId = ntohl(m_runpermPacket_data->periodId);
- 
-          // run permissions may be resent, so we have to check that we received a fresh packet
-          if(recvPeriodId > m_periodId)
-            {
-            NS_LOG_LOGIC("Got run permission (runTime = " << runTime << ", periodId = " << recvPeriodId << ")");
-            m_periodId = recvPeriodId;
-            return runTime;
-            }
-          else
-            NS_LOG_LOGIC("Got an old run permission again, ignoring ...");
-          }
-         else
-          NS_LOG_LOGIC("Wrong packet type (!= run permission), ignoring ...");
-        }
-      else
-        NS_LOG_LOGIC("Wrong packet length for run permission, ignoring ...");
+      if (HandlePacket (bytes_received, runTime))
+        return runTime;
+      if (m_shmHeader != NULL)
+        return WaitForRunPermissionShm ();
       }
     }
   else // resend packets after timeout
@@ -251,10 +635,12 @@ uint32_t SyncClient::WaitForRunPermission ()
       {
       NS_LOG_LOGIC("Waiting for run permission packet");
  
-      // use select to have a timeout if no data arrives
+      // use select to have a timeout if no data arrives (the rest of the resend timeout, 
+      // rounded up to microseconds)
+      int64_t left = GetTimeToResend ();
       struct timeval timeout;
-      timeout.tv_sec = m_recvTimeout;
-      timeout.tv_usec = 0;
+      timeout.tv_sec = left / 1000000000LL;
+      timeout.tv_usec = (left % 1000000000LL + 999) / 1000;
       fd_set readfds;
       FD_ZERO(&readfds);
       FD_SET(m_sock, &readfds);
@@ -264,44 +650,115 @@ uint32_t SyncClient::WaitForRunPermission ()
       // if nothing changed, we had an timeout and have to retransmit the last packet
       if(select_val == 0)
         {
-        NS_LOG_LOGIC("Timeout occured while waiting for run permission, resending last packet");
-        int bytes_sent = sendto(m_sock, m_lastPacket, m_lastPacketLen, 0, (struct sockaddr*)&m_dest, sizeof (m_dest));
-        NS_ABORT_MSG_IF(bytes_sent == -1, "SyncClient::WaitForRunPermsission(): Could not send synchronization packet!");
+        ResendOnTimeout ();
         }
       // otherwise, we received some data
       else
         {
         NS_LOG_LOGIC("Received something");
-        int bytes_received = recvfrom(m_sock, m_runpermPacket, m_runpermPacket_recv_len, 0, NULL, 0);
+        int bytes_received = ReceivePacket (0);
  
-        if (bytes_received == m_runpermPacket_real_len)
-          {
-          if (m_runpermPacket->packetType == SyncCom::PACKETTYPE_RUNPERMISSION)
+        if (HandlePacket (bytes_received, runTime))
+          return runTime;
+        if (m_shmHeader != NULL)
+          return WaitForRunPermissionShm ();
+        }
+      }
+    }
+}
+
+bool SyncClient::HandlePacket (int len, uint32_t &runTime)
+{
+  uint32_t recvPeriodId = 0;
+  bool isRunPermission = false;
+  COM_SyncPacket *packet = (COM_SyncPacket*) m_recvPacket;
+
+  // the server sends version 1 run permissions while it has version 1 clients
+  if (len > 0 && sw_valid (m_recvPacket, len))
+    {
+      for (const SW_Tlv *tlv = sw_next (m_recvPacket, NULL); tlv != NULL; tlv = sw_next (m_recvPacket, tlv))
+        {
+          if (tlv->type == SW_MSG_RUNPERMISSION && sw_length (tlv) >= sizeof (SW_RunPermission))
             {
-            uint32_t runTime = ntohl(m_runpermPacket_data->runTime);
-            uint32_t recvPeriodId = ntohl(m_runpermPacket_data->periodId);
- 
-            // run permissions may be resent, so we have to check that we received a fresh packet
-            if(recvPeriodId > m_periodId)
-              {
-              NS_LOG_LOGIC("Got run permission (runTime = " << runTime << ", periodId = " << recvPeriodId << ")");
-              m_periodId = recvPeriodId;
-              return runTime;
-              }
-            else
-              NS_LOG_LOGIC("Got an old run permission again, ignoring ...");
+              const SW_RunPermission *rp = (const SW_RunPermission*) sw_value (tlv);
+              runTime = ntohl(rp->runTime);
+              recvPeriodId = ntohl(rp->periodId);
+              isRunPermission = true;
+            }
+          else if (tlv->type == SW_MSG_SHMGRANT && sw_length (tlv) >= sizeof (SW_ShmGrant))
+            {
+              const SW_ShmGrant *grant = (const SW_ShmGrant*) sw_value (tlv);
+              char name[SHM_NAME_LENGTH];
+              size_t nameLength = sw_length (tlv) - sizeof (SW_ShmGrant);
+              if (nameLength > SHM_NAME_LENGTH - 1)
+                nameLength = SHM_NAME_LENGTH - 1;
+              memcpy (name, grant->shmName, nameLength);
+              name[nameLength] = 0;
+              AttachSharedMemory (name, ntohs(grant->slot));
+              return false;
             }
-           else
-            NS_LOG_LOGIC("Wrong packet type (!= run permission), ignoring ...");
-          }
-        else
-          NS_LOG_LOGIC("Wrong packet length for run permission, ignoring ...");
         }
-      }
     }
+  else if (len == sizeof (COM_SyncPacket) + sizeof (COM_ShmGrant) && packet->packetType == PACKETTYPE_SHMGRANT)
+    {
+      COM_ShmGrant *grant = (COM_ShmGrant*) &(packet->data);
+      char name[SHM_NAME_LENGTH];
+      snprintf(name, SHM_NAME_LENGTH, "%s", grant->shmName);
+      AttachSharedMemory (name, ntohs(grant->slot));
+      return false;
+    }
+  else if (len == sizeof (COM_SyncPacket) + sizeof (COM_RunPermission) && packet->packetType == PACKETTYPE_RUNPERMISSION)
+    {
+      COM_RunPermission *rp = (COM_RunPermission*) &(packet->data);
+      runTime = ntohl(rp->runTime);
+      recvPeriodId = ntohl(rp->periodId);
+      isRunPermission = true;
+    }
+
+  if (!isRunPermission)
+    {
+      NS_LOG_LOGIC("No run permission, ignoring ...");
+      return false;
+    }
+
+  // run permissions may be resent, so we have to check that we received a fresh packet
+  if(recvPeriodId > m_periodId)
+    {
+      NS_LOG_LOGIC("Got run permission (runTime = " << runTime << ", periodId = " << recvPeriodId << ")");
+      m_periodId = recvPeriodId;
+      UpdateTimeout ();
+      if (m_recvStamped)
+        {
+          struct timespec now;
+          clock_gettime(CLOCK_REALTIME, &now);
+          m_wakeupLatencyTrace (NanoSeconds ((int64_t)(now.tv_sec - m_recvStamp.tv_sec) * 1000000000LL
+                                             + (now.tv_nsec - m_recvStamp.tv_nsec)));
+        }
+      return true;
+    }
+  else if (recvPeriodId == m_periodId && m_lastPacket == m_finishedPacket)
+    {
+      // the server resends the run permission of a period it is still waiting for,
+      // so our finished packet got lost
+      NS_LOG_LOGIC("Got the run permission of the finished period again, resending finished packet");
+      m_retransmissionTrace (m_periodId, Time (0));
+      ResendLastPacket ();
+    }
+  else
+    NS_LOG_LOGIC("Got an old run permission again, ignoring ...");
+  return false;
+}
+
+void SyncClient::ResendLastPacket ()
+{
+  int bytes_sent = sendto(m_sock, m_lastPacket, m_lastPacketLen, 0, (struct sockaddr*)&m_dest, sizeof (m_dest));
+  NS_ABORT_MSG_IF(bytes_sent == -1, "SyncClient::WaitForRunPermsission(): Could not send synchronization packet!");
+  clock_gettime(CLOCK_MONOTONIC, &m_lastSent);
+  m_rttPending = false;
+  m_resent++;
 }
 
-void SyncClient::SendPacket (struct SyncCom::SyncPacket *packet, size_t len)
+void SyncClient::SendPacket (uint8_t *packet, size_t len)
 {
   NS_LOG_FUNCTION (packet << len);
 
@@ -309,7 +766,10 @@ void SyncClient::SendPacket (struct SyncCom::SyncPacket *packet, size_t len)
 
   // increase the sequence number and write it to the packet
   m_seqNr++;
-  packet->seqNr = htonl(m_seqNr);
+  if (m_protocolVersion == SW_VERSION)
+    sw_setSeqNr (packet, m_seqNr);
+  else
+    ((COM_SyncPacket*) packet)->seqNr = htonl(m_seqNr);
 
   // send packet
   int bytes_sent = sendto(m_sock, packet, len, 0, (struct sockaddr*)&m_dest, sizeof (m_dest));
@@ -319,6 +779,82 @@ void SyncClient::SendPacket (struct SyncCom::SyncPacket *packet, size_t len)
   // save pointer to this packet
   m_lastPacket = packet;
   m_lastPacketLen = len;
+  clock_gettime(CLOCK_MONOTONIC, &m_lastSent);
+  m_rttPending = true;
+}
+
+void SyncClient::AttachSharedMemory (const char *name, uint16_t slot)
+{
+  NS_LOG_FUNCTION (name << slot);
+
+  NS_LOG_LOGIC("Server granted slot " << slot << " in shared memory " << name);
+
+  int fd = shm_open(name, O_RDWR, 0);
+  NS_ABORT_MSG_IF(fd < 0, "SyncClient::AttachSharedMemory(): Could not open shared memory " << name << "!");
+  m_shmLen = sizeof (COM_ShmHeader) + (slot + 1) * sizeof (COM_ShmSlot);
+  void *page = mmap(NULL, m_shmLen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  NS_ABORT_MSG_IF(page == MAP_FAILED, "SyncClient::AttachSharedMemory(): Could not map shared memory!");
+
+  m_shmHeader = (struct COM_ShmHeader*) page;
+  NS_ABORT_MSG_IF(m_shmHeader->magic != SHM_MAGIC || slot >= m_shmHeader->slots,
+                  "SyncClient::AttachSharedMemory(): Invalid shared memory page!");
+  m_shmSlot = (struct COM_ShmSlot*)((uint8_t*) page + sizeof (COM_ShmHeader)) + slot;
+}
+
+uint32_t SyncClient::WaitForRunPermissionShm ()
+{
+  NS_LOG_FUNCTION_NOARGS ();
+
+  for(;;)
+    {
+      uint32_t seq = *(volatile uint32_t*)&m_shmHeader->runSeq;
+      uint32_t runTime;
+      if (CheckRunPermissionShm (runTime))
+        return runTime;
+
+      // sleep until runSeq changes
+      syscall(SYS_futex, &m_shmHeader->runSeq, FUTEX_WAIT, seq, NULL, NULL, 0);
+    }
+}
+
+bool SyncClient::CheckRunPermissionShm (uint32_t &runTime)
+{
+  // read the run permission between two reads of runSeq; an odd runSeq means that the server
+  // is writing a new one, which is picked up once runSeq changes again
+  uint32_t seq = *(volatile uint32_t*)&m_shmHeader->runSeq;
+  if (seq & 1)
+    return false;
+  __sync_synchronize();
+  uint32_t recvPeriodId = *(volatile uint32_t*)&m_shmHeader->periodId;
+  runTime = *(volatile uint32_t*)&m_shmHeader->runTime;
+  __sync_synchronize();
+
+  if (seq == *(volatile uint32_t*)&m_shmHeader->runSeq && recvPeriodId > m_periodId)
+    {
+      NS_LOG_LOGIC("Got run permission (runTime = " << runTime << ", periodId = " << recvPeriodId << ")");
+      m_periodId = recvPeriodId;
+      return true;
+    }
+  return false;
+}
+
+void SyncClient::SendFinishedShm (uint32_t runTime, uint32_t realTime, uint32_t nextEvent, uint32_t lookahead, uint32_t flags)
+{
+  NS_LOG_FUNCTION (runTime << realTime << nextEvent << lookahead);
+
+  NS_LOG_LOGIC("Reporting finished period " << m_periodId << " in shared memory");
+  m_shmSlot->runTime = runTime;
+  m_shmSlot->realTime = realTime;
+  m_shmSlot->nextEvent = nextEvent;
+  m_shmSlot->lookahead = lookahead;
+  m_shmSlot->flags = flags;
+  // the server takes the slot as soon as finishedPeriod is set
+  __sync_synchronize();
+  *(volatile uint32_t*)&m_shmSlot->finishedPeriod = m_periodId;
+
+  __sync_fetch_and_add(&m_shmHeader->doorbell, 1);
+  syscall(SYS_futex, &m_shmHeader->doorbell, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
 }
 
 
@@ -25,113 +25,19 @@
 #include "ns3/assert.h"
 #include "ns3/object.h"
 #include "ns3/ipv4-address.h"
+#include "ns3/nstime.h"
+#include "ns3/traced-callback.h"
 
 #include <arpa/inet.h>
 #include <stdint.h>
 #include <string>
 
 
-namespace ns3 {
-
-  #define MAX2(a, b) (((a) > (b)) ? (a) : (b))
-  #define MAX4(a, b, c, d) MAX2(MAX2(a,b),MAX2(c,d))
-
-  namespace SyncCom {
-    //following are the structs for communication between clients and servers
-
-    /*
-     * If a client registers at the server, the client registers himself
-     * with a unique client id
-     */
-
-    static const int CLIENT_TYPE_LOCAL_XDOMAIN = 0;
-    static const int CLIENT_TYPE_REMOTE_XDOMAIN = 1;
-    static const int CLIENT_TYPE_REMOTE_SIMULATION = 2;
-    static const int CLIENT_TYPE_TEST = 133;
-    static const int CLIENT_TYPE_OTHER = 254;
-    static const int CLIENT_TYPE_UNKNOWN = 255;
-
-    static const int CLIENT_DESCR_LENGTH = 100; //length of client description in byte
-
-    struct RegisterClient {
-
-      u_int16_t clientID; //the id of the client that wishes to register. must be unique!
-      u_int8_t clientType; // Type of client: 0 = locally managed Xen Client, 1 = remotely managed  Xen client, 2 = remote simulation client, 254 = other, 255 = unknown
-      char client_Description[CLIENT_DESCR_LENGTH]; //arbitrary client description.
-
-    };
-
-    /*
-     * unregisters a client from the synchronization server
-     *
-     */
-
-    static const int UNREGISTER_REASON_REGULAR = 0;
-    static const int UNREGISTER_REASON_OUT_OF_SYNC = 1;
-    static const int UNREGISTER_REASON_OTHER = 2;
-
-    struct UnregisterClient {
-
-    u_int16_t clientID; //the id of the client to unregisterâ
-    u_int8_t reason; //the reason why a client unregisters, shoudl correspond to constantââ
-  };
-
-  /*
-     * tell all clients that they're allowed to execute a certain amount of virtual time
-   *
-   * IMPLEMENTATION NOTE: - Distribute this to all remote systems with a UDP broadcast!
-   *  					- Afterwards, use subsequent hypercalls to notify local guest domains!
-   *
-   * NOTE: We probably need periodic retransmissions in order to compensate for lost udp-packets
-   * otherwise, the execution will hang in a deadlock! (server waits for clients to finish execution, one client waits
-   * for server to announce next period)â
-   */
-
-  struct RunPermission {
-
-    u_int32_t periodId; // used to identify the periods
-    u_int32_t runTime;  //the runtime (in microseconds) the clients are allowed to continue their execution  
-  };
-
-
-  /*
-   *  tell the server that a client has finished the execution of a provided period
-   *
-   *  IMPLEMENTATION NOTE: If transmitted over UDP, this information must be rebroadcasted periodically
-   *  in order to avoid deadlocking (if a finished packet gets lost)
-   */
-
-  struct Finished {
-     u_int32_t periodId; //the id of the period whose execution has been finished;
-     u_int32_t runTime; //the virtual runtime that was assigned in this period (microseconds)
-     u_int32_t realTime; //the time actually needed for executing this period (microseconds)=> useful for statistics!
-     u_int16_t clientId; // (clientId is the last field here, since it better like that in the xen kernel module)
-                         //    (this was changed consitently on 2009-06-04)
-  };
-
-  //definition of packet type ids (should correspond to introductionary comment above!)
-
-  static const int PACKETTYPE_REGISTER = 0; //used to register a client at a server - note: we could use tcp here als well
-  static const int PACKETTYPE_UNREGISTER = 1; //used to unregister a client - note: we could use tcp for this as well.
-  static const int PACKETTYPE_RUNPERMISSION = 2; //used to announce that the clients can continue with their execution. UDP-Broadcast
-  static const int PACKETTYPE_FINISHED = 3; //used by clients to announce they finished execution of a period. UDP-Unicast
-
-
-  /*
-   *  this packet specifies the structure of the UDP packets
-   *
-   */
-
-  struct SyncPacket {
-
-    u_int32_t seqNr; //a seqNr to distinguish the packets
-    u_int8_t  packetType; //contains packet type information
-    //u_int16_t length; //length of data
-    u_int8_t data[]; //should contain one of the Structs â
-
-  };
-} // namespace SyncCom
+// the protocol structs are defined in synchronization.h of the synchronizer
+struct COM_ShmHeader;
+struct COM_ShmSlot;
 
+namespace ns3 {
 
 /**
  * \brief Helper class for SyncSimulatorImpl which manages the connection to the synchronization server
@@ -144,19 +50,45 @@ namespace ns3 {
  * to the server and after the server received such a packet from all registered clients, it sends the next runpermission.
  * If a client wants to leave, it sends an unregister packet. For efficiency reasons all of that communcation takes place 
  * via udp, which means on the other side that packets might get lost. To accommodate that, the client resends the finish packet 
- * after some configurable time if it receives not run permission.
- * The detailed format of this protocol can be found in src/simulator/sync-client.h
+ * after some configurable time if it receives not run permission. It also resends it when the server resends the 
+ * run permission of the period that was already finished, as the server does so for clients it is still waiting for.
+ * The detailed format of this protocol can be found in synchronizer/synchronization.h, which is shared
+ * by the synchronizer, the other clients and this class.
  *
  * The configuration is done with the following attributes:
  * - \em ClientPort and \em ClientAddress sets the port and address to receive packets on. 
      This has to be the same (broadcast) address and port for all synchronization clients. 
      In order to allow multiple instances to listen on the same broadcast address and port 
      on the same machine, SO_REUSEADDR is used for the socket.
+     If the server sends its run permissions to a multicast group, \em ClientAddress is set to that
+     group and the client joins it. If the server sends them by unicast, \em ClientAddress is the 
+     address of the client itself (or 0.0.0.0).
  * - \em ServerPort and \em ServerAddress define how to reach the synchronization server
  * - \em ClientId is the id with which the client registers at the server
  * - \em ClientDescription is a name for the client (for debugging and logging in the server)
- * - \em RecvTimeout is the number of seconds after which the client shall resend a finish packet if no 
- *   runpermission is received. If \em RecvTimeout is 0, packets are not resent at all.
+ * - \em RecvTimeout is the time after which the client resends the last packet if no run permission 
+ *   is received. If \em RecvTimeout is 0, packets are not resent at all. With \em AdaptiveTimeout, 
+ *   \em RecvTimeout only applies until the client has measured the time between sending a packet and 
+ *   receiving the next run permission; from then on the timeout is the smoothed round trip time plus 
+ *   four times its variation, bounded by \em MinRecvTimeout and \em MaxRecvTimeout. Every resend of 
+ *   the same packet doubles the timeout (up to \em MaxRecvTimeout). Resends are counted 
+ *   (GetRetransmissions()) and reported by the \em Retransmission trace source.
+ * - \em SharedMemory asks the server to exchange run permissions and finished messages through a 
+ *   shared memory page instead of UDP. This only works if the server runs on the same host and 
+ *   has such a page (srv_shm_name), otherwise the client keeps using UDP.
+ * - \em SpinTime makes the client poll for the run permission without blocking for that long before 
+ *   it sleeps until the permission arrives, and \em BusyPoll lets the kernel busy poll the network device 
+ *   in blocking receives (SO_BUSY_POLL). Both burn CPU time to save the wake-up latency, which matters 
+ *   with timeslices of some 10 microseconds on hosts that have a core to spare. The time between the arrival 
+ *   of a run permission at the socket and its handling is reported by the \em WakeupLatency trace source 
+ *   (not with \em SharedMemory).
+ * - \em ProtocolVersion selects the wire format the client sends (1 for servers that only speak the 
+ *   original format). Version 2 finished packets carry the time the client waited for its run permission 
+ *   and the number of packets it resent. Run permissions are accepted in both formats.
+ *
+ * Instead of blocking in WaitForRunPermission(), the run permission can also be awaited from an event 
+ * loop: poll GetFd() for readability (at most for GetPollTimeout(), so that packets are resent 
+ * in time) and call TryGetRunPermission() whenever it wakes up.
  * 
  * \see SyncSimulatirImpl
  */
@@ -188,16 +120,104 @@ class SyncClient : public Object
    void SendFinished(uint32_t runTime, uint32_t realTime);
 
    /**
-    * Waits for the server to send a run permission packet and if that does not happen after 
-    * \em RecvTimeout seconds, the last sent packet is sent again.
+    * Sends a finished packet which additionally announces when the next event of this client is due.
+    *
+    * \param runTime the time that was assigned in the last timeslice (in microseconds)
+    * \param realTime the time which was actually needed for the simulation of the timeslice (in microseconds)
+    * \param nextEvent time from the end of the last timeslice to the next event (in microseconds, 
+    *        NEXTEVENT_NONE if there is none)
+    * \param lookahead minimum delay before an event becomes visible outside of this client (in microseconds)
+    */
+   void SendFinished(uint32_t runTime, uint32_t realTime, uint32_t nextEvent, uint32_t lookahead);
+
+   /**
+    * Waits for the server to send a run permission packet and if that does not happen within 
+    * the resend timeout, the last sent packet is sent again.
     *
     * \returns the run time (in microseconds) of the next timeslice
     */
    uint32_t WaitForRunPermission();
 
+   /**
+    * Non-blocking variant of WaitForRunPermission(): handles the packets the server has sent so far 
+    * and resends the last packet if the resend timeout has passed since it was sent.
+    *
+    * \param runTime set to the run time (in microseconds) of the next timeslice if a run permission arrived
+    * \returns true if a fresh run permission arrived
+    */
+   bool TryGetRunPermission (uint32_t &runTime);
+
+   /**
+    * \returns the file descriptor which becomes readable when the server sends a packet, 
+    *          -1 if the run permissions are exchanged through shared memory (which has no descriptor)
+    */
+   int GetFd () const;
+
+   /**
+    * \returns the time after which TryGetRunPermission() has to be called again to resend the 
+    *          last packet, a negative time if packets are not resent
+    */
+   Time GetPollTimeout () const;
+
+   /**
+    * \returns the number of packets resent since the registration
+    */
+   uint32_t GetRetransmissions () const;
+
+   /**
+    * \returns the time to poll for the run permission before blocking (the \em SpinTime attribute)
+    */
+   Time GetSpinTime () const;
+
  private:
-   // sets the sequence number of a packet structure and sends it to the server
-   void SendPacket (struct SyncCom::SyncPacket *packet, size_t len);
+   // sets the sequence number of a packet and sends it to the server
+   void SendPacket (uint8_t *packet, size_t len);
+
+   // builds and sends a finished packet, with the next event if announce is set
+   void SendFinishedUdp (uint32_t runTime, uint32_t realTime, uint32_t nextEvent, uint32_t lookahead, bool announce);
+
+   // waits for a run permission on the socket (or in shared memory once the server granted it)
+   uint32_t ReceiveRunPermission ();
+
+   // handles a received packet of len bytes, returns true (and the run time) if it is a fresh run permission
+   bool HandlePacket (int len, uint32_t &runTime);
+
+   // receives a packet into m_recvPacket and keeps its kernel timestamp
+   int ReceivePacket (int flags);
+
+   // handles the packets that have arrived so far and resends the last packet if it is overdue
+   bool PollRunPermission (uint32_t &runTime);
+
+   // polls for the run permission for up to m_spinTime
+   bool SpinForRunPermission (uint32_t &runTime);
+
+   // resends the last packet
+   void ResendLastPacket ();
+
+   // nanoseconds until the last packet has to be resent (0 if overdue), -1 if it is not resent
+   int64_t GetTimeToResend () const;
+
+   // resends the last packet because the timeout expired and backs off
+   void ResendOnTimeout ();
+
+   // takes a round trip time sample (if unambiguous) when a run permission arrives and resets the timeout
+   void UpdateTimeout ();
+
+   // maps the shared memory page the server granted
+   void AttachSharedMemory (const char *name, uint16_t slot);
+
+   // waits for a run permission in the shared memory page
+   uint32_t WaitForRunPermissionShm ();
+
+   // checks the shared memory page for a fresh run permission without waiting
+   bool CheckRunPermissionShm (uint32_t &runTime);
+
+   // measure the time spent waiting for a run permission (reported as m_waitTime)
+   void StartWaiting ();
+   void StopWaiting ();
+
+   // reports a finished timeslice in the shared memory slot
+   void SendFinishedShm (uint32_t runTime, uint32_t realTime, uint32_t nextEvent, uint32_t lookahead, uint32_t flags);
 
    // configuration attributes
    uint16_t m_clientPort;
@@ -206,7 +226,14 @@ class SyncClient : public Object
    Ipv4Address m_serverAddress;
    uint16_t m_clientId;
    std::string m_clientDescription;
-   uint16_t m_recvTimeout;
+   Time m_recvTimeout;
+   bool m_adaptiveTimeout;
+   Time m_minRecvTimeout;
+   Time m_maxRecvTimeout;
+   bool m_sharedMemory;
+   Time m_spinTime;
+   Time m_busyPoll;
+   uint8_t m_protocolVersion;
 
    // socket to send and receive on
    int m_sock;
@@ -217,26 +244,47 @@ class SyncClient : public Object
    // counter of the period ids the server sends
    uint32_t m_periodId;
 
-   // length, complete packet and data part for all four messages
-   // (is malloced only once in the constructor)
-   int m_regPacket_len;
-   struct SyncCom::SyncPacket *m_regPacket;
-   struct SyncCom::RegisterClient *m_regPacket_data;
-   int m_unregPacket_len;
-   struct SyncCom::SyncPacket *m_unregPacket;
-   struct SyncCom::UnregisterClient *m_unregPacket_data;
-   int m_finishedPacket_len;
-   struct SyncCom::SyncPacket *m_finishedPacket;
-   struct SyncCom::Finished *m_finishedPacket_data;
-   int m_runpermPacket_recv_len;
-   int m_runpermPacket_real_len;
-   struct SyncCom::SyncPacket *m_runpermPacket;
-   struct SyncCom::RunPermission *m_runpermPacket_data;
+   // the packets this client sends and the receive buffer, SW_MAX_DATAGRAM bytes each
+   // (are malloced only once in the constructor)
+   uint8_t *m_regPacket;
+   size_t m_regPacket_len;
+   uint8_t *m_unregPacket;
+   size_t m_unregPacket_len;
+   uint8_t *m_finishedPacket;
+   uint8_t *m_recvPacket;
    struct sockaddr_in m_dest;
 
    // pointer to the last sent packet and its length
-   struct SyncCom::SyncPacket *m_lastPacket;
-   int m_lastPacketLen;
+   uint8_t *m_lastPacket;
+   size_t m_lastPacketLen;
+   struct timespec m_lastSent;
+
+   // resend timeout, smoothed round trip time and its variation (nanoseconds)
+   int64_t m_rto;
+   int64_t m_srtt;
+   int64_t m_rttvar;
+   // the last packet has not been resent, so its answer gives a round trip time sample
+   bool m_rttPending;
+
+   TracedCallback<uint32_t, Time> m_retransmissionTrace;
+
+   // kernel timestamp (CLOCK_REALTIME) of the last received packet, if it had one
+   struct timespec m_recvStamp;
+   bool m_recvStamped;
+   TracedCallback<Time> m_wakeupLatencyTrace;
+
+   // set while a run permission is awaited (TryGetRunPermission) and since when
+   bool m_waiting;
+   struct timespec m_waitStart;
+
+   // statistics sent along with the finished packets (version 2)
+   uint32_t m_waitTime; // microseconds spent in the last WaitForRunPermission()
+   uint32_t m_resent; // packets resent since the registration
+
+   // the shared memory page and this client's slot in it (NULL when using UDP)
+   struct COM_ShmHeader *m_shmHeader;
+   struct COM_ShmSlot *m_shmSlot;
+   size_t m_shmLen;
 };
 
 } // namespace ns3
@@ -23,6 +23,7 @@
 
 #include "ns3/simulator.h"
 #include "ns3/sync-simulator-impl.h"
+#include "synchronization.h"
 #include "ns3/scheduler.h"
 #include "ns3/event-impl.h"
 
@@ -30,12 +31,28 @@
 #include "ns3/pointer.h"
 #include "ns3/assert.h"
 #include "ns3/fatal-error.h"
+#include "ns3/abort.h"
 #include "ns3/log.h"
-
-
+#include "ns3/boolean.h"
+#include "ns3/uinteger.h"
+#include "ns3/nstime.h"
+#include "ns3/trace-source-accessor.h"
+#include "ns3/core-config.h"
+#include "ns3/node-list.h"
+#include "ns3/node.h"
+#include "ns3/net-device.h"
+#include "ns3/channel.h"
+
+
+#include <algorithm>
+#include <string>
 #include <math.h>
 #include <sys/time.h>
 #include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
 
 NS_LOG_COMPONENT_DEFINE ("SyncSimulatorImpl");
 
@@ -43,12 +60,55 @@ namespace ns3 {
 
 NS_OBJECT_ENSURE_REGISTERED (SyncSimulatorImpl);
 
+__thread SyncSimulatorImpl::Partition *SyncSimulatorImpl::m_currentPartition = 0;
+
 TypeId
 SyncSimulatorImpl::GetTypeId (void)
 {
   static TypeId tid = TypeId ("ns3::SyncSimulatorImpl")
     .SetParent<Object> ()
     .AddConstructor<SyncSimulatorImpl> ()
+    .AddAttribute ("AnnounceNextEvent",
+                   "Tell the sync server in every finished packet when the next event is due, "
+                   "so that it can skip idle timeslices.",
+                   BooleanValue (false),
+                   MakeBooleanAccessor (&SyncSimulatorImpl::m_announceNextEvent),
+                   MakeBooleanChecker ())
+    .AddAttribute ("Lookahead",
+                   "The minimum delay before an event of this simulation becomes visible to other "
+                   "sync clients (e.g. the delay of the links to the tunnels). Only used with AnnounceNextEvent.",
+                   TimeValue (Seconds (0)),
+                   MakeTimeAccessor (&SyncSimulatorImpl::m_lookahead),
+                   MakeTimeChecker ())
+    .AddAttribute ("AsyncWait",
+                   "Wait for the run permission in a poll loop which also does the work queued with "
+                   "ScheduleEarlyWork() (e.g. decoding received tunnel packets) instead of blocking.",
+                   BooleanValue (false),
+                   MakeBooleanAccessor (&SyncSimulatorImpl::m_asyncWait),
+                   MakeBooleanChecker ())
+    .AddAttribute ("PreciseTimestamps",
+                   "Schedule packets received from the tunnels at the virtual time within the current timeslice "
+                   "which corresponds to their wall-clock receive time instead of at the end of the timeslice.",
+                   BooleanValue (true),
+                   MakeBooleanAccessor (&SyncSimulatorImpl::m_preciseTimestamps),
+                   MakeBooleanChecker ())
+    .AddAttribute ("Threads",
+                   "The number of threads which execute the events of a timeslice, each for the nodes "
+                   "of one partition (needs ns-3 configured with --enable-parallel-events if larger than 1).",
+                   UintegerValue (1),
+                   MakeUintegerAccessor (&SyncSimulatorImpl::m_threads),
+                   MakeUintegerChecker<uint32_t> (1))
+    .AddAttribute ("PartitionLookahead",
+                   "The smallest delay of the links between nodes of different partitions, which is the "
+                   "length of the windows executed in parallel. 0 means take it from the Delay attribute "
+                   "of the channels.",
+                   TimeValue (Seconds (0)),
+                   MakeTimeAccessor (&SyncSimulatorImpl::m_partitionLookahead),
+                   MakeTimeChecker ())
+    .AddTraceSource ("SliceEnd",
+                     "All events of the current timeslice have been executed and the end of the timeslice "
+                     "is about to be reported to the sync server.",
+                     MakeTraceSourceAccessor (&SyncSimulatorImpl::m_sliceEndTrace))
     ;
   return tid;
 }
@@ -68,22 +128,52 @@ SyncSimulatorImpl::SyncSimulatorImpl ()
   // before ::Run is entered, the m_currentUid will be zero
   m_currentUid = 0;
   m_currentTs = 0;
+  m_currentContext = 0xffffffff;
   m_unscheduledEvents = 0;
  
   // will be set if events are scheduled while waiting for a runtime permission
   m_newEventArrived = false;
+  m_isWaitingForPermission = false;
+  m_main = SystemThread::Self ();
+  m_eventsWithContext = 0;
+  m_wakeFd = -1;
+
+  m_sliceStartTs = 0;
+  m_sliceStartWall = 0;
+
+  m_lookaheadTs = 0;
+  m_windowEnd = 0;
+  m_windowGeneration = 0;
+  m_busyPartitions = 0;
+  m_partitionsExit = false;
+  pthread_mutex_init (&m_windowLock, NULL);
+  pthread_cond_init (&m_windowStart, NULL);
+  pthread_cond_init (&m_windowDone, NULL);
 
   // create a sync client for communcation with the server
   m_syncClient = CreateObject<SyncClient> ();
 }
 
 SyncSimulatorImpl::~SyncSimulatorImpl ()
-{}
+{
+  pthread_cond_destroy (&m_windowDone);
+  pthread_cond_destroy (&m_windowStart);
+  pthread_mutex_destroy (&m_windowLock);
+}
 
 void 
 SyncSimulatorImpl::DoDispose (void)
 {
   NS_LOG_FUNCTION_NOARGS ();
+
+  // events and work of other threads that were never taken: the work is still done, as
+  // it may release resources (like the receive batches of SyncTunnelComm), the events
+  // it schedules are dropped with the others below
+  while (m_eventsWithContext != 0)
+    {
+      ProcessEventsWithContext ();
+    }
+
   while (m_events->IsEmpty () == false)
     {
       Scheduler::Event next = m_events->RemoveNext ();
@@ -117,6 +207,13 @@ SyncSimulatorImpl::Destroy ()
           ev->Invoke ();
         }
     }
+
+  // the bridges have stopped their tunnels with the nodes, the work they left is only
+  // needed to release its resources (see DoDispose())
+  while (m_eventsWithContext != 0)
+    {
+      ProcessEventsWithContext ();
+    }
 }
 
 void
@@ -125,20 +222,17 @@ SyncSimulatorImpl::SetScheduler (ObjectFactory schedulerFactory)
   NS_LOG_FUNCTION_NOARGS ();
 
   Ptr<Scheduler> scheduler = schedulerFactory.Create<Scheduler> ();
+  m_schedulerFactory = schedulerFactory;
 
-  { 
-    CriticalSection cs (m_mutex);
-
-    if (m_events != 0)
-      {
-        while (m_events->IsEmpty () == false)
-          {
-            Scheduler::Event next = m_events->RemoveNext ();
-            scheduler->Insert (next);
-          }
-      }
-    m_events = scheduler;
-  }
+  if (m_events != 0)
+    {
+      while (m_events->IsEmpty () == false)
+        {
+          Scheduler::Event next = m_events->RemoveNext ();
+          scheduler->Insert (next);
+        }
+    }
+  m_events = scheduler;
 }
 
 void
@@ -153,6 +247,9 @@ SyncSimulatorImpl::ProcessOneEvent (void)
   
   //usleep(10000); a very generic slowdown to show e.g simulation overload. don't uncomment //elias
   
+  // the events of other threads and the early work (which may schedule events) go 
+  // before looking at the next event
+  ProcessEventsWithContext ();
 
   NS_LOG_LOGIC ("Checking if next event is within the current timeslice");
 
@@ -190,14 +287,27 @@ SyncSimulatorImpl::ProcessOneEvent (void)
           realTime = (curTimeval.tv_sec - lastTimeval.tv_sec) * 1000000 + (curTimeval.tv_usec - lastTimeval.tv_usec);
           #endif
 
+          // let the models complete the work of this timeslice
+          m_sliceEndTrace ();
+
           // send the packet
           NS_LOG_LOGIC ("Sending finish packet");
-          m_syncClient->SendFinished (runTime, realTime);
+          if (m_announceNextEvent)
+            {
+              // (tsNext >= m_barrierTime holds in this loop)
+              uint64_t nextEvent = (tsNext - m_barrierTime) / 1000;
+              uint64_t lookahead = m_lookahead.GetMicroSeconds ();
+              m_syncClient->SendFinished (runTime, realTime,
+                                          nextEvent < NEXTEVENT_NONE ? nextEvent : NEXTEVENT_NONE,
+                                          lookahead < NEXTEVENT_NONE ? lookahead : NEXTEVENT_NONE);
+            }
+          else
+            m_syncClient->SendFinished (runTime, realTime);
         }
 
       // wait for run permission
       NS_LOG_LOGIC("Waiting for run permission");
-      runTime = m_syncClient->WaitForRunPermission();
+      runTime = WaitForRunPermission ();
 
       // update lastTimeval
       #ifdef SEND_REALTIME
@@ -206,7 +316,9 @@ SyncSimulatorImpl::ProcessOneEvent (void)
 
       // increase the barrier time
       // (runTime is in microseconds, but m_barrierTime is nanoseconds)
-      m_barrierTime += runTime*1000;
+      m_sliceStartTs = m_barrierTime;
+      m_sliceStartWall = GetWallClock ();
+      m_barrierTime += (uint64_t) runTime*1000;
 
       // if a new event arrived stop waiting 
       if (m_newEventArrived)
@@ -219,49 +331,37 @@ SyncSimulatorImpl::ProcessOneEvent (void)
     }
     m_isWaitingForPermission = false;
 
+  // execute the events of the next window in the partition threads if possible
+  if (m_lookaheadTs > 0 && ProcessWindow ())
+    return;
+
   NS_LOG_LOGIC("Ready to execute the next event");
 
   // ok, we are ready to execute the next event
-  Scheduler::Event next;
-
-  { 
-    CriticalSection cs (m_mutex);
-
-    // 
-    // We do know we're waiting for an event, so there had better be an event on the 
-    // event queue.  Let's pull it off.  When we release the critical section, the
-    // event we're working on won't be on the list and so subsequent operations won't
-    // mess with us.
-    //
-    NS_ASSERT_MSG (m_events->IsEmpty () == false, 
-      "SyncSimulatorImpl::ProcessOneEvent(): event queue is empty");
-    next = m_events->RemoveNext ();
-    m_unscheduledEvents--;
-
-    //
-    // We cannot make any assumption that "next" is the same event we originally waited 
-    // for.  We can only assume that only that it must be due and cannot cause time 
-    // to move backward.
-    //
-    NS_ASSERT_MSG (next.key.m_ts >= m_currentTs,
-                   "SyncSimulatorImpl::ProcessOneEvent(): "
-                   "next.GetTs() earlier than m_currentTs (list order error)");
-    NS_LOG_LOGIC ("handle " << next.key.m_ts);
-
-    // 
-    // Update the current simulation time to be the timestamp of the event we're 
-    // executing.  From the rest of the simulation's point of view, simulation time
-    // is frozen until the next event is executed.
-    //
-    m_currentTs = next.key.m_ts;
-    m_currentContext = next.key.m_context;
-    m_currentUid = next.key.m_uid;
-  }
+  // (other threads do not touch the event list, so no critical section is needed)
+  NS_ASSERT_MSG (m_events->IsEmpty () == false, 
+    "SyncSimulatorImpl::ProcessOneEvent(): event queue is empty");
+  Scheduler::Event next = m_events->RemoveNext ();
+  __sync_fetch_and_sub (&m_unscheduledEvents, 1);
 
   //
-  // We have got the event we're about to execute completely disentangled from the 
-  // event list so we can execute it outside a critical section without fear of someone
-  // changing things out from under us.
+  // We cannot make any assumption that "next" is the same event we originally waited 
+  // for.  We can only assume that only that it must be due and cannot cause time 
+  // to move backward.
+  //
+  NS_ASSERT_MSG (next.key.m_ts >= m_currentTs,
+                 "SyncSimulatorImpl::ProcessOneEvent(): "
+                 "next.GetTs() earlier than m_currentTs (list order error)");
+  NS_LOG_LOGIC ("handle " << next.key.m_ts);
+
+  // 
+  // Update the current simulation time to be the timestamp of the event we're 
+  // executing.  From the rest of the simulation's point of view, simulation time
+  // is frozen until the next event is executed.
+  //
+  m_currentTs = next.key.m_ts;
+  m_currentContext = next.key.m_context;
+  m_currentUid = next.key.m_uid;
 
   EventImpl *event = next.impl;
   event->Invoke ();
@@ -270,21 +370,475 @@ SyncSimulatorImpl::ProcessOneEvent (void)
   NS_LOG_LOGIC("Executed and deleted that event");
 }
 
+uint32_t
+SyncSimulatorImpl::WaitForRunPermission (void)
+{
+  NS_LOG_FUNCTION_NOARGS ();
+
+  uint32_t runTime;
+  int fd = m_syncClient->GetFd ();
+
+  if (!m_asyncWait || fd < 0)
+    {
+      runTime = m_syncClient->WaitForRunPermission ();
+      // the work that arrived while waiting belongs to the beginning of the new timeslice
+      // (m_barrierTime is increased after this)
+      ProcessEventsWithContext ();
+      return runTime;
+    }
+
+  // other threads either see that the simulator thread waits (and wake it up) or their 
+  // events are taken in the loop below
+  __sync_synchronize ();
+
+  // poll without sleeping for the SpinTime of the SyncClient first
+  uint64_t spinEnd = GetWallClock () + m_syncClient->GetSpinTime ().GetNanoSeconds ();
+
+  for (;;)
+    {
+      ProcessEventsWithContext ();
+      if (m_syncClient->TryGetRunPermission (runTime))
+        {
+          ProcessEventsWithContext ();
+          return runTime;
+        }
+      if (GetWallClock () < spinEnd)
+        continue;
+
+      // sleep until the server sends something, early work is queued or a packet has to be resent
+      struct pollfd fds[2];
+      fds[0].fd = fd;
+      fds[0].events = POLLIN;
+      fds[1].fd = m_wakeFd;
+      fds[1].events = POLLIN;
+      Time left = m_syncClient->GetPollTimeout ();
+      struct timespec timeout;
+      timeout.tv_sec = left.GetNanoSeconds () / 1000000000LL;
+      timeout.tv_nsec = left.GetNanoSeconds () % 1000000000LL;
+      int ready = ppoll (fds, 2, left.IsNegative () ? NULL : &timeout, NULL);
+      NS_ABORT_MSG_IF (ready < 0 && errno != EINTR, "SyncSimulatorImpl::WaitForRunPermission(): poll failed");
+      if (ready > 0 && (fds[1].revents & POLLIN))
+        {
+          uint64_t count;
+          if (read (m_wakeFd, &count, sizeof (count)) < 0)
+            NS_LOG_LOGIC ("Wake-up counter was already reset");
+        }
+    }
+}
+
+void
+SyncSimulatorImpl::PushEventWithContext (EventWithContext *ev)
+{
+  EventWithContext *head;
+  do
+    {
+      head = m_eventsWithContext;
+      ev->next = head;
+    }
+  while (!__sync_bool_compare_and_swap (&m_eventsWithContext, head, ev));
+
+  // wake up the simulator thread if it polls for the run permission 
+  // (once, until it has taken the stack)
+  if (head == 0 && m_isWaitingForPermission)
+    {
+      int fd = m_wakeFd;
+      uint64_t one = 1;
+      if (fd >= 0 && write (fd, &one, sizeof (one)) < 0)
+        NS_LOG_LOGIC ("Wake-up counter is saturated");
+    }
+}
+
+void
+SyncSimulatorImpl::ProcessEventsWithContext (void)
+{
+  if (m_eventsWithContext == 0)
+    {
+      return;
+    }
+
+  // take the whole stack and restore the order in which the events were pushed
+  EventWithContext *ev = __sync_lock_test_and_set (&m_eventsWithContext, 0);
+  EventWithContext *fifo = 0;
+  while (ev != 0)
+    {
+      EventWithContext *next = ev->next;
+      ev->next = fifo;
+      fifo = ev;
+      ev = next;
+    }
+
+  while (fifo != 0)
+    {
+      ev = fifo;
+      fifo = ev->next;
+      switch (ev->type)
+        {
+        case EventWithContext::EVENT:
+          {
+            Scheduler::Event event;
+            event.impl = ev->event;
+            event.key.m_ts = m_currentTs + ev->timestamp;
+            event.key.m_context = ev->context;
+            event.key.m_uid = __sync_fetch_and_add (&m_uid, 1);
+            __sync_fetch_and_add (&m_unscheduledEvents, 1);
+            m_events->Insert (event);
+            m_newEventArrived = true;
+            break;
+          }
+        case EventWithContext::SLICE_EVENT:
+          InsertInCurrentSlice (ev->context, ev->event, ev->timestamp);
+          break;
+        case EventWithContext::EARLY_WORK:
+          // the work may schedule events
+          ev->event->Invoke ();
+          ev->event->Unref ();
+          break;
+        }
+      delete ev;
+    }
+}
+
+void
+SyncSimulatorImpl::ScheduleEarlyWork (EventImpl *impl)
+{
+  NS_LOG_FUNCTION (impl);
+
+  EventWithContext *ev = new EventWithContext;
+  ev->type = EventWithContext::EARLY_WORK;
+  ev->context = 0xffffffff;
+  ev->timestamp = 0;
+  ev->event = impl;
+  PushEventWithContext (ev);
+}
+
+uint32_t
+SyncSimulatorImpl::GetPartition (uint32_t context) const
+{
+  if (context < m_nodePartitions.size ())
+    return m_nodePartitions[context];
+  return context % m_partitions.size ();
+}
+
+static uint32_t
+FindComponent (std::vector<uint32_t> &parents, uint32_t node)
+{
+  while (parents[node] != node)
+    {
+      parents[node] = parents[parents[node]];
+      node = parents[node];
+    }
+  return node;
+}
+
+uint32_t
+SyncSimulatorImpl::AssignPartitions (void)
+{
+  NS_LOG_FUNCTION_NOARGS ();
+
+  // union-find over the channels: only point-to-point links have a delay between
+  // their ends which every packet crosses, all other channels (e.g. a CsmaChannel)
+  // keep state shared by their devices, so their nodes have to be in the same partition
+  uint32_t nodes = NodeList::GetNNodes ();
+  std::vector<uint32_t> parents (nodes);
+  for (uint32_t i = 0; i < nodes; i++)
+    parents[i] = i;
+  for (NodeList::Iterator node = NodeList::Begin (); node != NodeList::End (); node++)
+    {
+      for (uint32_t i = 0; i < (*node)->GetNDevices (); i++)
+        {
+          Ptr<Channel> channel = (*node)->GetDevice (i)->GetChannel ();
+          if (channel == 0 || IsPointToPoint (channel))
+            continue;
+          for (uint32_t j = 0; j < channel->GetNDevices (); j++)
+            {
+              uint32_t a = FindComponent (parents, (*node)->GetId ());
+              uint32_t b = FindComponent (parents, channel->GetDevice (j)->GetNode ()->GetId ());
+              parents[std::max (a, b)] = std::min (a, b);
+            }
+        }
+    }
+
+  // distribute the connected nodes round robin over the partitions
+  std::vector<uint32_t> componentPartitions (nodes, 0xffffffff);
+  uint32_t partitions = 0;
+  m_nodePartitions.resize (nodes);
+  for (uint32_t i = 0; i < nodes; i++)
+    {
+      uint32_t component = FindComponent (parents, i);
+      if (componentPartitions[component] == 0xffffffff)
+        componentPartitions[component] = partitions++ % m_threads;
+      m_nodePartitions[i] = componentPartitions[component];
+    }
+  return std::min (partitions, m_threads);
+}
+
+bool
+SyncSimulatorImpl::IsPointToPoint (Ptr<Channel> channel)
+{
+  std::string name = channel->GetInstanceTypeId ().GetName ();
+  return channel->GetNDevices () <= 2
+    && (name == "ns3::PointToPointChannel" || name == "ns3::PointToPointRemoteChannel");
+}
+
+Time
+SyncSimulatorImpl::CalculatePartitionLookahead (void) const
+{
+  NS_LOG_FUNCTION_NOARGS ();
+
+  // the contexts of the events of a node are its id
+  Time lookahead = GetMaximumSimulationTime ();
+  for (NodeList::Iterator node = NodeList::Begin (); node != NodeList::End (); node++)
+    {
+      for (uint32_t i = 0; i < (*node)->GetNDevices (); i++)
+        {
+          Ptr<Channel> channel = (*node)->GetDevice (i)->GetChannel ();
+          if (channel == 0)
+            continue;
+          // channels which are not point-to-point never cross partitions (see AssignPartitions())
+          for (uint32_t j = 0; j < channel->GetNDevices (); j++)
+            {
+              Ptr<Node> peer = channel->GetDevice (j)->GetNode ();
+              if (GetPartition (peer->GetId ()) == GetPartition ((*node)->GetId ()))
+                continue;
+              TimeValue delay;
+              if (!channel->GetAttributeFailSafe ("Delay", delay))
+                {
+                  NS_LOG_WARN ("Channel " << channel->GetInstanceTypeId ().GetName () << " between node " 
+                               << (*node)->GetId () << " and node " << peer->GetId () << " has no delay");
+                  return Seconds (0);
+                }
+              lookahead = Min (lookahead, delay.Get ());
+            }
+        }
+    }
+  return lookahead;
+}
+
+void
+SyncSimulatorImpl::StartPartitions (void)
+{
+  NS_LOG_FUNCTION_NOARGS ();
+
+  m_lookaheadTs = 0;
+  if (m_threads <= 1)
+    return;
+
+#ifndef NS3_PARALLEL_EVENTS
+  NS_FATAL_ERROR ("SyncSimulatorImpl::Run(): Threads > 1 needs ns-3 configured with --enable-parallel-events");
+#endif
+
+  uint32_t partitions = AssignPartitions ();
+  if (partitions <= 1)
+    {
+      NS_LOG_WARN ("All nodes share a channel, executing the events in a single thread");
+      m_nodePartitions.clear ();
+      return;
+    }
+  Time lookahead = m_partitionLookahead.IsZero () ? CalculatePartitionLookahead () : m_partitionLookahead;
+  if (!lookahead.IsStrictlyPositive ())
+    {
+      NS_LOG_WARN ("No lookahead between the partitions, executing the events in a single thread");
+      m_nodePartitions.clear ();
+      return;
+    }
+  NS_LOG_LOGIC ("Executing the events in " << partitions << " threads, lookahead " << lookahead);
+  m_lookaheadTs = lookahead.GetTimeStep ();
+
+  m_partitionsExit = false;
+  for (uint32_t i = 0; i < partitions; i++)
+    {
+      Partition *partition = new Partition;
+      partition->impl = this;
+      partition->events = m_schedulerFactory.Create<Scheduler> ();
+      partition->currentTs = m_currentTs;
+      partition->currentContext = 0xffffffff;
+      partition->currentUid = 0;
+      // the first partition is executed by the simulator thread itself
+      if (i > 0)
+        {
+          partition->thread = Create<SystemThread> (MakeCallback (&Partition::Thread, partition));
+          partition->thread->Start ();
+        }
+      m_partitions.push_back (partition);
+    }
+}
+
+void
+SyncSimulatorImpl::StopPartitions (void)
+{
+  NS_LOG_FUNCTION_NOARGS ();
+
+  pthread_mutex_lock (&m_windowLock);
+  m_partitionsExit = true;
+  pthread_cond_broadcast (&m_windowStart);
+  pthread_mutex_unlock (&m_windowLock);
+
+  for (std::vector<Partition *>::iterator i = m_partitions.begin (); i != m_partitions.end (); i++)
+    {
+      if ((*i)->thread != 0)
+        (*i)->thread->Join ();
+      delete *i;
+    }
+  m_partitions.clear ();
+  m_nodePartitions.clear ();
+  m_lookaheadTs = 0;
+}
+
+void
+SyncSimulatorImpl::Partition::Thread (void)
+{
+  impl->PartitionThread (this);
+}
+
+void
+SyncSimulatorImpl::PartitionThread (Partition *partition)
+{
+  uint32_t generation = 0;
+  for (;;)
+    {
+      pthread_mutex_lock (&m_windowLock);
+      while (m_windowGeneration == generation && !m_partitionsExit)
+        pthread_cond_wait (&m_windowStart, &m_windowLock);
+      if (m_partitionsExit)
+        {
+          pthread_mutex_unlock (&m_windowLock);
+          return;
+        }
+      generation = m_windowGeneration;
+      pthread_mutex_unlock (&m_windowLock);
+
+      RunPartition (partition);
+
+      pthread_mutex_lock (&m_windowLock);
+      if (--m_busyPartitions == 0)
+        pthread_cond_signal (&m_windowDone);
+      pthread_mutex_unlock (&m_windowLock);
+    }
+}
+
+bool
+SyncSimulatorImpl::ProcessWindow (void)
+{
+  NS_LOG_FUNCTION_NOARGS ();
+
+  // the window ends before the last nanosecond of the timeslice, where other threads 
+  // schedule with ScheduleInCurrentSlice(), and at the next event without a node, 
+  // which may touch any node and is therefore executed alone
+  uint32_t distributed = 0;
+  uint64_t windowEnd = std::min (NextTs () + m_lookaheadTs, m_barrierTime - 1);
+  while (m_events->IsEmpty () == false)
+    {
+      Scheduler::Event next = m_events->PeekNext ();
+      if (next.key.m_ts >= windowEnd)
+        break;
+      if (next.key.m_context == 0xffffffff)
+        {
+          windowEnd = next.key.m_ts;
+          break;
+        }
+      m_events->RemoveNext ();
+      m_partitions[GetPartition (next.key.m_context)]->events->Insert (next);
+      distributed++;
+    }
+  m_windowEnd = windowEnd;
+  if (distributed == 0)
+    return false;
+
+  NS_LOG_LOGIC ("Executing " << distributed << " events up to " << m_windowEnd << " in parallel");
+  for (std::vector<Partition *>::iterator i = m_partitions.begin (); i != m_partitions.end (); i++)
+    (*i)->currentTs = m_currentTs;
+
+  pthread_mutex_lock (&m_windowLock);
+  m_windowGeneration++;
+  m_busyPartitions = m_partitions.size () - 1;
+  pthread_cond_broadcast (&m_windowStart);
+  pthread_mutex_unlock (&m_windowLock);
+
+  RunPartition (m_partitions[0]);
+
+  pthread_mutex_lock (&m_windowLock);
+  while (m_busyPartitions > 0)
+    pthread_cond_wait (&m_windowDone, &m_windowLock);
+  pthread_mutex_unlock (&m_windowLock);
+
+  // the simulation time continues at the last event of the window
+  for (std::vector<Partition *>::iterator i = m_partitions.begin (); i != m_partitions.end (); i++)
+    {
+      if ((*i)->currentTs > m_currentTs)
+        {
+          m_currentTs = (*i)->currentTs;
+          m_currentContext = (*i)->currentContext;
+          m_currentUid = (*i)->currentUid;
+        }
+    }
+  return true;
+}
+
+void
+SyncSimulatorImpl::RunPartition (Partition *partition)
+{
+  m_currentPartition = partition;
+  while (partition->events->IsEmpty () == false)
+    {
+      Scheduler::Event next = partition->events->RemoveNext ();
+      __sync_fetch_and_sub (&m_unscheduledEvents, 1);
+      partition->currentTs = next.key.m_ts;
+      partition->currentContext = next.key.m_context;
+      partition->currentUid = next.key.m_uid;
+
+      EventImpl *event = next.impl;
+      event->Invoke ();
+      event->Unref ();
+    }
+  m_currentPartition = 0;
+}
+
+EventId
+SyncSimulatorImpl::ScheduleInPartition (uint64_t ts, uint32_t context, EventImpl *impl)
+{
+  Partition *partition = m_currentPartition;
+  Scheduler::Event ev;
+  ev.impl = impl;
+  ev.key.m_ts = ts;
+  ev.key.m_context = context;
+  ev.key.m_uid = __sync_fetch_and_add (&m_uid, 1);
+  __sync_fetch_and_add (&m_unscheduledEvents, 1);
+
+  if (ts < m_windowEnd)
+    {
+      // within the window, only the own partition may be affected
+      NS_ABORT_MSG_IF (context == 0xffffffff || m_partitions[GetPartition (context)] != partition,
+                       "SyncSimulatorImpl: event for context " << context << " at " << ts 
+                       << " scheduled by context " << partition->currentContext << " at " << partition->currentTs 
+                       << " is within the PartitionLookahead");
+      partition->events->Insert (ev);
+    }
+  else
+    {
+      // the other partitions may do so at the same time
+      CriticalSection cs (m_mutex);
+      m_events->Insert (ev);
+    }
+
+  return EventId (impl, ev.key.m_ts, ev.key.m_context, ev.key.m_uid);
+}
+
+uint64_t
+SyncSimulatorImpl::CurrentTs (void) const
+{
+  Partition *partition = m_currentPartition;
+  return partition != 0 ? partition->currentTs : m_currentTs;
+}
+
 bool 
 SyncSimulatorImpl::IsFinished (void) const
 {
   NS_LOG_FUNCTION_NOARGS ();
-  bool rc;
-  {
-    CriticalSection cs (m_mutex);
-    rc = m_events->IsEmpty () || m_stop;
-  }
-
-  return rc;
+  return m_events->IsEmpty () || m_stop;
 }
 
 //
-// Peeks into event list.  Should be called with critical section locked.
+// Peeks into event list.  Must be called by the simulator thread.
 //
 uint64_t
 SyncSimulatorImpl::NextTs (void) const
@@ -297,7 +851,7 @@ SyncSimulatorImpl::NextTs (void) const
 }
 
 //
-// Calls NextTs().  Should be called with critical section locked.
+// Calls NextTs().  Must be called by the simulator thread.
 //
 Time
 SyncSimulatorImpl::Next (void) const
@@ -311,13 +865,20 @@ SyncSimulatorImpl::Run (void)
 {
   NS_LOG_FUNCTION_NOARGS ();
 
+  // Set the current threadId as the main threadId
+  m_main = SystemThread::Self ();
+  m_wakeFd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  NS_ABORT_MSG_IF (m_wakeFd < 0, "SyncSimulatorImpl::Run(): Could not create eventfd");
+  m_isWaitingForPermission = true;
+
   NS_LOG_LOGIC("Registering at synchronization server");
   // connect to sync server
   m_syncClient->ConnectAndSendRegister();
   m_barrierTime = 0;
-  m_isWaitingForPermission = true;
   m_firstRound = true;
 
+  StartPartitions ();
+
   NS_ASSERT_MSG (m_running == false, 
                  "SyncSimulatorImpl::Run(): Simulator already running");
 
@@ -326,23 +887,15 @@ SyncSimulatorImpl::Run (void)
 
   for (;;) 
     {
-      bool done = false;
-
-      {
-        CriticalSection cs (m_mutex);
-        //
-        // In all cases we stop when the event list is empty.  If you are doing a 
-        // realtime simulation and you want it to extend out for some time, you must
-        // call StopAt.  In the realtime case, this will stick a placeholder event out
-        // at the end of time.
-        //
-        if (m_stop || m_events->IsEmpty ())
-          {
-            done = true;
-          }
-      }
-
-      if (done)
+      ProcessEventsWithContext ();
+
+      //
+      // In all cases we stop when the event list is empty.  If you are doing a 
+      // realtime simulation and you want it to extend out for some time, you must
+      // call StopAt.  In the realtime case, this will stick a placeholder event out
+      // at the end of time.
+      //
+      if (m_stop || m_events->IsEmpty ())
         {
           NS_LOG_LOGIC("done with processing events");
           break;
@@ -356,17 +909,23 @@ SyncSimulatorImpl::Run (void)
   // If the simulator stopped naturally by lack of events, make a
   // consistency test to check that we didn't lose any events along the way.
   //
-  {
-    CriticalSection cs (m_mutex);
+  NS_ASSERT_MSG (m_events->IsEmpty () == false || m_unscheduledEvents == 0,
+    "SyncSimulatorImpl::Run(): Empty queue and unprocessed events");
 
-    NS_ASSERT_MSG (m_events->IsEmpty () == false || m_unscheduledEvents == 0,
-      "SyncSimulatorImpl::Run(): Empty queue and unprocessed events");
-  }
+  StopPartitions ();
+
+  // the last timeslice ends here
+  m_sliceEndTrace ();
 
   NS_LOG_LOGIC("Unregistering at synchronization server");
   // disconnect from sync server
   m_syncClient->SendUnregAndDisconnect();
 
+  m_isWaitingForPermission = false;
+  int fd = m_wakeFd;
+  m_wakeFd = -1;
+  __sync_synchronize ();
+  close (fd);
 
   m_running = false;
 }
@@ -398,26 +957,19 @@ SyncSimulatorImpl::RunOneEvent (void)
   NS_ASSERT_MSG (m_running == false, 
                  "SyncSimulatorImpl::RunOneEvent(): An internal simulator event loop is running");
 
-  EventImpl *event = 0;
+  // other threads only push their events, which are inserted here
+  ProcessEventsWithContext ();
 
-  //
-  // Run this in a critical section in case there's another thread around that
-  // may be inserting things onto the event list.
-  //
-  {
-    CriticalSection cs (m_mutex);
+  Scheduler::Event next = m_events->RemoveNext ();
 
-    Scheduler::Event next = m_events->RemoveNext ();
+  NS_ASSERT (next.key.m_ts >= m_currentTs);
+  __sync_fetch_and_sub (&m_unscheduledEvents, 1);
 
-    NS_ASSERT (next.key.m_ts >= m_currentTs);
-    m_unscheduledEvents--;
-
-    NS_LOG_LOGIC ("handle " << next.key.m_ts);
-    m_currentTs = next.key.m_ts;
-    m_currentContext = next.key.m_context;
-    m_currentUid = next.key.m_ts;
-    event = next.impl;
-  }
+  NS_LOG_LOGIC ("handle " << next.key.m_ts);
+  m_currentTs = next.key.m_ts;
+  m_currentContext = next.key.m_context;
+  m_currentUid = next.key.m_ts;
+  EventImpl *event = next.impl;
   event->Invoke ();
   event->Unref ();
 }
@@ -443,27 +995,22 @@ SyncSimulatorImpl::Schedule (Time const &time, EventImpl *impl)
 {
   NS_LOG_FUNCTION (time << impl);
 
+  if (m_currentPartition != 0)
+    return ScheduleInPartition (CurrentTs () + time.GetTimeStep (), GetContext (), impl);
+
+  NS_ASSERT_MSG (SystemThread::Equals (m_main), "Simulator::Schedule Thread-unsafe invocation!");
+
+  Time tAbsolute = time + TimeStep (m_currentTs);
+  NS_ASSERT_MSG (tAbsolute.IsPositive (), "SyncSimulatorImpl::Schedule(): Negative time");
+  NS_ASSERT_MSG (tAbsolute >= TimeStep (m_currentTs), "SyncSimulatorImpl::Schedule(): time < m_currentTs");
   Scheduler::Event ev;
-  {
-    CriticalSection cs (m_mutex);
-    //
-    // This is the reason we had to bring the absolute time calcualtion in from the
-    // simulator.h into the implementation.  Since the implementations may be 
-    // multi-threaded, we need this calculation to be atomic.  You can see it is
-    // here since we are running in a CriticalSection.
-    //
-    Time tAbsolute = Simulator::Now () + time;
-    NS_ASSERT_MSG (tAbsolute.IsPositive (), "SyncSimulatorImpl::Schedule(): Negative time");
-    NS_ASSERT_MSG (tAbsolute >= TimeStep (m_currentTs), "SyncSimulatorImpl::Schedule(): time < m_currentTs");
-    ev.impl = impl;
-    ev.key.m_ts = (uint64_t) tAbsolute.GetTimeStep ();
-    ev.key.m_context = GetContext();
-    ev.key.m_uid = m_uid;
-    m_uid++;
-    m_unscheduledEvents++;
-    m_events->Insert (ev);
-    m_newEventArrived = true;
-  }
+  ev.impl = impl;
+  ev.key.m_ts = (uint64_t) tAbsolute.GetTimeStep ();
+  ev.key.m_context = GetContext();
+  ev.key.m_uid = __sync_fetch_and_add (&m_uid, 1);
+  __sync_fetch_and_add (&m_unscheduledEvents, 1);
+  m_events->Insert (ev);
+  m_newEventArrived = true;
 
   return EventId (impl, ev.key.m_ts, ev.key.m_context, ev.key.m_uid);
 }
@@ -473,41 +1020,55 @@ SyncSimulatorImpl::ScheduleWithContext (uint32_t context, Time const &time, Even
 {
   NS_LOG_FUNCTION (context << time << impl);
 
-  {
-    CriticalSection cs (m_mutex);
-    uint64_t ts;
-
-    ts = m_currentTs + time.GetTimeStep ();
-    NS_ASSERT_MSG (ts >= m_currentTs, "SyncSimulatorImpl::ScheduleWithContext(): schedule for time < m_currentTs");
-    Scheduler::Event ev;
-    ev.impl = impl;
-    ev.key.m_ts = ts;
-    ev.key.m_context = context;
-    ev.key.m_uid = m_uid;
-    m_uid++;
-    m_unscheduledEvents++;
-    m_events->Insert (ev);
-    m_newEventArrived = true;
-  }
+  if (m_currentPartition != 0)
+    {
+      ScheduleInPartition (CurrentTs () + time.GetTimeStep (), context, impl);
+      return;
+    }
+
+  if (SystemThread::Equals (m_main))
+    {
+      uint64_t ts = m_currentTs + time.GetTimeStep ();
+      NS_ASSERT_MSG (ts >= m_currentTs, "SyncSimulatorImpl::ScheduleWithContext(): schedule for time < m_currentTs");
+      Scheduler::Event ev;
+      ev.impl = impl;
+      ev.key.m_ts = ts;
+      ev.key.m_context = context;
+      ev.key.m_uid = __sync_fetch_and_add (&m_uid, 1);
+      __sync_fetch_and_add (&m_unscheduledEvents, 1);
+      m_events->Insert (ev);
+      m_newEventArrived = true;
+    }
+  else
+    {
+      // relative to the simulation time at which the simulator thread takes the event
+      EventWithContext *ev = new EventWithContext;
+      ev->type = EventWithContext::EVENT;
+      ev->context = context;
+      ev->timestamp = time.GetTimeStep ();
+      ev->event = impl;
+      PushEventWithContext (ev);
+    }
 }
 
 EventId
 SyncSimulatorImpl::ScheduleNow (EventImpl *impl)
 {
   NS_LOG_FUNCTION (impl);
-  Scheduler::Event ev;
-  {
-    CriticalSection cs (m_mutex);
 
-    ev.impl = impl;
-    ev.key.m_ts = m_currentTs;
-    ev.key.m_context = GetContext();
-    ev.key.m_uid = m_uid;
-    m_uid++;
-    m_unscheduledEvents++;
-    m_events->Insert (ev);
-    m_newEventArrived = true;
-  }
+  if (m_currentPartition != 0)
+    return ScheduleInPartition (CurrentTs (), GetContext (), impl);
+
+  NS_ASSERT_MSG (SystemThread::Equals (m_main), "Simulator::ScheduleNow Thread-unsafe invocation!");
+
+  Scheduler::Event ev;
+  ev.impl = impl;
+  ev.key.m_ts = m_currentTs;
+  ev.key.m_context = GetContext();
+  ev.key.m_uid = __sync_fetch_and_add (&m_uid, 1);
+  __sync_fetch_and_add (&m_unscheduledEvents, 1);
+  m_events->Insert (ev);
+  m_newEventArrived = true;
 
   return EventId (impl, ev.key.m_ts, ev.key.m_context, ev.key.m_uid);
 }
@@ -515,25 +1076,57 @@ SyncSimulatorImpl::ScheduleNow (EventImpl *impl)
 void
 SyncSimulatorImpl::ScheduleInCurrentSliceWithContext (uint32_t context, EventImpl *impl)
 {
-  NS_LOG_FUNCTION (context << impl);
-  Scheduler::Event ev;
-  {
-    CriticalSection cs (m_mutex);
+  ScheduleInCurrentSliceWithContext (context, impl, 0);
+}
 
-    if (m_isWaitingForPermission)
-      ev.key.m_ts = m_barrierTime; // schedule at beginning of timeslice we are waiting for
-    else
-      ev.key.m_ts = m_barrierTime - 1; // schedule at the end of the timeslice we are currently running
+void
+SyncSimulatorImpl::ScheduleInCurrentSliceWithContext (uint32_t context, EventImpl *impl, uint64_t receiveTime)
+{
+  NS_LOG_FUNCTION (context << impl << receiveTime);
 
-    NS_LOG_LOGIC ("Scheduling event in current timeslice (event is at " << ev.key.m_ts << ", barrier time is " << m_barrierTime << ")");
+  if (m_currentPartition == 0 && SystemThread::Equals (m_main))
+    {
+      InsertInCurrentSlice (context, impl, receiveTime);
+    }
+  else
+    {
+      // the timeslice is the one in which the simulator thread takes the event
+      // (partitions push as well, the window never reaches the end of the timeslice)
+      EventWithContext *ev = new EventWithContext;
+      ev->type = EventWithContext::SLICE_EVENT;
+      ev->context = context;
+      ev->timestamp = receiveTime;
+      ev->event = impl;
+      PushEventWithContext (ev);
+    }
+}
 
-    ev.impl = impl;
-    ev.key.m_uid = m_uid;
-    m_uid++;
-    m_unscheduledEvents++;
-    m_events->Insert (ev);
-    m_newEventArrived = true;
-  }
+void
+SyncSimulatorImpl::InsertInCurrentSlice (uint32_t context, EventImpl *impl, uint64_t receiveTime)
+{
+  Scheduler::Event ev;
+  if (m_isWaitingForPermission)
+    ev.key.m_ts = m_barrierTime; // schedule at beginning of timeslice we are waiting for
+  else if (m_preciseTimestamps && receiveTime != 0)
+    {
+      // the virtual machines run in real time within a timeslice, so the packet was sent at 
+      // about the same virtual time after the start of the timeslice (a packet received 
+      // before the start is late and goes first)
+      uint64_t elapsed = receiveTime > m_sliceStartWall ? receiveTime - m_sliceStartWall : 0;
+      ev.key.m_ts = std::min (m_sliceStartTs + elapsed, m_barrierTime - 1);
+      ev.key.m_ts = std::max (ev.key.m_ts, m_currentTs);
+    }
+  else
+    ev.key.m_ts = m_barrierTime - 1; // schedule at the end of the timeslice we are currently running
+
+  NS_LOG_LOGIC ("Scheduling event in current timeslice (event is at " << ev.key.m_ts << ", barrier time is " << m_barrierTime << ")");
+
+  ev.impl = impl;
+  ev.key.m_context = context;
+  ev.key.m_uid = __sync_fetch_and_add (&m_uid, 1);
+  __sync_fetch_and_add (&m_unscheduledEvents, 1);
+  m_events->Insert (ev);
+  m_newEventArrived = true;
 }
 
 void
@@ -543,10 +1136,18 @@ SyncSimulatorImpl::ScheduleInCurrentSlice (EventImpl *impl)
   ScheduleInCurrentSliceWithContext(GetContext (), impl);
 }
 
+uint64_t
+SyncSimulatorImpl::GetWallClock (void)
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
 Time
 SyncSimulatorImpl::Now (void) const
 {
-  return TimeStep (m_currentTs);
+  return TimeStep (CurrentTs ());
 }
 
 EventId
@@ -563,9 +1164,9 @@ SyncSimulatorImpl::ScheduleDestroy (EventImpl *impl)
     // overridden by the uid of 2 which identifies this as an event to be 
     // executed at Simulator::Destroy time.
     //
-    id = EventId (Ptr<EventImpl> (impl, false), m_currentTs, 0xffffffff, 2);
+    id = EventId (Ptr<EventImpl> (impl, false), CurrentTs (), 0xffffffff, 2);
     m_destroyEvents.push_back (id);
-    m_uid++;
+    __sync_fetch_and_add (&m_uid, 1);
   }
 
   return id;
@@ -583,7 +1184,7 @@ SyncSimulatorImpl::GetDelayLeft (const EventId &id) const
       return TimeStep (0);
     }
 
-  return TimeStep (id.GetTs () - m_currentTs);
+  return TimeStep (id.GetTs () - CurrentTs ());
 }
 
 void
@@ -609,20 +1210,32 @@ SyncSimulatorImpl::Remove (const EventId &id)
       return;
     }
 
-  {
-    CriticalSection cs (m_mutex);
+  Scheduler::Event event;
+  event.impl = id.PeekEventImpl ();
+  event.key.m_ts = id.GetTs ();
+  event.key.m_context = id.GetContext ();
+  event.key.m_uid = id.GetUid ();
 
-    Scheduler::Event event;
-    event.impl = id.PeekEventImpl ();
-    event.key.m_ts = id.GetTs ();
-    event.key.m_context = id.GetContext ();
-    event.key.m_uid = id.GetUid ();
-    
-    m_events->Remove (event);
-    m_unscheduledEvents++;
-    event.impl->Cancel ();
-    event.impl->Unref ();
-  }
+  Partition *partition = m_currentPartition;
+  if (partition != 0 && event.key.m_ts < m_windowEnd)
+    {
+      // the event is in the window of this partition
+      NS_ABORT_MSG_IF (m_partitions[GetPartition (event.key.m_context)] != partition,
+                       "SyncSimulatorImpl::Remove(): event of another partition within the PartitionLookahead");
+      partition->events->Remove (event);
+    }
+  else if (partition != 0)
+    {
+      CriticalSection cs (m_mutex);
+      m_events->Remove (event);
+    }
+  else
+    {
+      m_events->Remove (event);
+    }
+  __sync_fetch_and_add (&m_unscheduledEvents, 1);
+  event.impl->Cancel ();
+  event.impl->Unref ();
 }
 
 void
@@ -664,9 +1277,12 @@ SyncSimulatorImpl::IsExpired (const EventId &ev) const
   //
   // The same is true for the next line involving the m_currentUid.
   //
+  Partition *partition = m_currentPartition;
+  uint64_t currentTs = partition != 0 ? partition->currentTs : m_currentTs;
+  uint32_t currentUid = partition != 0 ? partition->currentUid : m_currentUid;
   if (ev.PeekEventImpl () == 0 ||
-      ev.GetTs () < m_currentTs ||
-      (ev.GetTs () == m_currentTs && ev.GetUid () <= m_currentUid) ||
+      ev.GetTs () < currentTs ||
+      (ev.GetTs () == currentTs && ev.GetUid () <= currentUid) ||
       ev.PeekEventImpl ()->IsCancelled ()) 
     {
       return true;
@@ -688,7 +1304,8 @@ SyncSimulatorImpl::GetMaximumSimulationTime (void) const
 uint32_t
 SyncSimulatorImpl::GetContext (void) const
 {
-  return m_currentContext;
+  Partition *partition = m_currentPartition;
+  return partition != 0 ? partition->currentContext : m_currentContext;
 }
 
 uint32_t
@@ -44,9 +44,14 @@
 #include "ns3/assert.h"
 #include "ns3/log.h"
 #include "ns3/system-mutex.h"
+#include "ns3/system-thread.h"
+#include "ns3/object-factory.h"
+#include "ns3/traced-callback.h"
 
 #include <list>
+#include <vector>
 #include <time.h>
+#include <pthread.h>
 
 
 // if this is set, the used realtime will be reported to the server
@@ -55,6 +60,8 @@
 
 namespace ns3 {
 
+class Channel;
+
 /**
 * \brief Implements a simulation engine which processes events synchronized with other 
 * simulation toolkits or virtual machines over a siple protocol.
@@ -69,10 +76,52 @@ namespace ns3 {
 * used realtime shall be calculated and reported to the server. If the server doesn't use this information 
 * at all it's not very helpful to calculate this value and the define can be commented out. 
 *
+* If the attribute \em AnnounceNextEvent is set, every finished packet tells the server when the next 
+* event is due (plus the configured \em Lookahead). A server which gets such announcements from all its 
+* clients can then skip idle stretches in a single timeslice.
+*
 * If \em SyncTunnelBridge, \em TapBridge or \em EmuNetDevice are used, received packets are scheduled at 
 * the end of the timeslice in which they have been received or at the beginning of the next timslice in case
 * a packet has been received while waiting for the next run permission. For this reason the chosen timeslice length 
-* has a large influence on the packet delay.
+* has a large influence on the packet delay. SyncTunnelBridge therefore passes the wall-clock time at which a packet 
+* was received: if the attribute \em PreciseTimestamps is set, the packet is scheduled at the same distance from the 
+* start of the timeslice in virtual time as it was received after the run permission in wall-clock time (the virtual 
+* machines run in real time within a timeslice), but not before the current simulation time and not after the end 
+* of the timeslice.
+*
+* Other threads may only call ScheduleWithContext(), ScheduleInCurrentSlice(), ScheduleInCurrentSliceWithContext() 
+* and ScheduleEarlyWork(). Their events are pushed onto a lock-free queue which the simulator thread empties 
+* before each event and while it waits for the next run permission, so the simulator thread itself schedules 
+* events without taking a lock.
+*
+* Work which does not depend on the simulation time (like decoding the packets received by SyncTunnelBridge) 
+* can be handed to the simulator thread with ScheduleEarlyWork(). If the attribute \em AsyncWait is set, 
+* the simulator thread does such work while it waits for the next run permission: it polls the socket of 
+* the SyncClient and wakes up as soon as either a packet of the server or new work arrives. Otherwise (and 
+* if the SyncClient uses shared memory, which cannot be polled) the work is done once the run permission 
+* has arrived.
+*
+* If the attribute \em Threads is larger than 1, the events of a timeslice are executed by that many 
+* threads. The nodes are split into partitions by their context (the node id): nodes connected by a channel 
+* other than a point-to-point link (e.g. a CsmaChannel, whose devices share its state) always end up in the 
+* same partition, the groups of nodes formed that way are distributed round robin over the threads (and 
+* the events are executed by a single thread if all nodes form one group). The simulation advances in 
+* windows of the length \em PartitionLookahead: all events of a window are executed at once, each partition 
+* by its own thread, before the next window starts. This is only correct 
+* if an event of one partition cannot cause an event in another partition earlier than that, so 
+* \em PartitionLookahead has to be the smallest delay of the links between nodes of different partitions. 
+* If it is 0, it is taken from the \em Delay attribute of the channels which connect different partitions 
+* (and the events are executed by a single thread if such a channel has none). Events which do not belong 
+* to a node (context 0xffffffff) are executed alone, between the windows. ns-3 has to be configured with 
+* --enable-parallel-events for this, and the models must not share state between nodes other than through 
+* their channels (e.g. trace sinks that count for all nodes need to synchronize themselves). Events of the 
+* same partition keep their order, but the order of simultaneous events in different partitions and thus 
+* the packet uids differ from run to run.
+*
+* The trace source \em SliceEnd is invoked in the simulator thread when all events of a timeslice have been 
+* executed, right before the finished packet is sent (and once more before unregistering at the end of the 
+* simulation). Models which collect work during a timeslice (like the send queue of SyncTunnelBridge) can 
+* complete it there.
 * 
 * \see SyncClient
 */
@@ -110,10 +159,86 @@ public:
   virtual void ScheduleInCurrentSliceWithContext (uint32_t context, EventImpl *event);
   virtual void ScheduleInCurrentSlice (EventImpl *event);
 
+  /**
+   * Schedules an event in the current timeslice at the virtual time which corresponds to
+   * the wall-clock time at which its cause (e.g. a packet) was received (see \em PreciseTimestamps).
+   * May be called from any thread.
+   *
+   * \param context the context of the event
+   * \param event the event
+   * \param receiveTime the time of GetWallClock() at which the packet was received, 0 if unknown
+   */
+  void ScheduleInCurrentSliceWithContext (uint32_t context, EventImpl *event, uint64_t receiveTime);
+
+  /**
+   * \returns the monotonic wall-clock time in nanoseconds, as used for the receive times
+   */
+  static uint64_t GetWallClock (void);
+
+  /**
+   * Queues work which does not depend on the simulation time (e.g. decoding a packet received
+   * by another thread) to be done by the simulator thread, while it waits for the next run
+   * permission if possible and before the next event at the latest. May be called from any thread.
+   *
+   * \param event the work, invoked (and unrefed) in the simulator thread
+   */
+  void ScheduleEarlyWork (EventImpl *event);
+
 private:
   bool Running (void) const;
 
   void ProcessOneEvent (void);
+  // waits for the next run permission, doing early work meanwhile
+  uint32_t WaitForRunPermission (void);
+
+  // an event or early work handed over by another thread
+  struct EventWithContext
+  {
+    EventWithContext *next;
+    enum { EVENT, SLICE_EVENT, EARLY_WORK } type;
+    uint32_t context;
+    // EVENT: relative to the time at which the simulator thread takes the event,
+    // SLICE_EVENT: the wall-clock receive time (0 if unknown)
+    uint64_t timestamp;
+    EventImpl *event;
+  };
+  // pushes onto m_eventsWithContext (from any thread)
+  void PushEventWithContext (EventWithContext *ev);
+  // inserts the events and does the early work queued by other threads
+  void ProcessEventsWithContext (void);
+  void InsertInCurrentSlice (uint32_t context, EventImpl *impl, uint64_t receiveTime);
+
+  // the events of the nodes of one partition within the current window (see Threads)
+  struct Partition
+  {
+    SyncSimulatorImpl *impl;
+    Ptr<Scheduler> events;
+    Ptr<SystemThread> thread;
+    uint64_t currentTs;
+    uint32_t currentContext;
+    uint32_t currentUid;
+    void Thread (void);
+  };
+
+  uint32_t GetPartition (uint32_t context) const;
+  // puts the nodes connected by a channel other than a point-to-point link into the
+  // same partition, returns the number of partitions with nodes
+  uint32_t AssignPartitions (void);
+  static bool IsPointToPoint (Ptr<Channel> channel);
+  // smallest Delay of the channels between nodes of different partitions (0 if unknown)
+  Time CalculatePartitionLookahead (void) const;
+  void StartPartitions (void);
+  void StopPartitions (void);
+  // executes the events up to the end of the next window in parallel,
+  // returns false if the next event has to be executed alone
+  bool ProcessWindow (void);
+  // executes the events of a partition within the current window
+  void RunPartition (Partition *partition);
+  // loop of the threads of all but the first partition
+  void PartitionThread (Partition *partition);
+  // schedules an event from a partition thread
+  EventId ScheduleInPartition (uint64_t ts, uint32_t context, EventImpl *impl);
+  uint64_t CurrentTs (void) const;
   uint64_t NextTs (void) const;
   virtual void DoDispose (void);
 
@@ -132,16 +257,54 @@ private:
   // after that the sync server has to be asked to release the next timeslice
   uint64_t m_barrierTime;
 
+  // announce the next event to the server and the lookahead added to it
+  bool m_announceNextEvent;
+  Time m_lookahead;
+
   // stores whether the simulation is currently running or waiting for the next run permission
   // this is needed to determine when a received packet shall be scheduled
-  bool m_isWaitingForPermission;
+  volatile bool m_isWaitingForPermission;
+
+  // wait for the run permission in a poll loop that also wakes up for early work
+  bool m_asyncWait;
+
+  // map the receive times of packets scheduled in the current timeslice onto virtual time
+  bool m_preciseTimestamps;
+  // invoked before the end of every timeslice is reported to the server
+  TracedCallback<> m_sliceEndTrace;
+  // start of the current timeslice in virtual time and in wall-clock time (see GetWallClock())
+  uint64_t m_sliceStartTs;
+  uint64_t m_sliceStartWall;
+
+  // parallel execution of the events within a timeslice (see Threads)
+  uint32_t m_threads;
+  Time m_partitionLookahead;
+  ObjectFactory m_schedulerFactory;
+  std::vector<Partition *> m_partitions;
+  // the partition of every node, indexed by its id (see AssignPartitions())
+  std::vector<uint32_t> m_nodePartitions;
+  // length of a window, 0 if the events are executed by a single thread
+  uint64_t m_lookaheadTs;
+  // end of the current window (set before the partition threads start it)
+  uint64_t m_windowEnd;
+  // the partition the calling thread executes, 0 outside of a window
+  static __thread Partition *m_currentPartition;
+  // start and completion of the windows, protected by m_windowLock
+  pthread_mutex_t m_windowLock;
+  pthread_cond_t m_windowStart;
+  pthread_cond_t m_windowDone;
+  uint32_t m_windowGeneration;
+  uint32_t m_busyPartitions;
+  bool m_partitionsExit;
 
   // used to determine how much realtime it took to process a timeslice
   #ifdef SEND_REALTIME
   struct timeval lastTimeval;
   #endif
 
-  // The following variables are protected using the m_mutex
+  // The following variables are only changed by the simulator thread, except that the partitions 
+  // insert events beyond their window into m_events under m_mutex and change m_uid and 
+  // m_unscheduledEvents atomically
   Ptr<Scheduler> m_events;
   int m_unscheduledEvents;
   uint32_t m_uid;
@@ -151,6 +314,12 @@ private:
   uint32_t m_currentSystemId;
   // is set if new event arrived while waiting for the next timeslice
   bool m_newEventArrived;
+  SystemThread::ThreadId m_main;
+  // events and work of other threads, a lock-free stack (newest first) which the simulator 
+  // thread takes as a whole
+  EventWithContext * volatile m_eventsWithContext;
+  // eventfd which wakes up the simulator thread when early work arrives while waiting (-1 outside of Run)
+  int m_wakeFd;
 
   mutable SystemMutex m_mutex;
 };
@@ -70,6 +70,12 @@ SyncTunnelBridge::GetTypeId (void)
                    IntegerValue (17),
                    MakeIntegerAccessor (&SyncTunnelBridge::m_flowId),
                    MakeIntegerChecker<int32_t> ())
+    .AddAttribute ("TunnelCoalescing",
+                   "Offer the other side of the tunnel to coalesce the frames of this flow, "
+                   "several per datagram",
+                   BooleanValue (false),
+                   MakeBooleanAccessor (&SyncTunnelBridge::m_coalescing),
+                   MakeBooleanChecker ())
     .AddAttribute ("Mode", 
                    "The operating and configuration mode to use.",
                    EnumValue (USE_BRIDGE),
@@ -100,6 +106,9 @@ SyncTunnelBridge::~SyncTunnelBridge()
 SyncTunnelBridge::DoDispose ()
 {
   NS_LOG_FUNCTION_NOARGS ();
+  // the last bridge stops the receive threads, so no more work is queued in the simulator
+  if (m_isStarted)
+    StopTunnel ();
   NetDevice::DoDispose ();
 }
 
@@ -119,6 +128,12 @@ SyncTunnelBridge::StartTunnel (void)
   m_destSockAddr.sin_family = AF_INET;
   m_destSockAddr.sin_port = htons(m_destPort);
   m_destSockAddr.sin_addr.s_addr = htonl(m_destAddress.Get());
+
+  if (m_coalescing)
+    {
+      NS_LOG_LOGIC("Offering to coalesce the frames of flowId " << m_flowId);
+      SyncTunnelComm::EnableCoalescing (m_flowId, m_destSockAddr);
+    }
   
   m_isStarted = true;
 }
@@ -136,27 +151,60 @@ SyncTunnelBridge::StopTunnel (void)
 }
 
 void
-SyncTunnelBridge::ForwardToBridgedDevice (uint8_t *buf, uint32_t len)
+SyncTunnelBridge::ForwardToBridgedDevice (const uint8_t *buf, uint32_t len)
 {
   NS_LOG_FUNCTION (buf << len);
 
-  // create Packet out of the buffer which has been received and free that buffer
-  Ptr<Packet> packet = Create<Packet> (reinterpret_cast<const uint8_t *> (buf), len);
-  free (buf);
-  buf = 0;
+  Address src, dst;
+  uint16_t type;
+
+  Ptr<Packet> packet = Decode (buf, len, &src, &dst, &type);
+  if (packet == 0)
+    return;
+
+  SendToBridgedDevice (packet, src, dst, type);
+}
+
+void
+SyncTunnelBridge::DecodeFromTunnel (const uint8_t *buf, uint32_t len, uint64_t receiveTime, SyncSimulatorImpl *impl)
+{
+  NS_LOG_FUNCTION (buf << len << receiveTime << impl);
 
   Address src, dst;
   uint16_t type;
 
+  Ptr<Packet> packet = Decode (buf, len, &src, &dst, &type);
+  if (packet == 0)
+    return;
+
+  // only the forwarding depends on the simulation time
+  EventImpl *event = MakeEvent (&SyncTunnelBridge::SendToBridgedDevice, this, packet, src, dst, type);
+  impl->ScheduleInCurrentSliceWithContext (m_node->GetId (), event, receiveTime);
+}
+
+Ptr<Packet>
+SyncTunnelBridge::Decode (const uint8_t *buf, uint32_t len, Address *src, Address *dst, uint16_t *type)
+{
+  // create Packet out of the buffer which has been received
+  // (the buffer belongs to SyncTunnelComm which recycles it afterwards)
+  Ptr<Packet> packet = Create<Packet> (buf, len);
+  buf = 0;
+
   NS_LOG_LOGIC ("Received packet from tunnel");
 
   // check if packet is suited for ns-3
-  Ptr<Packet> p = Filter (packet, &src, &dst, &type);
+  Ptr<Packet> p = Filter (packet, src, dst, type);
   if (p == 0)
     {
       NS_LOG_LOGIC ("Discarding packet as unfit for ns-3 consumption");
-      return;
     }
+  return p;
+}
+
+void
+SyncTunnelBridge::SendToBridgedDevice (Ptr<Packet> packet, Address src, Address dst, uint16_t type)
+{
+  NS_LOG_FUNCTION (packet << src << dst << type);
 
   NS_LOG_LOGIC ("Pkt source is " << src);
   NS_LOG_LOGIC ("Pkt destination is " << dst);
@@ -350,20 +398,11 @@ SyncTunnelBridge::ReceiveFromBridgedDevice (
   NS_ABORT_MSG_IF(p->GetSize() < 0, "SyncTunnelBridge::ReceiveFromBridgedDevice(): Packet has negative length");
   NS_ABORT_MSG_IF(m_flowId < 0, "SyncTunnelBridge::ReceiveFromBridgedDevice(): Negative flow id");
 
-  // copy the packet into the TunPacket data structure
-  struct SyncBridgeCom::TunPacket *tpacket = (struct SyncBridgeCom::TunPacket*) malloc (sizeof (struct SyncBridgeCom::TunPacket) + p->GetSize());
-  NS_ABORT_MSG_IF(tpacket == NULL, "SyncTunnelBridge::ReceiveFromBridgedDevice(): malloc failed");
-  tpacket->len = htons((uint16_t)(p->GetSize())); // use htons because len and flowid are signed int32
-  tpacket->flowid = htons((uint16_t)m_flowId);
-  p->CopyData ((uint8_t *)tpacket->data, p->GetSize());
-
-  // send the packet through the tunnel
-  int bytes_sent = SyncTunnelComm::SendTo((unsigned char*) tpacket, sizeof (struct SyncBridgeCom::TunPacket) + p->GetSize() , 0, (struct sockaddr*) &m_destSockAddr, sizeof(struct sockaddr_in));
-  NS_ABORT_MSG_IF (bytes_sent == -1, "SyncTunnelBridge::ReceiveFromBridgedDevice(): Send error, errno = " << strerror (errno));
-
-  free(tpacket);
+  // queue the packet to be sent through the tunnel
+  // (it is serialized into a buffer of the send queue of SyncTunnelComm)
+  SyncTunnelComm::SendPacket (p, m_flowId, m_destSockAddr);
 
-  NS_LOG_LOGIC("Sent packet to tunnel");
+  NS_LOG_LOGIC("Queued packet for tunnel");
 
   return true;
 }
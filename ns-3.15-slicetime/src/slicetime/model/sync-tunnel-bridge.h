@@ -52,10 +52,20 @@ namespace ns3 {
       char data[];
     };
 
+    // flowid of a TunPacket which bundles several TunPackets (len is their number)
+    const uint16_t TUN_BUNDLE = 0xffff;
+
+    // the TunPackets in a bundle start at multiples of this
+    const uint32_t TUN_BUNDLE_ALIGN = 4;
+
+    // largest datagram of a bundle (the largest UDP payload)
+    const uint32_t TUN_BUNDLE_SIZE = 65507;
+
   } // namespace SyncBridgeCom
 
 
 class Node;
+class SyncSimulatorImpl;
 
 
 /**
@@ -94,12 +104,21 @@ class Node;
  * - \em data contains an ethernet frame and \em len is it's length
  * - \em flowid is used to distinguish the traffic of different nodes which share the same udp tunnel
  *
+ * Both fields hold 16 bit values in network byte order. Optionally, several TunPackets (also of different
+ * flows) can be coalesced into one datagram of up to 64 KB: the datagram starts with a TunPacket header 
+ * whose flowid is SyncBridgeCom::TUN_BUNDLE and whose len is the number of TunPackets which follow, each 
+ * starting at a multiple of 4 bytes. This is negotiated per flow: a side which is willing to coalesce 
+ * the frames of a flow (attribute \em TunnelCoalescing) offers it with a bundle which holds an empty 
+ * TunPacket of the flow, and it sends bundles for the flow once it has received a bundle with a 
+ * TunPacket of the flow from the other side. Bundles are always accepted, and a side which does not 
+ * know them drops the offers as packets of an unknown flow.
+ *
  * Because of flowid it is sufficient to open one listening socket to receive the traffic for all
  * SyncTunnelBridges in the ns-3 simulation. However there has to be one SyncTunnelBridge for each 
  * ghost node which bridges to some net device. In order to solve this, SyncTunnelBridge uses the helper
  * SyncTunnelComm of which only one instance is created in the whole simulation. This helper spins up 
- * an extra thread which waits for packets from the tunnel endpoint. Because of this extra thread, SyncTunnelBridge
- * has to be used with either SyncSimulatorImpl or RealtimeSimulatorImpl. The socket which SyncTunnelComm creates 
+ * extra threads which wait for packets from the tunnel endpoint. Because of these extra threads, SyncTunnelBridge
+ * has to be used with either SyncSimulatorImpl or RealtimeSimulatorImpl. The first socket which SyncTunnelComm creates 
  * is also used by all SyncTunnelBridges to send the data, but with different recipient addresses if needed.
  *
  * SyncTunnelBridge has 3 configuration attributes:
@@ -107,9 +126,11 @@ class Node;
  *   is sent
  * - \em TunnelFlowId sets the flow id which is used inside the TunPackets which are sent to the other side and 
  *   therefore determines the node on the other side of the tunnel
+ * - \em TunnelCoalescing offers the other side to coalesce the frames of this flow (see above)
  *
  * Since the port and address to receive traffic on is used in SyncTunnelComm of which only one instance exists,  
- * they are set with the global values SyncTunnelReceivePort and SyncTunnelReceiveAddress.
+ * they are set with the global values SyncTunnelReceivePort and SyncTunnelReceiveAddress. The global value
+ * SyncTunnelReceiveThreads sets the number of threads (and sockets) which share the reception.
  */
 
 
@@ -154,10 +175,23 @@ public:
    * Forward a packet received from the tunnel to the bridged ns-3 device
    *
    * \param buf A character buffer containing the actaul packet bits that were
-   *            received from the host.
+   *            received from the host (is only read, not freed).
    * \param buf The length of the buffer.
    */
-  void ForwardToBridgedDevice (uint8_t *buf, uint32_t len);
+  void ForwardToBridgedDevice (const uint8_t *buf, uint32_t len);
+
+  /*
+   * Decode a packet received from the tunnel and schedule its forwarding to the 
+   * bridged ns-3 device in the current timeslice of the SyncSimulatorImpl
+   * (is queued as early work, so that the simulator thread can decode the 
+   * packet while it waits for the next run permission)
+   *
+   * \param buf the received packet bits (are only read, not freed)
+   * \param len The length of the buffer.
+   * \param receiveTime the wall-clock time at which the packet was received (see SyncSimulatorImpl::GetWallClock())
+   * \param impl the simulator implementation to schedule the forwarding with
+   */
+  void DecodeFromTunnel (const uint8_t *buf, uint32_t len, uint64_t receiveTime, SyncSimulatorImpl *impl);
 
   /**
    * Set the operating mode of this device.
@@ -220,6 +254,12 @@ private:
   // checks whether packet is suited for ns-3
   Ptr<Packet> Filter (Ptr<Packet> packet, Address *src, Address *dst, uint16_t *type);
 
+  // creates a packet out of a buffer received from the tunnel, 0 if unfit for ns-3
+  Ptr<Packet> Decode (const uint8_t *buf, uint32_t len, Address *src, Address *dst, uint16_t *type);
+
+  // hands a decoded packet to the bridged ns-3 device
+  void SendToBridgedDevice (Ptr<Packet> packet, Address src, Address dst, uint16_t type);
+
   // receive callbacks
   // (just for compatiblity to NetDevice; are never called)
   NetDevice::ReceiveCallback m_rxCallback;
@@ -243,6 +283,7 @@ private:
   Ipv4Address m_destAddress;
   uint16_t m_destPort;
   int32_t m_flowId;
+  bool m_coalescing;
 
   // mac address of this device
   // (again for compatibility; is not used)
@@ -33,6 +33,8 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <sys/socket.h>
+#include <unistd.h>
+#include <sstream>
 
 NS_LOG_COMPONENT_DEFINE ("SyncTunnelComm");
 
@@ -56,6 +58,17 @@ GlobalValue g_syncTunRecvPort = GlobalValue ("SyncTunnelReceivePort",
   UintegerValue (7544),
   MakeUintegerChecker<uint16_t>());
 
+GlobalValue g_syncTunRecvThreads = GlobalValue ("SyncTunnelReceiveThreads",
+  "The number of threads (each with its own socket on the receive port) which receive packets of the sync tunnel",
+  UintegerValue (1),
+  MakeUintegerChecker<uint32_t> (1));
+
+GlobalValue g_syncTunSendBatch = GlobalValue ("SyncTunnelSendBatch",
+  "The number of frames after which the frames queued for the sync tunnel are sent with one call "
+  "(they are also sent at the end of every timeslice of SyncSimulatorImpl)",
+  UintegerValue (32),
+  MakeUintegerChecker<uint32_t> (1, 64));
+
 
 TypeId 
 SyncTunnelComm::GetTypeId (void)
@@ -71,11 +84,117 @@ SyncTunnelComm::SyncTunnelComm ()
   NS_LOG_FUNCTION_NOARGS ();
 
   // get raw pointers of simulator implementations (needed to schedule received packets)
-  // (the decision which of them to use is made later on)
+  // (the decision which of them to use is made later on); they do not hold a reference,
+  // so the implementation is still disposed by Simulator::Destroy()
   Ptr<RealtimeSimulatorImpl> rtImpl = DynamicCast<RealtimeSimulatorImpl> (Simulator::GetImplementation ());
-  m_rtImpl = GetPointer (rtImpl);
+  m_rtImpl = PeekPointer (rtImpl);
   Ptr<SyncSimulatorImpl> syncImpl = DynamicCast<SyncSimulatorImpl> (Simulator::GetImplementation ());
-  m_syncImpl = GetPointer (syncImpl);
+  m_syncImpl = PeekPointer (syncImpl);
+
+  // no bridges are registered yet
+  m_bridges = (SyncTunnelBridge * volatile *) calloc (MAX_FLOWS, sizeof (SyncTunnelBridge *));
+  NS_ABORT_MSG_IF (m_bridges == NULL, "SyncTunnelComm::SyncTunnelComm(): calloc failed");
+  m_numBridges = 0;
+  m_stop = false;
+  m_references = 1;
+
+  // no flow is coalesced yet
+  m_flowFlags = (volatile uint8_t *) calloc (MAX_FLOWS, sizeof (uint8_t));
+  NS_ABORT_MSG_IF (m_flowFlags == NULL, "SyncTunnelComm::SyncTunnelComm(): calloc failed");
+
+  // set up the send queue; without timeslices to flush it at, every frame is sent at once
+  m_sendQueue = (SendQueue *) malloc (sizeof (SendQueue));
+  NS_ABORT_MSG_IF (m_sendQueue == NULL, "SyncTunnelComm::SyncTunnelComm(): malloc failed");
+  m_sendQueue->count = 0;
+  memset (m_sendQueue->msgs, 0, sizeof (m_sendQueue->msgs));
+  for (uint32_t i = 0; i < SEND_BATCH; i++)
+    {
+      m_sendQueue->iovecs[i].iov_base = m_sendQueue->buffers[i];
+      m_sendQueue->msgs[i].msg_hdr.msg_iov = &m_sendQueue->iovecs[i];
+      m_sendQueue->msgs[i].msg_hdr.msg_iovlen = 1;
+      m_sendQueue->msgs[i].msg_hdr.msg_name = &m_sendQueue->dests[i];
+      m_sendQueue->msgs[i].msg_hdr.msg_namelen = sizeof (struct sockaddr_in);
+    }
+  m_sendQueue->numBundles = 0;
+  memset (m_sendQueue->bundleMsgs, 0, sizeof (m_sendQueue->bundleMsgs));
+  for (uint32_t i = 0; i < SEND_BUNDLES; i++)
+    {
+      m_sendQueue->bundleIovecs[i].iov_base = m_sendQueue->bundles[i].buffer;
+      m_sendQueue->bundleMsgs[i].msg_hdr.msg_iov = &m_sendQueue->bundleIovecs[i];
+      m_sendQueue->bundleMsgs[i].msg_hdr.msg_iovlen = 1;
+      m_sendQueue->bundleMsgs[i].msg_hdr.msg_name = &m_sendQueue->bundles[i].dest;
+      m_sendQueue->bundleMsgs[i].msg_hdr.msg_namelen = sizeof (struct sockaddr_in);
+    }
+  UintegerValue sendBatch;
+  g_syncTunSendBatch.GetValue (sendBatch);
+  m_sendThreshold = m_syncImpl != NULL ? sendBatch.Get () : 1;
+  if (m_syncImpl != NULL)
+    {
+      m_syncImpl->TraceConnectWithoutContext ("SliceEnd", MakeCallback (&SyncTunnelComm::FlushSendQueue, this));
+    }
+
+  // get the number of receive threads (is stored in a global variable)
+  UintegerValue numThreads;
+  g_syncTunRecvThreads.GetValue (numThreads);
+
+  // create the sockets first, so that no shard misses packets because it is bound later
+  for (uint32_t i = 0; i < numThreads.Get (); i++)
+    {
+      Shard *shard = new Shard;
+      shard->comm = this;
+      shard->index = i;
+      shard->sock = CreateSocket (numThreads.Get () > 1);
+      // the pool of receive batches is filled as needed by the read thread
+      shard->freeBatches = NULL;
+      shard->ownBatches = NULL;
+      shard->batches = 0;
+      shard->packets = 0;
+      shard->discarded = 0;
+      m_shards.push_back (shard);
+    }
+
+  // start up the read threads
+  for (uint32_t i = 0; i < m_shards.size (); i++)
+    {
+      NS_LOG_LOGIC("Creating thread " << i << " which waits for tunnel data");
+      m_shards[i]->readThread = Create<SystemThread> (MakeCallback (&Shard::Run, m_shards[i]));
+      m_shards[i]->readThread->Start ();
+    }
+}
+
+SyncTunnelComm::~SyncTunnelComm ()
+{
+  NS_LOG_FUNCTION_NOARGS ();
+
+  for (uint32_t i = 0; i < m_shards.size (); i++)
+    {
+      Shard *shard = m_shards[i];
+      ReceiveBatch *batch = shard->ownBatches;
+      while (batch != NULL)
+        {
+          ReceiveBatch *next = batch->next;
+          free (batch);
+          batch = next;
+        }
+      batch = shard->freeBatches;
+      while (batch != NULL)
+        {
+          ReceiveBatch *next = batch->next;
+          free (batch);
+          batch = next;
+        }
+      delete shard;
+    }
+  m_shards.clear ();
+  free ((void *) m_bridges);
+  free ((void *) m_flowFlags);
+  free (m_sendQueue);
+}
+
+int32_t
+SyncTunnelComm::CreateSocket (bool reusePort)
+{
+  NS_LOG_FUNCTION (reusePort);
 
   // get port and address to receive on (are stored in a global variable)
   UintegerValue localPort;
@@ -85,26 +204,30 @@ SyncTunnelComm::SyncTunnelComm ()
 
   // create socket
   NS_LOG_LOGIC("Creating socket to receive tunnel data");
-  m_sock = socket (PF_INET, SOCK_DGRAM, IPPROTO_IP);
-  NS_ABORT_MSG_IF (m_sock < 0, "SyncTunnelComm::SyncTunnelComm(): Could not create socket!");
+  int32_t sock = socket (PF_INET, SOCK_DGRAM, IPPROTO_IP);
+  NS_ABORT_MSG_IF (sock < 0, "SyncTunnelComm::SyncTunnelComm(): Could not create socket!");
+
+  // let the kernel distribute the flows over the sockets of all shards
+  if (reusePort)
+    {
+#ifdef SO_REUSEPORT
+      int on = 1;
+      int result = setsockopt (sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof (on));
+      NS_ABORT_MSG_IF (result < 0, "SyncTunnelComm::SyncTunnelComm(): Could not set SO_REUSEPORT, errno = " << strerror (errno));
+#else
+      NS_FATAL_ERROR ("SyncTunnelComm::SyncTunnelComm(): SyncTunnelReceiveThreads > 1 requires SO_REUSEPORT");
+#endif
+    }
 
   // bind socket
   struct sockaddr_in sa;
   sa.sin_family = AF_INET;
   sa.sin_addr.s_addr = htonl ((localAddress.Get ()).Get ());
   sa.sin_port = htons (localPort.Get ());
-  int bound = bind (m_sock, (struct sockaddr *)&sa, sizeof (struct sockaddr));
+  int bound = bind (sock, (struct sockaddr *)&sa, sizeof (struct sockaddr));
   NS_ABORT_MSG_IF (bound < 0, "SyncTunnelComm::SyncTunnelComm(): Could not bind socket!");
 
-  // start up the read thread
-  NS_LOG_LOGIC("Creating thread which waits for tunnel data");
-  m_readThread = Create<SystemThread> (MakeCallback (&SyncTunnelComm::ReadThread, this));
-  m_readThread->Start ();
-}
-
-SyncTunnelComm::~SyncTunnelComm ()
-{
-  NS_LOG_FUNCTION_NOARGS ();
+  return sock;
 }
 
 void SyncTunnelComm::Register (uint32_t flowid, SyncTunnelBridge* bridge)
@@ -120,9 +243,12 @@ void SyncTunnelComm::Register (uint32_t flowid, SyncTunnelBridge* bridge)
     m_comm = new SyncTunnelComm();
     }
 
-  // insert an entry for this flowid in the map
-  NS_ABORT_MSG_IF (m_comm->m_allBridges.count (flowid) != 0, "SyncTunnelComm::Register(): Flowid " << flowid << " is already registered");
-  m_comm->m_allBridges.insert (std::pair<int32_t, SyncTunnelBridge*> (flowid, bridge));
+  // insert an entry for this flowid in the table
+  NS_ABORT_MSG_IF (flowid >= MAX_FLOWS, "SyncTunnelComm::Register(): Flowid " << flowid << " does not fit into 16 bits");
+  NS_ABORT_MSG_IF (flowid == SyncBridgeCom::TUN_BUNDLE, "SyncTunnelComm::Register(): Flowid " << flowid << " is reserved for bundles");
+  NS_ABORT_MSG_IF (m_comm->m_bridges[flowid] != NULL, "SyncTunnelComm::Register(): Flowid " << flowid << " is already registered");
+  m_comm->m_bridges[flowid] = bridge;
+  m_comm->m_numBridges++;
 
 }
 
@@ -132,25 +258,46 @@ void SyncTunnelComm::Unregister (uint32_t flowid)
 
   NS_LOG_LOGIC("SyncTunnelBridge with flowid " << flowid << " wants to unregister");
 
-  // remove from map
-  NS_ABORT_MSG_IF (m_comm->m_allBridges.count (flowid) != 1, "SyncTunnelComm::Unregister(): Flowid " << flowid << " is not registered");
-  m_comm->m_allBridges.erase (flowid);
+  // remove from table
+  NS_ABORT_MSG_IF (flowid >= MAX_FLOWS || m_comm->m_bridges[flowid] == NULL, "SyncTunnelComm::Unregister(): Flowid " << flowid << " is not registered");
+  m_comm->m_bridges[flowid] = NULL;
+  m_comm->m_numBridges--;
 
   // if this was the last registered bridge, stop and remove the comm object
-  if (m_comm->m_allBridges.empty ())
+  if (m_comm->m_numBridges == 0)
     {
     NS_LOG_LOGIC("Stopping the SyncTunnelComm instance since this was the last registered bridge");
-    
-    // stop thread
-    m_comm->m_readThread->Join ();
-    m_comm->m_readThread = 0;
+    m_comm->FlushSendQueue ();
+    if (m_comm->m_syncImpl != NULL)
+      {
+        m_comm->m_syncImpl->TraceDisconnectWithoutContext ("SliceEnd", MakeCallback (&SyncTunnelComm::FlushSendQueue, m_comm));
+      }
+    std::ostringstream stats;
+    PrintStatistics (stats);
+    NS_LOG_INFO (stats.str ());
 
-    // close socket
-    close(m_comm->m_sock);
+    // stop threads (shutting down the sockets wakes them up)
+    m_comm->m_stop = true;
+    for (uint32_t i = 0; i < m_comm->m_shards.size (); i++)
+      {
+        shutdown (m_comm->m_shards[i]->sock, SHUT_RDWR);
+      }
+    for (uint32_t i = 0; i < m_comm->m_shards.size (); i++)
+      {
+        m_comm->m_shards[i]->readThread->Join ();
+        m_comm->m_shards[i]->readThread = 0;
 
-    // delete comm object
-    free(m_comm);
+        // close socket
+        close(m_comm->m_shards[i]->sock);
+      }
+
+    // delete comm object, or leave it to the release of the last batch which is still pending
+    SyncTunnelComm *comm = m_comm;
     m_comm = NULL;
+    if (__sync_sub_and_fetch (&comm->m_references, 1) == 0)
+      {
+        delete comm;
+      }
     }
 
 }
@@ -159,71 +306,440 @@ ssize_t SyncTunnelComm::SendTo(const void *buf, size_t len, int flags, const str
 {
   NS_ASSERT(m_comm != NULL);
   NS_LOG_LOGIC("Sending packet through SyncTunnel");
-  return sendto(m_comm->m_sock, buf, len, flags, dest_addr, addrlen);
+  return sendto(m_comm->m_shards[0]->sock, buf, len, flags, dest_addr, addrlen);
 }
 
-void SyncTunnelComm::ReadThread() {
-  NS_LOG_FUNCTION_NOARGS ();
+void SyncTunnelComm::SendPacket (Ptr<const Packet> packet, int32_t flowid, const struct sockaddr_in &dest)
+{
+  NS_ASSERT(m_comm != NULL);
+  uint32_t size = sizeof (struct SyncBridgeCom::TunPacket) + packet->GetSize ();
+
+  CriticalSection cs (m_comm->m_sendMutex);
+
+  // frames of flows which both sides coalesce go into the bundle for their destination
+  if (m_comm->m_flowFlags[(uint16_t) flowid] == (FLOW_COALESCE | FLOW_PEER_COALESCES)
+      && sizeof (struct SyncBridgeCom::TunPacket) + size <= SyncBridgeCom::TUN_BUNDLE_SIZE)
+    {
+      m_comm->AddToBundle (packet, flowid, dest);
+      return;
+    }
+
+  // frames which do not fit into a buffer of the queue are sent on their own, after the queued ones
+  if (size > SEND_BUFFER)
+    {
+      m_comm->DoFlushSendQueue ();
+      struct SyncBridgeCom::TunPacket *tpacket = (struct SyncBridgeCom::TunPacket*) malloc (size);
+      NS_ABORT_MSG_IF(tpacket == NULL, "SyncTunnelComm::SendPacket(): malloc failed");
+      tpacket->len = htons((uint16_t)(packet->GetSize())); // use htons because len and flowid are signed int32
+      tpacket->flowid = htons((uint16_t)flowid);
+      packet->CopyData ((uint8_t *)tpacket->data, packet->GetSize());
+      NS_LOG_LOGIC("Sending packet through SyncTunnel");
+      int bytes_sent = sendto(m_comm->m_shards[0]->sock, tpacket, size, 0, (const struct sockaddr *) &dest, sizeof (struct sockaddr_in));
+      NS_ABORT_MSG_IF (bytes_sent == -1, "SyncTunnelComm::SendPacket(): Send error, errno = " << strerror (errno));
+      free(tpacket);
+      return;
+    }
+
+  // serialize the frame into the next buffer of the queue
+  SendQueue *queue = m_comm->m_sendQueue;
+  uint32_t i = queue->count++;
+  struct SyncBridgeCom::TunPacket *tpacket = (struct SyncBridgeCom::TunPacket*) queue->buffers[i];
+  tpacket->len = htons((uint16_t)(packet->GetSize())); // use htons because len and flowid are signed int32
+  tpacket->flowid = htons((uint16_t)flowid);
+  packet->CopyData ((uint8_t *)tpacket->data, packet->GetSize());
+  queue->iovecs[i].iov_len = size;
+  queue->dests[i] = dest;
+  NS_LOG_LOGIC("Queued packet for SyncTunnel (" << queue->count << " queued)");
+
+  if (queue->count + queue->numBundles >= m_comm->m_sendThreshold)
+    {
+      m_comm->DoFlushSendQueue ();
+    }
+}
+
+void
+SyncTunnelComm::AddToBundle (Ptr<const Packet> packet, int32_t flowid, const struct sockaddr_in &dest)
+{
+  SendQueue *queue = m_sendQueue;
+  uint32_t size = sizeof (struct SyncBridgeCom::TunPacket) + packet->GetSize ();
+
+  // find the bundle for the destination, send everything if it is full or if no bundle is left for it
+  // (the queued frames go first, so that the frames of every flow stay in order)
+  Bundle *bundle = NULL;
+  for (uint32_t i = 0; i < queue->numBundles; i++)
+    {
+      if (queue->bundles[i].dest.sin_addr.s_addr == dest.sin_addr.s_addr
+          && queue->bundles[i].dest.sin_port == dest.sin_port)
+        {
+          bundle = &queue->bundles[i];
+          break;
+        }
+    }
+  if (bundle != NULL && bundle->size + size > SyncBridgeCom::TUN_BUNDLE_SIZE)
+    {
+      DoFlushSendQueue ();
+      bundle = NULL;
+    }
+  if (bundle == NULL)
+    {
+      if (queue->numBundles == SEND_BUNDLES)
+        {
+          DoFlushSendQueue ();
+        }
+      bundle = &queue->bundles[queue->numBundles++];
+      bundle->dest = dest;
+      bundle->count = 0;
+      bundle->size = sizeof (struct SyncBridgeCom::TunPacket);
+    }
+
+  // serialize the frame behind the previous one
+  struct SyncBridgeCom::TunPacket *tpacket = (struct SyncBridgeCom::TunPacket*) (bundle->buffer + bundle->size);
+  tpacket->len = htons((uint16_t)(packet->GetSize()));
+  tpacket->flowid = htons((uint16_t)flowid);
+  packet->CopyData ((uint8_t *)tpacket->data, packet->GetSize());
+  bundle->count++;
+  bundle->size += size;
+  bundle->size = (bundle->size + SyncBridgeCom::TUN_BUNDLE_ALIGN - 1) & ~(SyncBridgeCom::TUN_BUNDLE_ALIGN - 1);
+  NS_LOG_LOGIC("Bundled packet for SyncTunnel (" << bundle->count << " in bundle)");
+
+  if (queue->count + queue->numBundles >= m_sendThreshold)
+    {
+      DoFlushSendQueue ();
+    }
+}
+
+void SyncTunnelComm::EnableCoalescing (int32_t flowid, const struct sockaddr_in &dest)
+{
+  NS_LOG_FUNCTION (flowid);
+  NS_ASSERT(m_comm != NULL);
+
+  __sync_fetch_and_or (&m_comm->m_flowFlags[(uint16_t) flowid], (uint8_t) FLOW_COALESCE);
+
+  // the offer is a bundle with an empty TunPacket of the flow
+  struct SyncBridgeCom::TunPacket offer[2];
+  offer[0].flowid = htons(SyncBridgeCom::TUN_BUNDLE);
+  offer[0].len = htons(1);
+  offer[1].flowid = htons((uint16_t)flowid);
+  offer[1].len = htons(0);
+  NS_LOG_LOGIC("Offering to coalesce flow " << flowid);
+  int bytes_sent = sendto(m_comm->m_shards[0]->sock, offer, sizeof (offer), 0, (const struct sockaddr *) &dest, sizeof (struct sockaddr_in));
+  NS_ABORT_MSG_IF (bytes_sent == -1, "SyncTunnelComm::EnableCoalescing(): Send error, errno = " << strerror (errno));
+}
+
+void
+SyncTunnelComm::FlushSendQueue ()
+{
+  CriticalSection cs (m_sendMutex);
+  DoFlushSendQueue ();
+}
+
+void
+SyncTunnelComm::DoFlushSendQueue ()
+{
+  SendQueue *queue = m_sendQueue;
+  if (queue->count > 0)
+    {
+      NS_LOG_LOGIC("Sending " << queue->count << " packets through SyncTunnel");
+      SendMessages (queue->msgs, queue->count);
+      queue->count = 0;
+    }
+
+  if (queue->numBundles > 0)
+    {
+      NS_LOG_LOGIC("Sending " << queue->numBundles << " bundles through SyncTunnel");
+      for (uint32_t i = 0; i < queue->numBundles; i++)
+        {
+          struct SyncBridgeCom::TunPacket *header = (struct SyncBridgeCom::TunPacket*) queue->bundles[i].buffer;
+          header->flowid = htons(SyncBridgeCom::TUN_BUNDLE);
+          header->len = htons((uint16_t) queue->bundles[i].count);
+          queue->bundleIovecs[i].iov_len = queue->bundles[i].size;
+        }
+      SendMessages (queue->bundleMsgs, queue->numBundles);
+      queue->numBundles = 0;
+    }
+}
+
+void
+SyncTunnelComm::SendMessages (struct mmsghdr *msgs, uint32_t count)
+{
+  uint32_t sent = 0;
+  while (sent < count)
+    {
+      int result = sendmmsg (m_shards[0]->sock, msgs + sent, count - sent, 0);
+      if (result == -1 && errno == EINTR)
+        continue;
+      NS_ABORT_MSG_IF (result == -1, "SyncTunnelComm::FlushSendQueue(): Send error, errno = " << strerror (errno));
+      sent += result;
+    }
+}
+
+void SyncTunnelComm::PrintStatistics (std::ostream &os)
+{
+  if (m_comm == NULL)
+    return;
+
+  for (uint32_t i = 0; i < m_comm->m_shards.size (); i++)
+    {
+      Shard *shard = m_comm->m_shards[i];
+      os << "SyncTunnelComm shard " << i << ": " << shard->batches << " batches, "
+         << shard->packets << " frames, " << shard->discarded << " discarded" << std::endl;
+    }
+}
+
+SyncTunnelComm::ReceiveBatch *
+SyncTunnelComm::AllocateBatch (Shard *shard)
+{
+  // take all batches released by the simulator thread at once if the own ones are used up
+  // (only the read thread of the shard takes batches, so there is no ABA problem)
+  if (shard->ownBatches == NULL)
+    {
+      shard->ownBatches = __sync_lock_test_and_set (&shard->freeBatches, (ReceiveBatch *) NULL);
+    }
+  if (shard->ownBatches != NULL)
+    {
+      ReceiveBatch *batch = shard->ownBatches;
+      shard->ownBatches = batch->next;
+      return batch;
+    }
+
+  NS_LOG_LOGIC("Allocating a new receive batch");
+  ReceiveBatch *batch = (ReceiveBatch *) malloc (sizeof (ReceiveBatch));
+  NS_ABORT_MSG_IF(batch == NULL, "SyncTunnelComm::AllocateBatch(): malloc failed");
+  batch->shard = shard;
+  memset (batch->msgs, 0, sizeof (batch->msgs));
+  for (uint32_t i = 0; i < RECEIVE_BATCH; i++)
+    {
+      batch->iovecs[i].iov_base = batch->buffers[i];
+      batch->iovecs[i].iov_len = RECEIVE_BUFFER;
+      batch->msgs[i].msg_hdr.msg_iov = &batch->iovecs[i];
+      batch->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+  return batch;
+}
+
+void
+SyncTunnelComm::ReleaseBatch (ReceiveBatch *batch)
+{
+  Shard *shard = batch->shard;
+  ReceiveBatch *head;
+  do
+    {
+      head = shard->freeBatches;
+      batch->next = head;
+    }
+  while (!__sync_bool_compare_and_swap (&shard->freeBatches, head, batch));
+
+  // the last bridge may have unregistered while the batch was pending
+  if (__sync_sub_and_fetch (&m_references, 1) == 0)
+    {
+      NS_LOG_LOGIC("Deleting the SyncTunnelComm instance since its last batch was released");
+      delete this;
+    }
+}
 
-  // run in an infinte loop and wait for packets to arrive
-  for(;;)
+SyncTunnelComm::FrameIterator::FrameIterator (const uint8_t *buffer, uint32_t size)
+  : m_pos (buffer),
+    m_end (buffer + size),
+    m_left (1),
+    m_bundle (false),
+    m_malformed (false)
+{
+  const struct SyncBridgeCom::TunPacket *tpacket = (const struct SyncBridgeCom::TunPacket*) buffer;
+  if (size >= sizeof (struct SyncBridgeCom::TunPacket) && ntohs(tpacket->flowid) == SyncBridgeCom::TUN_BUNDLE)
+    {
+      m_bundle = true;
+      m_left = ntohs(tpacket->len);
+      m_pos += sizeof (struct SyncBridgeCom::TunPacket);
+    }
+}
+
+bool
+SyncTunnelComm::FrameIterator::Next (uint32_t *flowid, const uint8_t **data, uint32_t *len)
+{
+  if (m_left == 0)
+    return false;
+  m_left--;
+
+  uint32_t available = m_end - m_pos;
+  const struct SyncBridgeCom::TunPacket *tpacket = (const struct SyncBridgeCom::TunPacket*) m_pos;
+  if (available < sizeof (struct SyncBridgeCom::TunPacket)
+      || ntohs(tpacket->len) > available - sizeof (struct SyncBridgeCom::TunPacket))
+    {
+      m_left = 0;
+      m_malformed = true;
+      return false;
+    }
+  *flowid = ntohs(tpacket->flowid);
+  *len = ntohs(tpacket->len);
+  *data = (const uint8_t *) tpacket->data;
+
+  // the next TunPacket of a bundle starts at the next aligned offset (possibly past the end)
+  uint32_t size = sizeof (struct SyncBridgeCom::TunPacket) + *len;
+  size = (size + SyncBridgeCom::TUN_BUNDLE_ALIGN - 1) & ~(SyncBridgeCom::TUN_BUNDLE_ALIGN - 1);
+  m_pos += size < available ? size : available;
+  return true;
+}
+
+bool
+SyncTunnelComm::FrameIterator::IsBundle (void) const
+{
+  return m_bundle;
+}
+
+bool
+SyncTunnelComm::FrameIterator::IsMalformed (void) const
+{
+  return m_malformed;
+}
+
+void
+SyncTunnelComm::DecodeBatch (ReceiveBatch *batch)
+{
+  NS_LOG_FUNCTION (batch << batch->count);
+
+  for (uint32_t i = 0; i < batch->count; i++)
+    {
+      FrameIterator frames (batch->buffers[i], batch->msgs[i].msg_len);
+      uint32_t flowid, len;
+      const uint8_t *data;
+      while (frames.Next (&flowid, &data, &len))
+        {
+          SyncTunnelBridge *bridge = m_bridges[flowid];
+          if (bridge == NULL || (frames.IsBundle () && len == 0))
+            continue;
+          bridge->DecodeFromTunnel (data, len, batch->receiveTime, m_syncImpl);
+        }
+    }
+  ReleaseBatch (batch);
+}
+
+void
+SyncTunnelComm::ForwardFrame (ReceiveBatch *batch, uint32_t flowid, const uint8_t *data, uint32_t len)
+{
+  NS_LOG_FUNCTION (batch << flowid << len);
+
+  // the bridge may have unregistered since the frame was received
+  SyncTunnelBridge *bridge = m_bridges[flowid];
+  if (bridge != NULL)
+    {
+      bridge->ForwardToBridgedDevice (data, len);
+    }
+  if (__sync_sub_and_fetch (&batch->pending, 1) == 0)
+    {
+      ReleaseBatch (batch);
+    }
+}
+
+void SyncTunnelComm::ReadThread(Shard *shard) {
+  NS_LOG_FUNCTION (shard->index);
+
+  NS_ABORT_MSG_IF (m_rtImpl == NULL && m_syncImpl == NULL,
+                   "SyncTunnelBridge::ReadThread(): SyncTunnelBridge has to be used with RealtimeSimulatorImplementation or SyncSimulatorImplementation!");
+
+  // run in a loop and wait for packets to arrive until the comm object is stopped
+  while (!m_stop)
    {
-     // receive next packet
-     NS_LOG_LOGIC("Waiting for the next packet to arrive");
-     uint8_t* databuffer = (uint8_t*) malloc (2000);
-     NS_ABORT_MSG_IF(databuffer == NULL, "SyncTunnelComm::ReadThread(): malloc failed");
-     int bytes_received = recv (m_sock, databuffer, 2000, 0);
-     if(bytes_received == -1)
+     // receive the next packet and all packets which are queued behind it
+     NS_LOG_LOGIC("Waiting for the next packets to arrive");
+     ReceiveBatch *batch = AllocateBatch (shard);
+     int received = recvmmsg (shard->sock, batch->msgs, RECEIVE_BATCH, MSG_WAITFORONE, NULL);
+     if(received <= 0)
        {
-       free(databuffer);
+       batch->next = shard->ownBatches;
+       shard->ownBatches = batch;
        continue;
        }
-     NS_LOG_LOGIC("Received a packet");
-
-     // Split up the TunPacket into its components
-     struct SyncBridgeCom::TunPacket *tpacket = (struct SyncBridgeCom::TunPacket*) databuffer;
-
-     int32_t packet_flowid = ntohs(tpacket->flowid);
-     int32_t packet_len = ntohs(tpacket->len);
-     uint8_t* packet = (uint8_t*) malloc (packet_len);
-     NS_ABORT_MSG_IF(packet == NULL, "SyncTunnelComm::ReadThread(): malloc failed");
-     memcpy(packet, tpacket->data, packet_len);
-     free(databuffer);
-
-     // Get the bridge object this packet is for
-     std::map<int32_t, SyncTunnelBridge*>::iterator it;
-     it = m_allBridges.find(packet_flowid);
-     // if the flowid is not known, simply drop the packet
-     if(it == m_allBridges.end ())
+     // the time of reception determines the virtual time of the packets in SyncSimulatorImpl
+     batch->receiveTime = SyncSimulatorImpl::GetWallClock ();
+     batch->count = received;
+     NS_LOG_LOGIC("Received " << received << " packets");
+     shard->batches++;
+
+     // the realtime events are scheduled while walking the frames, so the batch holds one reference
+     // of its own until all of them are scheduled
+     batch->pending = 1;
+
+     // Split up the datagrams into their TunPackets and look up the bridges they are for
+     uint32_t valid = 0;
+     for (int i = 0; i < received; i++)
        {
-       NS_LOG_LOGIC("Discarding packet since the flowid is unknown");
-       continue;
+         FrameIterator frames (batch->buffers[i], batch->msgs[i].msg_len);
+         uint32_t flowid, len;
+         const uint8_t *data;
+         while (frames.Next (&flowid, &data, &len))
+           {
+             shard->packets++;
+
+             // a bundle with a frame of a flow shows that the other side coalesces it;
+             // an empty TunPacket in a bundle is only an offer to do so
+             if (frames.IsBundle ())
+               {
+                 if (!(m_flowFlags[flowid] & FLOW_PEER_COALESCES))
+                   {
+                     NS_LOG_LOGIC("The other side coalesces flow " << flowid);
+                     __sync_fetch_and_or (&m_flowFlags[flowid], (uint8_t) FLOW_PEER_COALESCES);
+                   }
+                 if (len == 0)
+                   continue;
+               }
+
+             // Get the bridge object this packet is for
+             // (ntohs yields less than MAX_FLOWS, so no bounds check is needed)
+             SyncTunnelBridge *bridge = m_bridges[flowid];
+             // if the flowid is not known, simply drop the packet
+             if(bridge == NULL)
+               {
+               NS_LOG_LOGIC("Discarding packet since the flowid is unknown");
+               shard->discarded++;
+               continue;
+               }
+             valid++;
+
+             // SyncTunnelComm requires a special SimulatorImpl.
+             // If this is RealTimeSimulatorImpl, the received packets have to be scheduled as RealtimeEvents.
+             if (m_rtImpl != NULL)
+               {
+                 __sync_fetch_and_add (&batch->pending, 1);
+                 EventImpl *event = MakeEvent (&SyncTunnelComm::ForwardFrame, this, batch, flowid, data, len);
+                 m_rtImpl->ScheduleRealtimeNowWithContext (bridge->GetNode ()->GetId (), event);
+               }
+           }
+         if (frames.IsMalformed ())
+           {
+           NS_LOG_LOGIC("Discarding packet since it is too short or truncated");
+           shard->packets++;
+           shard->discarded++;
+           }
        }
 
-    SyncTunnelBridge *bridge = it->second;
+     if (valid == 0)
+       {
+       batch->next = shard->ownBatches;
+       shard->ownBatches = batch;
+       continue;
+       }
 
-    NS_LOG_INFO ("SyncTunnelBridge::ReadThread(): Received packet");
+    NS_LOG_INFO ("SyncTunnelBridge::ReadThread(): Received " << valid << " packets");
 
-    // create and schedule an event for this packet
-    EventImpl *event =  MakeEvent (&SyncTunnelBridge::ForwardToBridgedDevice, bridge, packet, packet_len);
-    uint32_t node_id = bridge->GetNode ()->GetId (); 
+    // the batch keeps the comm object alive until it is released (no release can happen before, as
+    // the realtime events wait for the reference of the read thread in pending)
+    __sync_fetch_and_add (&m_references, 1);
 
-    // SyncTunnelComm requires a special SimulatorImpl.
-    // If this is RealTimeSimulatorImpl, the received packet has to be scheduled as RealtimeEvent.
-    // In case of SyncSimulatorImpl there is another special function which is used.
+    // In case of SyncSimulatorImpl the simulator thread decodes the packets as early work
+    // (possibly while waiting for the run permission) and schedules them in the current timeslice;
+    // the whole batch is queued at once.
     if (m_rtImpl != NULL)
       {
-        NS_LOG_INFO ("SyncTunnelBridge::ReadThread(): Scheduling handler in RealtimeSimulatorImpl");
-        m_rtImpl->ScheduleRealtimeNowWithContext (node_id, event);
-      }
-    else if (m_syncImpl != NULL)
-      {
-        NS_LOG_INFO ("SyncTunnelBridge::ReadThread(): Scheduling handler in SyncSimulatorImpl");
-        m_syncImpl->ScheduleInCurrentSliceWithContext (node_id, event);
+        if (__sync_sub_and_fetch (&batch->pending, 1) == 0)
+          {
+            ReleaseBatch (batch);
+          }
       }
     else
       {
-        NS_FATAL_ERROR("SyncTunnelBridge::ReadThread(): SyncTunnelBridge has to be used with RealtimeSimulatorImplementation or SyncSimulatorImplementation!");
+        NS_LOG_INFO ("SyncTunnelBridge::ReadThread(): Queueing decoding in SyncSimulatorImpl");
+        EventImpl *event = MakeEvent (&SyncTunnelComm::DecodeBatch, this, batch);
+        m_syncImpl->ScheduleEarlyWork (event);
       }
 
    }
@@ -27,13 +27,17 @@
 #include "ns3/ipv4-address.h"
 #include "ns3/global-value.h"
 #include "ns3/system-thread.h"
+#include "ns3/system-mutex.h"
+#include "ns3/packet.h"
 #include "ns3/realtime-simulator-impl.h"
 #include "ns3/sync-simulator-impl.h"
 
 #include <arpa/inet.h>
+#include <sys/socket.h>
 #include <stdint.h>
 #include <string>
-#include <map>
+#include <vector>
+#include <ostream>
 
 
 
@@ -45,6 +49,32 @@ namespace ns3 {
  * \brief Helper class for SyncTunnelBridge which handles the reception 
  * and sending of packets from a tunnel.
  * 
+ * Reception is sharded over the number of threads set with the global value
+ * SyncTunnelReceiveThreads: each shard has its own socket bound to the receive port with
+ * SO_REUSEPORT, so the kernel spreads the tunnel flows over the shards by their address
+ * and port (tunnel endpoints should use a source port per flow for this to balance).
+ * The bridges are looked up by flowid in a flat array, since the flowid is 16 bits
+ * wide on the wire.
+ *
+ * Each read thread receives up to RECEIVE_BATCH datagrams with one recvmmsg() call into
+ * a ReceiveBatch. The frames are decoded straight out of the batch's buffers, which are
+ * recycled once all frames have been handed to their bridges, so no memory is allocated
+ * for received packets except for the ns-3 Packets themselves. With SyncSimulatorImpl
+ * all frames of a batch are queued as one early work item. The per-shard counters can be
+ * printed with PrintStatistics().
+ *
+ * Frames sent with SendPacket() are serialized straight into the buffers of a send queue
+ * which is flushed with one sendmmsg() call when it holds SyncTunnelSendBatch frames and
+ * at the end of every timeslice of SyncSimulatorImpl (trace source SliceEnd), so a frame
+ * leaves at the latest when the timeslice in which it was sent has been executed. With
+ * RealtimeSimulatorImpl, which has no timeslices, every frame is sent at once.
+ *
+ * Received datagrams may be bundles of several TunPackets (see SyncTunnelBridge). Once a
+ * flow has been enabled with EnableCoalescing() and a bundle with a frame of the flow has
+ * been received, its frames are coalesced into one bundle per destination instead of
+ * taking a buffer each. A bundle counts as one datagram towards SyncTunnelSendBatch and is
+ * sent when it is full or when the queue is flushed.
+ *
  * @see SyncTunnelBridge
  */
 
@@ -79,6 +109,33 @@ public:
   */
   static ssize_t SendTo(const void *buf, size_t len, int flags, const struct sockaddr *dest_addr, socklen_t addrlen);
 
+  /**
+   * Queues a frame to be sent as TunPacket over the socket which is also used for receiving data.
+   * (the frame is sent when the send queue is flushed, see above)
+   *
+   * \param packet the ethernet frame to send
+   * \param flowid the flowid of the TunPacket
+   * \param dest the tunnel end point to send to
+   */
+  static void SendPacket (Ptr<const Packet> packet, int32_t flowid, const struct sockaddr_in &dest);
+
+  /**
+   * Offers the other side of the tunnel to coalesce the frames of a flow and coalesces the frames
+   * sent for the flow as soon as the other side has accepted (see SyncTunnelBridge).
+   *
+   * \param flowid the flowid (has to be registered)
+   * \param dest the tunnel end point to send the offer to
+   */
+  static void EnableCoalescing (int32_t flowid, const struct sockaddr_in &dest);
+
+  /**
+   * Prints the number of received batches, frames and discarded frames of each receive shard
+   * (nothing if no SyncTunnelComm instance exists).
+   *
+   * \param os the stream to print to
+   */
+  static void PrintStatistics (std::ostream &os);
+
 
 private:
   // pointer to the instance of SyncTunnelComm
@@ -88,17 +145,163 @@ private:
   SyncTunnelComm ();
   virtual ~SyncTunnelComm ();
 
-  // runs in extra thread and receives packets
-  void ReadThread ();
+  // number of datagrams received with one recvmmsg call and size of the buffer of each
+  // (large enough for a bundle; only the pages which are written to are backed by memory)
+  enum { RECEIVE_BATCH = 32, RECEIVE_BUFFER = 65536 };
+
+  // number of frames the send queue can hold and size of the buffer of each
+  enum { SEND_BATCH = 64, SEND_BUFFER = 2048 };
+
+  // number of destinations for which bundles can be open at the same time
+  enum { SEND_BUNDLES = 4 };
+
+  // frames of coalesced flows waiting to be sent to one destination in a single datagram
+  struct Bundle
+  {
+    struct sockaddr_in dest;
+    uint32_t count;
+    uint32_t size;
+    uint8_t buffer[SyncBridgeCom::TUN_BUNDLE_SIZE];
+  };
+
+  // frames waiting to be sent with one sendmmsg call
+  // (the iovecs point to the buffers and the message headers to the iovecs and
+  //   destinations once the queue is set up)
+  struct SendQueue
+  {
+    uint32_t count;
+    struct mmsghdr msgs[SEND_BATCH];
+    struct iovec iovecs[SEND_BATCH];
+    struct sockaddr_in dests[SEND_BATCH];
+    uint8_t buffers[SEND_BATCH][SEND_BUFFER];
+    // the open bundles and their message headers (are linked when they are sent)
+    uint32_t numBundles;
+    struct mmsghdr bundleMsgs[SEND_BUNDLES];
+    struct iovec bundleIovecs[SEND_BUNDLES];
+    Bundle bundles[SEND_BUNDLES];
+  };
+
+  // the flow is coalesced by this side (EnableCoalescing) and by the other side (a bundle was received)
+  enum { FLOW_COALESCE = 1, FLOW_PEER_COALESCES = 2 };
+
+  // number of flowids which can be used (they are 16 bits wide in a TunPacket)
+  enum { MAX_FLOWS = 65536 };
+
+  struct Shard;
+
+  // iterates over the TunPackets of a received datagram, which is either a single TunPacket or a bundle
+  class FrameIterator
+  {
+  public:
+    FrameIterator (const uint8_t *buffer, uint32_t size);
+    // gets the next TunPacket, false if there is none (or the rest of the datagram is malformed)
+    bool Next (uint32_t *flowid, const uint8_t **data, uint32_t *len);
+    // whether the datagram is a bundle
+    bool IsBundle (void) const;
+    // whether the datagram was malformed (valid once Next returned false)
+    bool IsMalformed (void) const;
+  private:
+    const uint8_t *m_pos;
+    const uint8_t *m_end;
+    uint32_t m_left;
+    bool m_bundle;
+    bool m_malformed;
+  };
+
+  // datagrams received with one recvmmsg call
+  // (buffers, iovecs and message headers are set up once and the batch is recycled
+  //   after all its frames have been handed to the bridges)
+  struct ReceiveBatch
+  {
+    ReceiveBatch *next;
+    Shard *shard;
+    // number of received datagrams and the wall-clock time of their reception
+    uint32_t count;
+    uint64_t receiveTime;
+    // frames not yet forwarded (RealtimeSimulatorImpl only)
+    uint32_t pending;
+    struct mmsghdr msgs[RECEIVE_BATCH];
+    struct iovec iovecs[RECEIVE_BATCH];
+    uint8_t buffers[RECEIVE_BATCH][RECEIVE_BUFFER];
+  };
+
+  // a socket with its read thread and its pool of batches
+  struct Shard
+  {
+    // entry point of the read thread (runs SyncTunnelComm::ReadThread for this shard)
+    void Run () { comm->ReadThread (this); }
+
+    SyncTunnelComm *comm;
+    uint32_t index;
+    // socket to receive with
+    int32_t sock;
+    // handle for the extra thread used to receive
+    Ptr<SystemThread> readThread;
+    // batches released by other threads (lock-free stack, see ReleaseBatch)
+    ReceiveBatch * volatile freeBatches;
+    // batches owned by the read thread
+    ReceiveBatch *ownBatches;
+    // counters (only written by the read thread)
+    uint64_t batches;
+    uint64_t packets;
+    uint64_t discarded;
+  };
+
+  // creates the socket of a shard and binds it to the receive address
+  int32_t CreateSocket (bool reusePort);
+
+  // runs in extra thread and receives the packets of a shard
+  void ReadThread (Shard *shard);
+
+  // takes a batch from the pool of a shard or allocates one if the pool is empty (read thread only)
+  ReceiveBatch *AllocateBatch (Shard *shard);
+
+  // returns a batch to the pool (any thread) and drops its reference of the comm object
+  void ReleaseBatch (ReceiveBatch *batch);
+
+  // sends all queued frames (takes m_sendMutex)
+  void FlushSendQueue ();
+
+  // sends all queued frames (m_sendMutex has to be held)
+  void DoFlushSendQueue ();
+
+  // sends messages with as few calls as possible
+  void SendMessages (struct mmsghdr *msgs, uint32_t count);
+
+  // adds a frame to the bundle for its destination (m_sendMutex has to be held)
+  void AddToBundle (Ptr<const Packet> packet, int32_t flowid, const struct sockaddr_in &dest);
+
+  // decodes all frames of a batch in the simulator thread of SyncSimulatorImpl
+  void DecodeBatch (ReceiveBatch *batch);
+
+  // forwards one frame of a batch in RealtimeSimulatorImpl (if the bridge is still registered)
+  void ForwardFrame (ReceiveBatch *batch, uint32_t flowid, const uint8_t *data, uint32_t len);
+
+  // the receive shards (the socket of the first one is also used to send)
+  std::vector<Shard *> m_shards;
+
+  // the registered SyncTunnelBridge objects indexed by flowid (MAX_FLOWS entries)
+  SyncTunnelBridge * volatile *m_bridges;
+
+  // number of registered bridges
+  uint32_t m_numBridges;
+
+  // FLOW_COALESCE and FLOW_PEER_COALESCES of every flowid (MAX_FLOWS entries)
+  volatile uint8_t *m_flowFlags;
 
-  // handle for the extra thread used to receive
-  Ptr<SystemThread> m_readThread;
+  // tells the read threads to exit
+  volatile bool m_stop;
 
-  // map to store the association of flowids to registered SyncTunnelBridge objects
-  std::map<int32_t, SyncTunnelBridge*> m_allBridges;
+  // references of the comm object: one of its own, dropped when the last bridge unregisters, and one
+  // of every batch handed over to the simulator thread, whose events may still be pending at that time;
+  // the comm object is deleted when the last reference is dropped
+  volatile uint32_t m_references;
 
-  // socket to receive with
-  int32_t m_sock;
+  // frames to send, the number of frames at which they are sent and the lock
+  // which protects them (SendPacket may be called by several partition threads)
+  SendQueue *m_sendQueue;
+  uint32_t m_sendThreshold;
+  SystemMutex m_sendMutex;
 
   /**
    * A copy of a raw pointer to the required real-time simulator implementation.
@@ -12,9 +12,9 @@ BRIDGE="br$1"
 TUNNEL="tunnel$1"
 TAP="tap$1"
 
-TUNCMD=$(pgrep -l -f "tap-udptunnel [0-9. ]* $TUNNEL")
+TUNCMD=$(pgrep -l -f "tap-udptunnel .* $TUNNEL$")
 echo "killing tunnel: $TUNCMD"
-sudo pkill -f "tap-udptunnel [0-9. ]* $TUNNEL"
+sudo pkill -f "tap-udptunnel .* $TUNNEL$"
 
 sudo ifconfig $BRIDGE down
 sudo ifconfig $TAP down
@@ -7,9 +7,17 @@ if [ $# -ne 5 ]; then
     echo "eg. $0 192.168.1.6 7543 7544 17 1"
     echo "creates devices br1, tap1 and tunnel1, tunnel will be connected to"
     echo "remote ns-3."
+    echo "Options for tap-udptunnel (e.g. \"-q 4 -v\") can be given in TUNNEL_OPTS."
     exit
 fi
 
+# the tunnel daemon is built in tap-udptunnel/ of this repository
+TAPUDPTUNNEL=$(dirname $(readlink -f $0))/../tap-udptunnel/tap-udptunnel
+if [ ! -x $TAPUDPTUNNEL ]; then
+    echo "$TAPUDPTUNNEL not found, run make in tap-udptunnel/ first"
+    exit 1
+fi
+
 SERVER=$1
 LOCAL=$2
 REMOTE=$3
@@ -24,8 +32,8 @@ echo "Bringing up bridge $BRIDGE with devices $TAP and $TUNNEL.."
 # so lets do sudo action and it caches the password for rest of the script.
 sudo sleep 1
 
-echo "tap-udptunnel $SERVER $LOCAL $REMOTE $FLOWID $TUNNEL &"
-sudo /home/kimdu/bin/tap-udptunnel $SERVER $LOCAL $REMOTE $FLOWID $TUNNEL &
+echo "tap-udptunnel $TUNNEL_OPTS $SERVER $LOCAL $REMOTE $FLOWID $TUNNEL &"
+sudo $TAPUDPTUNNEL $TUNNEL_OPTS $SERVER $LOCAL $REMOTE $FLOWID $TUNNEL &
 sleep 3
 sudo ifconfig $TUNNEL 192.168.2.254 netmask 255.255.255.0
 sudo ifconfig $TUNNEL -arp
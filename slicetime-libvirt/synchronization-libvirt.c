@@ -10,7 +10,12 @@
 #include <signal.h>
 #include <unistd.h>
 #include <time.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
 #include <sys/time.h>
+#include <sys/signalfd.h>
+#include <getopt.h>
 #include <libvirt/libvirt.h>
 
 #include "synchronization.h"
@@ -18,57 +23,543 @@
 
 // data structure for the libvirt connection
 virConnectPtr conn;
-int numDomains;
-virDomainPtr *activeDomains;
+const char *libvirt_uri = "xen:///";
+
+// the domain group to synchronize: the domains given by name or UUID and the
+// domains labelled with one of the groups in their metadata, e.g.
+//   <slicetime:group xmlns:slicetime="urn:slicetime:libvirt" name="web"/>
+// Without any, all active domains except for Domain-0 (ID 0) are synchronized.
+#define SLICETIME_METADATA_URI "urn:slicetime:libvirt"
+#define MAX_SELECTORS 64
+
+const char *sel_domains[MAX_SELECTORS];
+int numSelDomains;
+const char *sel_groups[MAX_SELECTORS];
+int numSelGroups;
+
+// the synchronized VM-es
+typedef struct slicetime_vm {
+    virDomainPtr domain;
+    unsigned int id;
+    unsigned char uuid[VIR_UUID_BUFLEN];
+    int left;                   // the domain was stopped, removed before the next round
+    int issued;                 // the operation of the current round has been issued
+    int done;                   // ... and has taken effect
+    struct timespec issued_at;
+    // pause latency: suspend issued -> VM paused (nanoseconds)
+    int64_t pause_last, pause_max, pause_sum;
+    int64_t pauses;
+    int failures;               // suspend/resume calls that failed
+    // guest CPU time (nanoseconds), read while the VM is paused
+    uint64_t cpu_time;          // consumed since the VM was started
+    uint64_t cpu_slice;         // consumed in the last slice
+    int cpu_readings;           // readings since the VM joined (0 if the last one failed)
+} slicetime_vm;
+
+slicetime_vm *vms;
+int numVms;
+
+// domains that were started during the run, they join at the next round
+virDomainPtr *vm_joining;
+int numJoining;
+
+// pause/resume engine: worker threads issue the operation of a round to all
+// VM-es concurrently, lifecycle events (or, as fallback, the domain states)
+// tell when it has taken effect
+#define VM_OP_SUSPEND 0
+#define VM_OP_RESUME 1
+#define VM_OP_CPUTIME 2 // read the guest CPU time, nothing to wait for
+#define VM_MAX_WORKERS 64
+#define VM_POLL_EVENTS_NS 10000000LL // state check if an event is overdue
+#define VM_POLL_NOEVENTS_NS 200000LL // state check without lifecycle events
+
+pthread_mutex_t vm_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t vm_work = PTHREAD_COND_INITIALIZER; // a round started
+pthread_cond_t vm_done;                            // the last VM completed the round
+pthread_cond_t vm_idle = PTHREAD_COND_INITIALIZER; // no call is in flight any more
+pthread_t vm_workers[VM_MAX_WORKERS];
+int numWorkers;
+int vm_auto_workers; // one worker per VM, started as the group grows
+int vm_op;          // operation of the current round
+int vm_next;        // next VM to issue the operation to
+int vm_pending;     // VM-es that have not completed the round yet
+int vm_inflight;    // calls the workers have issued and not yet accounted for
+int64_t vm_round_pause_max; // slowest pause of the last suspend round (nanoseconds)
+
+int vm_event_callback = -1; // id of the lifecycle event callback, -1 if there is none
+int vm_cpu_stats = 1;       // the hypervisor reports the guest CPU time
 
 // data structure for the slicetime communication
 int slicetime_initialized = 0;
 int slicetime_socket;
-fd_set rset;
 
-// data structure for the RUN_PERMISSION
+// data structure for the RUN_PERMISSION: the event loop hands it over to the
+// timing thread, which runs the VM-es for the slice
+pthread_mutex_t slice_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t slice_cond = PTHREAD_COND_INITIALIZER; // vm_running changed
+pthread_t slice_thread;
 uint32_t slice;
-int first_time = 0;
 int vm_running = 1;
 
 // data structure for time tracking
-int64_t r_total = 0;
-struct timespec tp_origin, tp_start, tp_end;
+struct timespec tp_start, tp_end;
 
 /////////////////////////////////////////////////////
 // Libvirt-related functions
 /////////////////////////////////////////////////////
 
-void libvirt_connect() {
+static int64_t elapsed_ns(const struct timespec *from, const struct timespec *to) {
+    return (int64_t) (to->tv_sec - from->tv_sec) * 1000000000LL + (to->tv_nsec - from->tv_nsec);
+}
+
+/*
+ * The operation of the current round has taken effect on a VM (now is NULL
+ * if it failed). Must be called with vm_mutex held.
+ */
+static void vm_complete(slicetime_vm *vm, const struct timespec *now) {
+    if (vm->done)
+        return;
+    vm->done = 1;
+
+    if (now != NULL && vm_op == VM_OP_SUSPEND) {
+        int64_t latency = elapsed_ns(&vm->issued_at, now);
+        vm->pause_last = latency;
+        vm->pause_sum += latency;
+        vm->pauses++;
+        if (latency > vm->pause_max)
+            vm->pause_max = latency;
+        if (latency > vm_round_pause_max)
+            vm_round_pause_max = latency;
+    }
+
+    if (--vm_pending == 0)
+        pthread_cond_signal(&vm_done);
+}
+
+/*
+ * Tells if a domain belongs to the synchronized group
+ */
+static int vm_selected(virDomainPtr dom) {
+    char uuid[VIR_UUID_STRING_BUFLEN];
+    char *metadata;
+    int i, selected = 0;
+
+    if (numSelDomains == 0 && numSelGroups == 0)
+        return virDomainGetID(dom) != 0;
+
+    if (virDomainGetUUIDString(dom, uuid) < 0)
+        uuid[0] = '\0';
+    for (i = 0; i < numSelDomains; i++) {
+        if (strcmp(sel_domains[i], virDomainGetName(dom)) == 0
+                || strcasecmp(sel_domains[i], uuid) == 0)
+            return 1;
+    }
+    if (numSelGroups == 0)
+        return 0;
+
+    // the label is the name attribute of our metadata element
+    metadata = virDomainGetMetadata(dom, VIR_DOMAIN_METADATA_ELEMENT, SLICETIME_METADATA_URI, 0);
+    if (metadata == NULL)
+        return 0;
+    for (i = 0; i < numSelGroups && !selected; i++) {
+        char attr[256];
+        snprintf(attr, sizeof(attr), "name=\"%s\"", sel_groups[i]);
+        selected = (strstr(metadata, attr) != NULL);
+        snprintf(attr, sizeof(attr), "name='%s'", sel_groups[i]);
+        selected = selected || (strstr(metadata, attr) != NULL);
+    }
+    free(metadata);
+    return selected;
+}
+
+/*
+ * The VM of a domain, NULL if it is not synchronized.
+ * Must be called with vm_mutex held.
+ */
+static slicetime_vm *vm_find(const unsigned char *uuid) {
+    int i;
+
+    for (i = 0; i < numVms; i++) {
+        if (!vms[i].left && memcmp(vms[i].uuid, uuid, VIR_UUID_BUFLEN) == 0)
+            return &vms[i];
+    }
+    return NULL;
+}
+
+/*
+ * A domain of the group was started: it joins at the next round
+ * (must be called with vm_mutex held)
+ */
+static void vm_join(virDomainPtr dom) {
+    unsigned char uuid[VIR_UUID_BUFLEN], other[VIR_UUID_BUFLEN];
+    int i;
+
+    if (virDomainGetUUID(dom, uuid) < 0 || vm_find(uuid) != NULL)
+        return;
+    for (i = 0; i < numJoining; i++) {
+        if (virDomainGetUUID(vm_joining[i], other) == 0 && memcmp(uuid, other, VIR_UUID_BUFLEN) == 0)
+            return;
+    }
+
+    virDomainRef(dom);
+    vm_joining = (virDomainPtr*) realloc(vm_joining, sizeof(virDomainPtr) * (numJoining + 1));
+    vm_joining[numJoining++] = dom;
+}
+
+/*
+ * A synchronized domain was stopped: nothing to wait for any more, it leaves
+ * at the next round (must be called with vm_mutex held)
+ */
+static void vm_leave(virDomainPtr dom) {
+    unsigned char uuid[VIR_UUID_BUFLEN];
+    slicetime_vm *vm;
+
+    if (virDomainGetUUID(dom, uuid) < 0 || (vm = vm_find(uuid)) == NULL)
+        return;
+    vm->left = 1;
+    if (vm->issued)
+        vm_complete(vm, NULL);
+}
+
+/*
+ * Removes the VM-es that left and adds the ones that joined since the last
+ * round. Must be called with vm_mutex held, between the rounds.
+ */
+static void vm_update_group(void) {
+    int i, kept = 0;
+
+    for (i = 0; i < numVms; i++) {
+        if (vms[i].left) {
+            printf("Domain %s left the group\n", virDomainGetName(vms[i].domain));
+            virDomainFree(vms[i].domain);
+            continue;
+        }
+        vms[kept++] = vms[i];
+    }
+    numVms = kept;
+
+    if (numJoining == 0)
+        return;
+    vms = (slicetime_vm*) realloc(vms, sizeof(slicetime_vm) * (numVms + numJoining));
+    for (i = 0; i < numJoining; i++) {
+        slicetime_vm *vm = &vms[numVms++];
+        memset(vm, 0, sizeof(*vm));
+        vm->domain = vm_joining[i];
+        vm->id = virDomainGetID(vm->domain);
+        virDomainGetUUID(vm->domain, vm->uuid);
+        printf("Domain %s joined the group\n", virDomainGetName(vm->domain));
+    }
+    numJoining = 0;
+}
+
+/*
+ * Lifecycle events of all domains, called in the event loop
+ */
+static int vm_lifecycle_cb(virConnectPtr c, virDomainPtr dom, int event,
+                           int detail, void *opaque) {
+    struct timespec now;
+    unsigned char uuid[VIR_UUID_BUFLEN];
+    slicetime_vm *vm;
+
+    // the group membership (the metadata is read outside of the lock)
+    if (event == VIR_DOMAIN_EVENT_STARTED) {
+        if (vm_selected(dom)) {
+            pthread_mutex_lock(&vm_mutex);
+            vm_join(dom);
+            pthread_mutex_unlock(&vm_mutex);
+        }
+        return 0;
+    }
+    if (event == VIR_DOMAIN_EVENT_STOPPED || event == VIR_DOMAIN_EVENT_CRASHED
+            || event == VIR_DOMAIN_EVENT_UNDEFINED) {
+        pthread_mutex_lock(&vm_mutex);
+        vm_leave(dom);
+        pthread_mutex_unlock(&vm_mutex);
+        return 0;
+    }
+
+    if (virDomainGetUUID(dom, uuid) < 0)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&vm_mutex);
+    vm = vm_find(uuid);
+    if (vm != NULL && vm->issued
+            && ((vm_op == VM_OP_SUSPEND && event == VIR_DOMAIN_EVENT_SUSPENDED)
+                || (vm_op == VM_OP_RESUME && event == VIR_DOMAIN_EVENT_RESUMED)))
+        vm_complete(vm, &now);
+    pthread_mutex_unlock(&vm_mutex);
+    return 0;
+}
+
+/*
+ * Reads the CPU time the guest has consumed so far. Returns -1 if the
+ * hypervisor does not report it.
+ */
+static int vm_read_cpu_time(virDomainPtr dom, uint64_t *cpu_time) {
+    virTypedParameter params[8];
+    int found = 0, n, i;
+
+    // the totals of all host CPUs (start_cpu = -1)
+    n = virDomainGetCPUStats(dom, params, 8, -1, 1, 0);
+    if (n < 0)
+        return -1;
+    for (i = 0; i < n; i++) {
+        if (strcmp(params[i].field, VIR_DOMAIN_CPU_STATS_CPUTIME) == 0
+                && params[i].type == VIR_TYPED_PARAM_ULLONG) {
+            *cpu_time = params[i].value.ul;
+            found = 1;
+        }
+    }
+    virTypedParamsClear(params, n);
+    return found ? 0 : -1;
+}
+
+/*
+ * Takes the VM-es of the current round one by one and issues the operation.
+ * The calls are made on a reference of the domain, the VM is looked up again
+ * afterwards: it may have left the group in the meantime.
+ */
+static void *vm_worker(void *arg) {
+    pthread_mutex_lock(&vm_mutex);
+    for ( ; ; ) {
+        while (vm_next >= numVms)
+            pthread_cond_wait(&vm_work, &vm_mutex);
+
+        slicetime_vm *vm = &vms[vm_next++];
+        // a VM which left before its turn has nothing to wait for
+        if (vm->left) {
+            vm->issued = 1;
+            vm_complete(vm, NULL);
+            continue;
+        }
+        virDomainPtr dom = vm->domain;
+        unsigned char uuid[VIR_UUID_BUFLEN];
+        uint64_t cpu_time = 0;
+        int op = vm_op, result;
+        memcpy(uuid, vm->uuid, VIR_UUID_BUFLEN);
+        virDomainRef(dom);
+        clock_gettime(CLOCK_MONOTONIC, &vm->issued_at);
+        vm->issued = 1;
+        vm_inflight++;
+        pthread_mutex_unlock(&vm_mutex);
+
+        if (op == VM_OP_CPUTIME)
+            result = vm_read_cpu_time(dom, &cpu_time);
+        else
+            result = (op == VM_OP_SUSPEND) ? virDomainSuspend(dom) : virDomainResume(dom);
+        virDomainFree(dom);
+
+        pthread_mutex_lock(&vm_mutex);
+        vm = vm_find(uuid);
+        if (vm != NULL && op == VM_OP_CPUTIME) {
+            if (result < 0) {
+                vm->cpu_readings = 0;
+            } else {
+                vm->cpu_slice = (vm->cpu_readings > 0 && cpu_time >= vm->cpu_time) ? cpu_time - vm->cpu_time : 0;
+                vm->cpu_time = cpu_time;
+                vm->cpu_readings++;
+            }
+            vm_complete(vm, NULL);
+        } else if (vm != NULL && result < 0) {
+            // nothing to wait for if the call failed
+            vm->failures++;
+            vm_complete(vm, NULL);
+        }
+        if (--vm_inflight == 0)
+            pthread_cond_broadcast(&vm_idle);
+    }
+    return NULL;
+}
+
+/*
+ * Starts worker threads until there are count of them. Signals are left to
+ * the event loop.
+ */
+static void vm_add_workers(int count) {
+    sigset_t all, old;
+
+    if (count > VM_MAX_WORKERS)
+        count = VM_MAX_WORKERS;
+    if (count <= numWorkers)
+        return;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    while (numWorkers < count) {
+        pthread_create(&vm_workers[numWorkers], NULL, vm_worker, NULL);
+        numWorkers++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * Checks the state of the VM-es whose event did not arrive (yet).
+ * Must be called with vm_mutex held, releases it during the calls.
+ */
+static void vm_poll_pending(void) {
+    int state, reason, i;
+    struct timespec now;
+
+    for (i = 0; i < numVms && vm_pending > 0; i++) {
+        slicetime_vm *vm = &vms[i];
+        if (!vm->issued || vm->done)
+            continue;
+
+        pthread_mutex_unlock(&vm_mutex);
+        int result = virDomainGetState(vm->domain, &state, &reason, 0);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        pthread_mutex_lock(&vm_mutex);
+
+        if (result < 0)
+            continue;
+        // stopped without a lifecycle event
+        if (state == VIR_DOMAIN_SHUTOFF || state == VIR_DOMAIN_CRASHED) {
+            vm->left = 1;
+            vm_complete(vm, NULL);
+            continue;
+        }
+        if ((vm_op == VM_OP_SUSPEND && state == VIR_DOMAIN_PAUSED)
+                || (vm_op == VM_OP_RESUME && (state == VIR_DOMAIN_BLOCKED || state == VIR_DOMAIN_RUNNING)))
+            vm_complete(vm, &now);
+    }
+}
+
+/*
+ * Issues op to all VM-es and waits until it has taken effect on every VM
+ */
+static void vm_run_round(int op) {
+    int64_t poll_ns = (vm_event_callback >= 0) ? VM_POLL_EVENTS_NS : VM_POLL_NOEVENTS_NS;
+    struct timespec deadline;
+    int i;
+
+    pthread_mutex_lock(&vm_mutex);
+    // calls of the last round may still be in flight if their VM-es left
+    // the group meanwhile, the group is only changed once they returned
+    while (vm_inflight > 0)
+        pthread_cond_wait(&vm_idle, &vm_mutex);
+    vm_update_group();
+    if (vm_auto_workers && numWorkers < numVms && numWorkers < VM_MAX_WORKERS) {
+        vm_add_workers(numVms);
+        printf("Suspending and resuming with %d thread(s)\n", numWorkers);
+    }
+    vm_op = op;
+    for (i = 0; i < numVms; i++) {
+        vms[i].issued = 0;
+        vms[i].done = 0;
+    }
+    if (op == VM_OP_SUSPEND)
+        vm_round_pause_max = 0;
+    vm_pending = numVms;
+    vm_next = 0;
+    pthread_cond_broadcast(&vm_work);
+
+    while (vm_pending > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += poll_ns;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000LL;
+        deadline.tv_nsec %= 1000000000LL;
+        if (pthread_cond_timedwait(&vm_done, &vm_mutex, &deadline) == ETIMEDOUT)
+            vm_poll_pending();
+    }
+    pthread_mutex_unlock(&vm_mutex);
+}
+
+/*
+ * Starts the worker threads
+ */
+static void vm_start_engine(int workers) {
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&vm_done, &attr);
+    pthread_condattr_destroy(&attr);
+
+    // without a given number, there is one worker per VM, also for the VM-es
+    // which join later on
+    vm_auto_workers = (workers <= 0);
+    pthread_mutex_lock(&vm_mutex);
+    vm_add_workers(vm_auto_workers ? (numVms > 0 ? numVms : 1) : workers);
+    pthread_mutex_unlock(&vm_mutex);
+
+    printf("Suspending and resuming with %d thread(s), %s\n", numWorkers,
+           (vm_event_callback >= 0) ? "waiting for lifecycle events" : "polling the domain states");
+}
+
+/*
+ * Prints the pause latency of every VM
+ */
+static void vm_print_latency(void) {
     int i;
-    int *activeDomainIDs;
 
-    // connect to xend
-    conn = virConnectOpen("xen:///");
+    printf("Pause latency (suspend issued -> VM paused):\n");
+    for (i = 0; i < numVms; i++) {
+        slicetime_vm *vm = &vms[i];
+        printf("  [%s] %lld pauses, mean %.1f us, max %.1f us, last %.1f us, %d failed calls",
+               virDomainGetName(vm->domain), (long long) vm->pauses,
+               vm->pauses ? vm->pause_sum / 1000.0 / vm->pauses : 0.0,
+               vm->pause_max / 1000.0, vm->pause_last / 1000.0, vm->failures);
+        if (vm->cpu_readings > 0)
+            printf(", guest CPU time %.3f s", vm->cpu_time / 1e9);
+        printf("\n");
+    }
+}
+
+void libvirt_connect(int workers) {
+    int i, numDomains;
+    virDomainPtr *domains;
+
+    // the event loop must be registered before the connection is opened
+    virEventRegisterDefaultImpl();
+
+    conn = virConnectOpen(libvirt_uri);
     if (conn == NULL) {
-        printf("Failed to open connection to xen");
+        printf("Failed to open connection to %s\n", libvirt_uri);
         exit(0);
     }
 
-    // get the Domain ID list
-    numDomains = virConnectNumOfDomains(conn);
-    activeDomainIDs = (int*) malloc(sizeof(int) * numDomains);
-    activeDomains = (virDomainPtr*) malloc(sizeof(virDomainPtr) * numDomains);
-    numDomains = virConnectListDomains(conn, activeDomainIDs, numDomains);
+    // the active domains of the group are synchronized from the start
+    numDomains = virConnectListAllDomains(conn, &domains, VIR_CONNECT_LIST_DOMAINS_ACTIVE);
+    if (numDomains < 0) {
+        printf("Failed to list the domains of %s\n", libvirt_uri);
+        exit(0);
+    }
+    vms = (slicetime_vm*) calloc(numDomains > 0 ? numDomains : 1, sizeof(slicetime_vm));
 
-    // associate the Domain ID list to Domain name list
-    printf("Active domain IDs:\n");
+    printf("Active domains of %s:\n", libvirt_uri);
+    numVms = 0;
     for (i = 0; i < numDomains; i++) {
-        activeDomains[i] = virDomainLookupByID(conn, activeDomainIDs[i]);
-        printf("  [%s - %d]\n", virDomainGetName(activeDomains[i]), activeDomainIDs[i]);
+        int selected = vm_selected(domains[i]);
+        printf("  [%s - %d]%s\n", virDomainGetName(domains[i]), virDomainGetID(domains[i]),
+               selected ? " synchronized" : "");
+        if (!selected) {
+            virDomainFree(domains[i]);
+            continue;
+        }
+        vms[numVms].domain = domains[i];
+        vms[numVms].id = virDomainGetID(domains[i]);
+        virDomainGetUUID(domains[i], vms[numVms].uuid);
+        numVms++;
     }
+    free(domains);
 
-    // Domain ID list is useless
-    free(activeDomainIDs);
+    // the lifecycle events also tell which domains join and leave the group
+    vm_event_callback = virConnectDomainEventRegisterAny(conn, NULL, VIR_DOMAIN_EVENT_ID_LIFECYCLE,
+                                                         VIR_DOMAIN_EVENT_CALLBACK(vm_lifecycle_cb),
+                                                         NULL, NULL);
+    vm_start_engine(workers);
 }
 
 void libvirt_disconnect() {
-    free(activeDomains);
+    int i;
+
+    vm_print_latency();
+    if (vm_event_callback >= 0)
+        virConnectDomainEventDeregisterAny(conn, vm_event_callback);
+    for (i = 0; i < numVms; i++)
+        virDomainFree(vms[i].domain);
+    for (i = 0; i < numJoining; i++)
+        virDomainFree(vm_joining[i]);
     virConnectClose(conn);
 
     // directly exit from here
@@ -76,66 +567,111 @@ void libvirt_disconnect() {
 }
 
 void stop_all_vm() {
-    int state, reason, count, i;
+    // the VM-es run until the suspend is issued
+    clock_gettime(CLOCK_MONOTONIC, &tp_end);
 
-    // suspend all the VM-es (except for Domain-0)
-    for (i = 1; i < numDomains; i++) 
-        virDomainSuspend(activeDomains[i]);
+    // suspend all the VM-es of the group and wait until they are paused
+    vm_run_round(VM_OP_SUSPEND);
+}
 
-    // capture the time after suspend action
-    clock_gettime(CLOCK_MONOTONIC, &tp_end);
-    
-    // this function will looped until all machines are paused.
-    while (1) {
-        count = 0;
-        for (i = 1; i < numDomains; i++) {
-            // check if the state is PAUSED
-            virDomainGetState(activeDomains[i], &state, &reason, 0);
-            if (state == VIR_DOMAIN_PAUSED)
-                count++;
-        }
-        // break when all the machines are paused
-        if (count == numDomains - 1) break;
+/*
+ * Reads the guest CPU time of all (paused) VM-es and returns the most any
+ * guest consumed in the last slice, the spread to the guest that consumed the
+ * least (both in nanoseconds) and the number of guests measured
+ */
+int read_guest_time(uint64_t *cpu_max, uint64_t *cpu_spread) {
+    uint64_t cpu_min = 0;
+    int guests = 0, measured = 0, i;
+
+    *cpu_max = 0;
+    *cpu_spread = 0;
+    if (!vm_cpu_stats)
+        return 0;
+
+    vm_run_round(VM_OP_CPUTIME);
+
+    for (i = 0; i < numVms; i++) {
+        if (vms[i].cpu_readings > 0)
+            measured++;
+        // a slice is measured by two readings
+        if (vms[i].cpu_readings < 2)
+            continue;
+        if (guests == 0 || vms[i].cpu_slice > *cpu_max)
+            *cpu_max = vms[i].cpu_slice;
+        if (guests == 0 || vms[i].cpu_slice < cpu_min)
+            cpu_min = vms[i].cpu_slice;
+        guests++;
     }
+    if (guests > 0)
+        *cpu_spread = *cpu_max - cpu_min;
+    else if (numVms > 0 && measured == 0) {
+        // not worth a round per slice
+        printf("The hypervisor does not report the guest CPU time\n");
+        vm_cpu_stats = 0;
+    }
+    return guests;
 }
 
 void resume_all_vm() {
-    int state, reason, count, i;
-
-    // resume all the VM-es (except for the Domain-0)
-    for (i = 1; i < numDomains; i++)
-        virDomainResume(activeDomains[i]);
+    // resume all the VM-es of the group and wait until they run
+    vm_run_round(VM_OP_RESUME);
 
     // capture the time after resume action
     clock_gettime(CLOCK_MONOTONIC, &tp_start);
-
-    // this function will looped until all machines are resumed.
-    while (1) {
-        count = 0;
-        for (i = 1; i < numDomains; i++) {
-            // check if the state is RUNNING (or BLOCKED in Xen)
-            virDomainGetState(activeDomains[i], &state, &reason, 0);
-            if (state == VIR_DOMAIN_BLOCKED || state == VIR_DOMAIN_RUNNING)
-                count++;
-        }
-        if (count == numDomains - 1) break;
-    }
 }
 
 /////////////////////////////////////////////////////
 // Slicetime-related functions
 /////////////////////////////////////////////////////
 
+/*
+ * Runs one slice after the other: resumes the VM-es, sleeps until the slice
+ * is over (an absolute deadline on the monotonic clock, so neither the resume
+ * nor a late wakeup shifts the next slices) and suspends them again
+ */
+static void *slicetime_timing_thread(void *arg) {
+    struct timespec deadline;
+
+    pthread_mutex_lock(&slice_mutex);
+    for ( ; ; ) {
+        while (!vm_running)
+            pthread_cond_wait(&slice_cond, &slice_mutex);
+        uint32_t microseconds = slice;
+        pthread_mutex_unlock(&slice_mutex);
+
+        // resume all the VM-es, the slice starts once they run
+        resume_all_vm();
+
+        deadline = tp_start;
+        deadline.tv_sec += microseconds / 1000000;
+        deadline.tv_nsec += (long) (microseconds % 1000000) * 1000;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+            ;
+
+        slicetime_stop_slice(microseconds);
+
+        pthread_mutex_lock(&slice_mutex);
+    }
+    return NULL;
+}
+
 void slicetime_init_client(const char *host, const char *host_port, 
                           const char *client_port, int client_id)
 {
+    sigset_t all, old;
+    uint64_t cpu_max, cpu_spread;
+
     // init the basic values
     slicetime_initialized = 1;
     vm_running = 0;
-    first_time = 1;
 
-    // suspend all the VM-es upon start up
+    // suspend all the VM-es upon start up, the guest CPU time is measured from here
     stop_all_vm();
+    read_guest_time(&cpu_max, &cpu_spread);
 
     // init client-server communication
     slicetime_socket = register_client(host, host_port, client_port, client_id,
@@ -147,8 +683,15 @@ void slicetime_init_client(const char *host, const char *host_port,
         return;
     }    
 
-    // record the based real-time
-    clock_gettime(CLOCK_MONOTONIC, &tp_origin);
+    // the RUN_PERMISSION messages are handled in the event loop
+    virEventAddHandle(slicetime_socket, VIR_EVENT_HANDLE_READABLE,
+                      slicetime_sock_event_cb, NULL, NULL);
+
+    // start the timing thread (signals are left to the event loop)
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    pthread_create(&slice_thread, NULL, slicetime_timing_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
 
     // finish
     printf("Init slicetime client\n");
@@ -159,11 +702,12 @@ void slicetime_sock_read_cb(void) {
     handle_socket_read();
 }
 
+static void slicetime_sock_event_cb(int watch, int fd, int events, void *opaque) {
+    slicetime_sock_read_cb();
+}
+
 void slicetime_run_for(uint32_t microseconds)
 {
-    struct itimerval value, ovalue, pvalue;
-    int which = ITIMER_REAL;
-
     // only run when the slicetime communication works
     if (!slicetime_initialized)
     {
@@ -171,75 +715,71 @@ void slicetime_run_for(uint32_t microseconds)
         return;
     }
 
-    // save the slicetime values
-    slice = microseconds;
-    first_time = 0;
-
-    // ignore if the VM-es are still running
+    // hand the slice to the timing thread
+    // (ignore if the VM-es are still running)
+    pthread_mutex_lock(&slice_mutex);
     if (!vm_running)
     {
-        // resume all the VM-es
-        vm_running = 1; // come before resume_all_vm so that the loop in main() works
-        resume_all_vm();
-
-        // set the timer interrupt for "slice" microseconds
-        signal(SIGALRM, slicetime_stop_timer_cb);
-
-        getitimer( which, &pvalue );
-        value.it_interval.tv_sec = 0;       /* Zero seconds */
-        value.it_interval.tv_usec = slice;  /* "slice" microseconds */
-        value.it_value.tv_sec = 0;          /* Zero seconds */
-        value.it_value.tv_usec = slice;     /* "slice" microseconds */
-        setitimer( which, &value, &ovalue);
+        slice = microseconds;
+        vm_running = 1;
+        pthread_cond_broadcast(&slice_cond);
     }
+    pthread_mutex_unlock(&slice_mutex);
 }
 
-static void slicetime_stop_timer_cb(int sig) {
-    struct itimerval value;
-    int which = ITIMER_REAL;
-
-    // stop the timer interrupts
-    signal(SIGALRM, SIG_IGN);  
-
-    getitimer( which, &value );
-    value.it_value.tv_sec = 0;
-    value.it_value.tv_usec = 0;
-    setitimer( which, &value, NULL );
+static void slicetime_stop_slice(uint32_t microseconds) {
+    uint64_t cpu_max, cpu_spread;
+    int guests;
 
     // suspend all the VM-es
     stop_all_vm();
-    vm_running = 0; // come after stop_all_vm to make sure all VM-es are stopped
 
-    // calculate the running time (in nanoseconds)
-    int64_t r_duration = (tp_end .tv_sec - tp_origin.tv_sec) - (tp_start.tv_sec - tp_origin.tv_sec);
-    r_duration = r_duration * 1000000000LL + (tp_end.tv_nsec - tp_start.tv_nsec); // duration in nanoseconds
-    
-    // accumulate the running time
-    r_total += r_duration;
+    // calculate the running time of this slice (in nanoseconds)
+    int64_t r_duration = elapsed_ns(&tp_start, &tp_end);
 
-    // send the FINISH message 
-    //   content = time slice (us) + accumulated running time (ns)
-    period_finished(slice, r_total); 
+    // the CPU time the guests actually got in the slice
+    guests = read_guest_time(&cpu_max, &cpu_spread);
+
+    // the next RUN_PERMISSION may come as soon as the FINISH message is out
+    // (it waits for slice_mutex, as does slicetime_stop_sync)
+    pthread_mutex_lock(&slice_mutex);
+    vm_running = 0; // come after stop_all_vm to make sure all VM-es are stopped
+    pthread_cond_broadcast(&slice_cond);
+
+    // send the FINISH message
+    //   content = time slice (us) + running time of the slice (us)
+    //   + guest CPU time of the slice (ns, if the hypervisor reports it)
+    if (guests > 0)
+        period_finished_guests(microseconds, r_duration / 1000, cpu_max, cpu_spread, guests);
+    else
+        period_finished(microseconds, r_duration / 1000);
+    pthread_mutex_unlock(&slice_mutex);
 }
 
 void slicetime_stop_sync()
 {
+    // no new slices, let the current one end
+    pthread_mutex_lock(&slice_mutex);
+    slicetime_initialized = 0;
+    while (vm_running)
+        pthread_cond_wait(&slice_cond, &slice_mutex);
+    pthread_mutex_unlock(&slice_mutex);
+
     // terminate the slicetime communication
     unregister_client(0);
-    slicetime_initialized = 0;
 
     // resume all the VM-es
-    vm_running = 1;
     resume_all_vm();
 
     // finish
     printf("Stopping sync..\n");
 }
 
-static void exitProcedure(int sig) {
-    // remove the timer and control-c interrupt
-    signal(SIGALRM, SIG_IGN);
-    signal(SIGINT, SIG_IGN);
+static void exitProcedure(int watch, int fd, int events, void *opaque) {
+    struct signalfd_siginfo info;
+
+    if (read(fd, &info, sizeof(info)) != sizeof(info))
+        return;
 
     // disconnect from the slicetime server
     slicetime_stop_sync();
@@ -255,30 +795,74 @@ static void exitProcedure(int sig) {
  *  2 - slicetime-server port
  *  3 - slicetime-client port (this client)
  *  4 - slicetime-client ID (this client)
+ *  5 - number of threads issuing suspend/resume (optional, default: one per VM,
+ *      also for the VM-es that join later)
+ * Options:
+ *  -c URI     - libvirt connection (default: xen:///), e.g. qemu:///system
+ *  -d DOMAIN  - synchronize the domain with this name or UUID (repeatable)
+ *  -g GROUP   - synchronize the domains labelled GROUP (repeatable)
+ *  -w THREADS - same as input 5
+ * Without -d and -g, all active domains except for Domain-0 are synchronized.
  */
 int main(int argc, char *argv[]) {
+    sigset_t mask;
+    int workers = 0, opt;
+
+    while ((opt = getopt(argc, argv, "c:d:g:w:")) != -1) {
+        switch (opt) {
+        case 'c':
+            libvirt_uri = optarg;
+            break;
+        case 'd':
+            if (numSelDomains < MAX_SELECTORS)
+                sel_domains[numSelDomains++] = optarg;
+            break;
+        case 'g':
+            if (numSelGroups < MAX_SELECTORS)
+                sel_groups[numSelGroups++] = optarg;
+            break;
+        case 'w':
+            workers = atoi(optarg);
+            break;
+        default:
+            printf("Usage: %s [-c URI] [-d DOMAIN]... [-g GROUP]... [-w THREADS]\n"
+                   "          SERVER_IP SERVER_PORT CLIENT_PORT CLIENT_ID [THREADS]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind < 4) {
+        printf("Usage: %s [-c URI] [-d DOMAIN]... [-g GROUP]... [-w THREADS]\n"
+               "          SERVER_IP SERVER_PORT CLIENT_PORT CLIENT_ID [THREADS]\n", argv[0]);
+        return 1;
+    }
+    argv += optind - 1;
+    if (argc - optind > 4)
+        workers = atoi(argv[5]);
+
+    // Control-C is read from a signalfd in the event loop, so the other
+    // threads must not take it
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
 
     // retrieve the list of domains
-    libvirt_connect();
+    libvirt_connect(workers);
 
     // connect to the slicetime server
     slicetime_init_client(argv[1], argv[2], argv[3], atoi(argv[4]));
 
     // capture the Control-C signal
-    signal(SIGINT, exitProcedure);
+    virEventAddHandle(signalfd(-1, &mask, SFD_CLOEXEC), VIR_EVENT_HANDLE_READABLE,
+                      exitProcedure, NULL, NULL);
 
-    // loop forever until the control-c is caught
+    // loop forever until the control-c is caught: RUN_PERMISSION messages,
+    // lifecycle events of the domains and signals
     for ( ; ; ) {
-        FD_ZERO(&rset);
-        FD_SET(slicetime_socket, &rset);
-        select(FD_SETSIZE, &rset, NULL, NULL, NULL);
-
-        // process the received RUN_PERMISSION
-        if (FD_ISSET(slicetime_socket, &rset)) 
-            slicetime_sock_read_cb();
-
-        // the next loop will start after all VM-es are suspended
-        while (first_time == 0 && vm_running) { sleep(1); }
+        if (virEventRunDefaultImpl() < 0) {
+            printf("Event loop failed\n");
+            break;
+        }
     }
 
     return 0;
@@ -9,18 +9,29 @@
  */
 
 /*
- * Connect/disconnect libvirt to the Xen hypervisor
+ * Connect/disconnect libvirt to the hypervisor (libvirt_uri) and select the
+ * domain group to synchronize. Suspend and resume are issued by the given
+ * number of threads (0: one per VM). The lifecycle events of the domains are
+ * dispatched by the libvirt event loop that main() runs; they also add the
+ * domains of the group that are started and remove the ones that are stopped.
  */
-void libvirt_connect();
+void libvirt_connect(int workers);
 void libvirt_disconnect();
 
 /*
- * Suspend/resume all the VM-es associated with the Xen hypervisor 
- * 	(except for the Domain-0)
+ * Suspend/resume all the VM-es of the group. The calls are issued
+ * 	concurrently and return once the operation has taken effect on every VM.
  */
 void stop_all_vm();
 void resume_all_vm();
 
+/*
+ * Read the CPU time the (paused) VM-es consumed in the last slice through
+ * virDomainGetCPUStats. Returns the number of guests measured, the maximum
+ * and the spread (max - min) in nanoseconds.
+ */
+int read_guest_time(uint64_t *cpu_max, uint64_t *cpu_spread);
+
 /*
  * Initialize SliceTime client. This should be called in emulator initialization
  * code. It connects emulator to SliceTime synchronization server and return the
@@ -37,14 +48,21 @@ void slicetime_sock_read_cb(void);
 
 /*
  * Allow the emulator to run for given amount of microseconds
+ * (the timing thread runs the slice)
  */
 typedef void(*SliceTime_runfor)(uint32_t);
 void slicetime_run_for(uint32_t microseconds);
 
 /*
- * After the run-time has ended
+ * Called by the event loop when the socket is readable
+ */
+static void slicetime_sock_event_cb(int, int, int, void *);
+
+/*
+ * After the run-time has ended: suspend the VM-es and send the FINISH message
+ * (called in the timing thread)
  */
-static void slicetime_stop_timer_cb(int);
+static void slicetime_stop_slice(uint32_t);
 
 /*
  * Terminate the Slicetime client-server communication
@@ -52,8 +70,9 @@ static void slicetime_stop_timer_cb(int);
 void slicetime_stop_sync();
 
 /*
- * This function is executed when Ctrl-C is caught. Terminate the slicetime, libvirt
+ * This function is executed when Ctrl-C is caught (read from a signalfd by
+ * the event loop). Terminate the slicetime, libvirt
  */
-static void exitProcedure(int);
+static void exitProcedure(int, int, int, void *);
 
 #endif
@@ -9,6 +9,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <pthread.h>
 
 #include "synchronization.h"
 
@@ -20,6 +21,13 @@ void print_addr(struct addrinfo *);
 int slicetime_client_sock, slicetime_client_id, slicetime_seqNr,
     slicetime_client_period = -1; //-1 denotes not started
 
+// the last FINISH message, resent if the server resends the RUN_PERMISSION
+// of a period that is finished already (the message is sent by the thread which
+// ends the period, the resend happens in the thread reading the socket)
+int slicetime_finished_period = -1;
+uint8_t slicetime_finished_packet[SW_MAX_DATAGRAM];
+pthread_mutex_t slicetime_finished_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 struct sockaddr_in slicetime_dest;
     
 SliceTime_runfor slicetime_runfor_cb;
@@ -130,83 +138,67 @@ int get_connection(const char *host, const char *remote_port, const char *local_
     return sockfd;
 }
 
-void client_sendFinished(COM_Finished fin) {
-    uint8_t buffer[32000];
-    //first of all, mutual exclusion for safety reasons :)
-
-    struct COM_SyncPacket
-		    *spacket=(struct COM_SyncPacket*) malloc(sizeof(COM_SyncPacket)
-				    +sizeof(fin));
+/*
+ * sends a version 2 packet (see synchronizer/synchronization.h) to the server
+ */
+static void client_sendPacket(uint8_t *buffer) {
 
-    memcpy(&(spacket->data), &fin, sizeof(fin));
+    int bytes_sent = sendto(slicetime_client_sock, buffer, sw_size(buffer), 0, (struct sockaddr*)&slicetime_dest, sizeof(struct sockaddr_in));
+    if(bytes_sent < 0)
+	perror("Error sending packet:");
+}
 
+//builds the FINISH packet into buffer (SW_MAX_DATAGRAM bytes)
+static uint8_t *client_buildFinished(COM_Finished fin, uint8_t *buffer) {
     slicetime_seqNr++;
-    spacket->packetType = PACKETTYPE_FINISHED;
-    spacket->seqNr = htonl(slicetime_seqNr);
-    //	spacket->length = sizeof(reg);
-
-    int buffer_length = sizeof(*spacket)+sizeof(fin);
-    memcpy(&buffer,spacket,buffer_length);
+    sw_begin(buffer, slicetime_seqNr);
+    SW_Finished *sfin = (SW_Finished*) sw_add(buffer, SW_MSG_FINISHED, sizeof(SW_Finished));
+    sfin->periodId = fin.periodId;
+    sfin->runTime = fin.runTime;
+    sfin->realTime = fin.realTime;
+    sfin->clientId = fin.clientId;
+    return buffer;
+}
 
-    int bytes_sent = sendto(slicetime_client_sock, buffer, buffer_length, 0, (struct sockaddr*)&slicetime_dest, sizeof(struct sockaddr_in));
-    if(bytes_sent < 0)
-	perror("Error sending packet:");
+//keeps the FINISH packet of a period to be resent if the run permission is duplicated
+static void client_keepFinished(const uint8_t *buffer, int period) {
+    pthread_mutex_lock(&slicetime_finished_mutex);
+    memcpy(slicetime_finished_packet, buffer, sw_size(buffer));
+    slicetime_finished_period = period;
+    pthread_mutex_unlock(&slicetime_finished_mutex);
+}
 
-    //free memory
-    free(spacket);
+void client_sendFinished(COM_Finished fin) {
+    uint8_t buffer[SW_MAX_DATAGRAM];
+    client_sendPacket(client_buildFinished(fin, buffer));
     //printf("Done sending seqNr=%d. ", slicetime_seqNr);
 }
 
 void client_sendRegister(COM_RegisterClient reg) {
-	uint8_t buffer[32000];
-	//first of all, mutual exclusion for safety reasons :)
-
-	struct COM_SyncPacket
-			*spacket=(struct COM_SyncPacket*) malloc(sizeof(COM_SyncPacket)
-					+sizeof(reg));
-
-	memcpy(&(spacket->data),&reg,sizeof(reg));
+	uint8_t buffer[SW_MAX_DATAGRAM];
+	size_t description_length = strnlen(reg.client_Description, CLIENT_DESCR_LENGTH-1);
 
 	slicetime_seqNr++;
-	spacket->packetType = PACKETTYPE_REGISTER;
-	spacket->seqNr = htonl(slicetime_seqNr);
-	//	spacket->length = sizeof(reg);
-
-	int buffer_length = sizeof(*spacket)+sizeof(reg);
-	memcpy(&buffer,spacket,buffer_length);
-
-	int bytes_sent = sendto(slicetime_client_sock, buffer, buffer_length, 0, (struct sockaddr*)&slicetime_dest, sizeof(struct sockaddr_in));
-	if(bytes_sent < 0)
-	    perror("Error sending packet:");
+	sw_begin(buffer, slicetime_seqNr);
+	SW_Register *sreg = (SW_Register*) sw_add(buffer, SW_MSG_REGISTER, sizeof(SW_Register)+description_length);
+	sreg->clientId = reg.clientID;
+	sreg->clientType = reg.clientType;
+	memcpy(sreg->description, reg.client_Description, description_length);
 
-	//free memory
-	free(spacket);
+	client_sendPacket(buffer);
 	//printf("Done sending the registration.\n");
 }
 
 void client_sendUnregister(COM_UnregisterClient ureg) {
-	uint8_t buffer[32000];
-	//first of all, mutual exclusion for safety reasons :)
-
-	struct COM_SyncPacket
-	    *spacket = (struct COM_SyncPacket*) malloc(sizeof(COM_SyncPacket)
-					+sizeof(ureg));
-
-	memcpy(&(spacket->data), &ureg, sizeof(ureg));
+	uint8_t buffer[SW_MAX_DATAGRAM];
 
 	slicetime_seqNr++;
-	spacket->packetType = PACKETTYPE_UNREGISTER;
-	spacket->seqNr = htonl(slicetime_seqNr);
+	sw_begin(buffer, slicetime_seqNr);
+	SW_Unregister *sureg = (SW_Unregister*) sw_add(buffer, SW_MSG_UNREGISTER, sizeof(SW_Unregister));
+	sureg->clientId = ureg.clientID;
+	sureg->reason = ureg.reason;
 
-	int buffer_length = sizeof(*spacket)+sizeof(ureg);
-	memcpy(&buffer,spacket,buffer_length);
-
-	int bytes_sent = sendto(slicetime_client_sock, buffer, buffer_length, 0, (struct sockaddr*)&slicetime_dest, sizeof(struct sockaddr_in));
-	if(bytes_sent < 0)
-	    perror("Error sending packet:");
-
-	//free memory
-	free(spacket);
+	client_sendPacket(buffer);
 	//printf("Done unregister!\n");
 }
 
@@ -234,6 +226,29 @@ int register_client(const char *host, const char *host_port,
 }  
   
 
+void period_finished_guests(int virtual_time, int real_time, uint64_t cpu_max,
+			    uint64_t cpu_spread, int guests)
+{
+    if (slicetime_client_period % 10 == 0) {
+	printf("Finished period %i\n", slicetime_client_period);
+    }
+    COM_Finished fin;
+    fin.clientId = htons(slicetime_client_id);
+    fin.periodId = htonl(slicetime_client_period);
+    fin.runTime = htonl(virtual_time);
+    fin.realTime = htonl(real_time);
+
+    uint8_t buffer[SW_MAX_DATAGRAM];
+    client_buildFinished(fin, buffer);
+    SW_GuestTime *guest = (SW_GuestTime*) sw_add(buffer, SW_MSG_GUESTTIME, sizeof(SW_GuestTime));
+    guest->cpuTimeMax = sw_hton64(cpu_max);
+    guest->cpuTimeSpread = sw_hton64(cpu_spread);
+    guest->guests = htonl(guests);
+
+    client_keepFinished(buffer, slicetime_client_period);
+    client_sendPacket(buffer);
+}
+
 void period_finished(int virtual_time, int real_time)
 {
     if (slicetime_client_period % 10 == 0) {
@@ -245,7 +260,10 @@ void period_finished(int virtual_time, int real_time)
     fin.runTime = htonl(virtual_time);
     fin.realTime = htonl(real_time);
 
-    client_sendFinished(fin);
+    uint8_t buffer[SW_MAX_DATAGRAM];
+    client_buildFinished(fin, buffer);
+    client_keepFinished(buffer, slicetime_client_period);
+    client_sendPacket(buffer);
 }
 
 int unregister_client(int reason)
@@ -267,7 +285,7 @@ void handle_socket_read(void) {
     uint8_t buffer[30000];
 
     struct sockaddr from;
-    socklen_t addrlen;
+    socklen_t addrlen = sizeof(from);
     
     status = recvfrom(slicetime_client_sock, &buffer, sizeof(buffer), 0,
                       &from, &addrlen);
@@ -277,14 +295,26 @@ void handle_socket_read(void) {
     	return;
     }
 
-    struct COM_SyncPacket* received_packet=(COM_SyncPacket*) &buffer;
-
-    //int rec_seqNr = ntohl(received_packet->seqNr);
-    int rec_packetType = received_packet->packetType;
-
-    if (rec_packetType==PACKETTYPE_RUNPERMISSION) {
-	COM_RunPermission *result = (COM_RunPermission*) &(received_packet->data);
+    //the server sends version 1 run permissions while it has version 1 clients
+    const COM_RunPermission *result = NULL;
+    COM_RunPermission permission;
+    if (sw_valid(buffer, status)) {
+	const SW_Tlv *tlv;
+	for (tlv = sw_next(buffer, NULL); tlv != NULL; tlv = sw_next(buffer, tlv)) {
+	    if (tlv->type == SW_MSG_RUNPERMISSION && sw_length(tlv) >= sizeof(SW_RunPermission)) {
+		const SW_RunPermission *rp = (const SW_RunPermission*) sw_value(tlv);
+		permission.periodId = rp->periodId;
+		permission.runTime = rp->runTime;
+		result = &permission;
+	    }
+	}
+    } else if (status >= (int) (sizeof(COM_SyncPacket)+sizeof(COM_RunPermission))) {
+	struct COM_SyncPacket* received_packet=(COM_SyncPacket*) &buffer;
+	if (received_packet->packetType==PACKETTYPE_RUNPERMISSION)
+	    result = (COM_RunPermission*) &(received_packet->data);
+    }
 
+    if (result != NULL) {
 	uint32_t runTime = ntohl(result->runTime);
 	int periodId = ntohl(result->periodId);
 	//monitor_printf(monitor, "RunPermission received: runTime=%i,periodId=%i\n",runTime,periodId);
@@ -298,6 +328,16 @@ void handle_socket_read(void) {
 	else if ((periodId>slicetime_client_period)) {
 	    slicetime_client_period = periodId;
 	}
+	else {
+	    //the server resends the RUN_PERMISSION to clients it still waits for:
+	    //if the period is finished already, the FINISH message got lost.
+	    //Either way, the period must not run again
+	    pthread_mutex_lock(&slicetime_finished_mutex);
+	    if (periodId == slicetime_finished_period)
+		client_sendPacket(slicetime_finished_packet);
+	    pthread_mutex_unlock(&slicetime_finished_mutex);
+	    return;
+	}
 
     //printf("\nReceived periodId=%d. ", periodId);
 	slicetime_runfor_cb(runTime);
@@ -0,0 +1,128 @@
+#include "clienttable.h"
+#include <string.h>
+
+ClientTable::ClientTable() : count_(0), capacity_(0), bucketMask_(0), bucketShift_(31) {
+}
+
+void ClientTable::init(int maxClients) {
+
+	count_=0;
+	capacity_=maxClients;
+
+	ids_.assign(maxClients, 0);
+	periods_.assign(maxClients, 0);
+	types_.assign(maxClients, 0);
+	descriptions_.assign(maxClients, std::string());
+	struct sockaddr_in none={};
+	addresses_.assign(maxClients, none);
+	STATS_Client empty={};
+	stats_.assign(maxClients, empty);
+	shmSlots_.assign(maxClients, -1);
+	versions_.assign(maxClients, 1);
+
+	//keep the load factor at or below 50% so that probe sequences stay short
+	unsigned int buckets=2;
+	bucketShift_=31;
+	while (buckets < 2*(unsigned int)maxClients) {
+		buckets<<=1;
+		bucketShift_--;
+	}
+	buckets_.assign(buckets, -1);
+	bucketMask_=buckets-1;
+}
+
+unsigned int ClientTable::bucketOf(u_int16_t clientId) const {
+
+	//fibonacci hashing: the top bits of the product spread consecutive ids over the table
+	return ((u_int32_t) clientId * 2654435769u) >> bucketShift_;
+}
+
+int ClientTable::find(u_int16_t clientId) const {
+
+	for (unsigned int b=bucketOf(clientId); ; b=(b+1) & bucketMask_) {
+		int slot=buckets_[b];
+		if (slot < 0)
+			return -1;
+		if (ids_[slot]==clientId)
+			return slot;
+	}
+}
+
+int ClientTable::add(u_int16_t clientId) {
+
+	if (count_>=capacity_)
+		return -1;
+
+	unsigned int b=bucketOf(clientId);
+	for (; buckets_[b] >= 0; b=(b+1) & bucketMask_) {
+		if (ids_[buckets_[b]]==clientId)
+			return -1;
+	}
+
+	int slot=count_++;
+	ids_[slot]=clientId;
+	periods_[slot]=0;
+	types_[slot]=0;
+	descriptions_[slot].clear();
+	memset(&addresses_[slot], 0, sizeof(struct sockaddr_in));
+	memset(&stats_[slot], 0, sizeof(STATS_Client));
+	stats_[slot].clientId=clientId;
+	shmSlots_[slot]=-1;
+	versions_[slot]=1;
+	buckets_[b]=slot;
+	return slot;
+}
+
+bool ClientTable::remove(u_int16_t clientId) {
+
+	unsigned int b=bucketOf(clientId);
+	for (; ; b=(b+1) & bucketMask_) {
+		if (buckets_[b] < 0)
+			return false;
+		if (ids_[buckets_[b]]==clientId)
+			break;
+	}
+
+	int slot=buckets_[b];
+
+	//backward shift deletion: pull following entries of the probe sequence
+	//into the hole, so that no tombstones are needed
+	unsigned int hole=b;
+	for (unsigned int next=(hole+1) & bucketMask_; buckets_[next] >= 0; next=(next+1) & bucketMask_) {
+		unsigned int home=bucketOf(ids_[buckets_[next]]);
+		//move the entry only if its home bucket is not in (hole, next]
+		if (((next-home) & bucketMask_) >= ((next-hole) & bucketMask_)) {
+			buckets_[hole]=buckets_[next];
+			hole=next;
+		}
+	}
+	buckets_[hole]=-1;
+
+	//keep the slots dense
+	int last=--count_;
+	if (slot!=last)
+		moveSlot(last, slot);
+	descriptions_[last].clear();
+
+	return true;
+}
+
+void ClientTable::moveSlot(int from, int to) {
+
+	ids_[to]=ids_[from];
+	periods_[to]=periods_[from];
+	types_[to]=types_[from];
+	descriptions_[to].swap(descriptions_[from]);
+	addresses_[to]=addresses_[from];
+	stats_[to]=stats_[from];
+	shmSlots_[to]=shmSlots_[from];
+	versions_[to]=versions_[from];
+
+	//redirect the bucket that pointed to the moved slot
+	for (unsigned int b=bucketOf(ids_[to]); ; b=(b+1) & bucketMask_) {
+		if (buckets_[b]==from) {
+			buckets_[b]=to;
+			return;
+		}
+	}
+}
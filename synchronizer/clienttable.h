@@ -0,0 +1,78 @@
+#ifndef CLIENTTABLE_H_
+#define CLIENTTABLE_H_
+
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include "stats.h"
+
+/*
+ * Registry of the clients currently known to the server.
+ *
+ * Registered clients occupy the dense slots 0..size()-1, so everything that has
+ * to look at all clients only walks over the clients that actually exist. The
+ * per-slot data is kept in parallel arrays: the fields touched at every barrier
+ * (id, period) are packed tightly, rarely used ones (type, description, address,
+ * statistics) are kept apart from them.
+ *
+ * A client id is mapped to its slot with an open addressing hash table (linear
+ * probing, backward shift deletion), so that add, remove and find are O(1).
+ * When a client is removed, the last slot is moved into the hole; slot numbers
+ * are therefore only stable until the next remove().
+ */
+class ClientTable {
+
+public:
+	ClientTable();
+
+	//(re)initializes an empty table for at most maxClients clients
+	void init(int maxClients);
+
+	//returns the slot of clientId or -1 if the client is not registered
+	int find(u_int16_t clientId) const;
+
+	//adds a client and returns its slot, -1 if it is registered already or the table is full
+	int add(u_int16_t clientId);
+
+	//removes a client, returns false if it was not registered
+	bool remove(u_int16_t clientId);
+
+	int size() const { return count_; }
+	int capacity() const { return capacity_; }
+
+	//per-slot data, valid for 0 <= slot < size()
+	u_int16_t id(int slot) const { return ids_[slot]; }
+	int& period(int slot) { return periods_[slot]; }
+	int& type(int slot) { return types_[slot]; }
+	std::string& description(int slot) { return descriptions_[slot]; }
+	struct sockaddr_in& address(int slot) { return addresses_[slot]; } //where the client sends from (and receives)
+	STATS_Client& stats(int slot) { return stats_[slot]; } //statistics of the client, see stats.h
+	int& shmSlot(int slot) { return shmSlots_[slot]; } //slot in the shared memory page, -1 for UDP clients
+	int& version(int slot) { return versions_[slot]; } //wire protocol version the client registered with
+
+private:
+	unsigned int bucketOf(u_int16_t clientId) const;
+	void moveSlot(int from, int to);
+
+	int count_;
+	int capacity_;
+
+	//dense per-slot arrays
+	std::vector<u_int16_t> ids_;
+	std::vector<int> periods_;
+	std::vector<int> types_;
+	std::vector<std::string> descriptions_;
+	std::vector<struct sockaddr_in> addresses_;
+	std::vector<STATS_Client> stats_;
+	std::vector<int> shmSlots_;
+	std::vector<int> versions_;
+
+	//hash buckets containing slot numbers, -1 marks an empty bucket
+	std::vector<int32_t> buckets_;
+	unsigned int bucketMask_;
+	unsigned int bucketShift_;
+};
+
+#endif /*CLIENTTABLE_H_*/
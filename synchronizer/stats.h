@@ -0,0 +1,73 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <sys/types.h>
+#include <stdint.h>
+
+/*
+ * Statistics the server keeps per client and the format of the trace file
+ * it writes them to (srv_stats_file, read by statsreader).
+ *
+ * The trace file starts with a STATS_FileHeader. Every srv_stats_interval
+ * milliseconds (and once more when the server stops) a STATS_Snapshot is
+ * appended, followed by one STATS_Client record per registered client.
+ * All values are in host byte order.
+ *
+ * Histograms use logarithmic buckets: bucket 0 counts the value 0, bucket
+ * b > 0 counts the values in [2^(b-1), 2^b). The last bucket also takes all
+ * larger values.
+ */
+
+#define STATS_MAGIC 0x53545354 //"STST"
+#define STATS_VERSION 3
+#define STATS_BUCKETS 32
+
+struct STATS_FileHeader {
+	u_int32_t magic; //STATS_MAGIC
+	u_int32_t version; //STATS_VERSION
+	u_int32_t buckets; //STATS_BUCKETS
+	u_int32_t clientSize; //sizeof(STATS_Client)
+};
+
+struct STATS_Snapshot {
+	u_int64_t wallTime; //microseconds since the first run permission
+	u_int64_t virtualTime; //sum of the runTime of all completed periods (microseconds)
+	u_int64_t retransmissions; //run permissions resent to all clients
+	u_int32_t periodId; //the current period
+	u_int32_t clients; //number of STATS_Client records following
+};
+
+struct STATS_Client {
+	u_int64_t reports; //periods reported in time
+	u_int64_t latencySum; //completion latency: run permission sent -> report received (microseconds)
+	u_int64_t realTimeSum; //sum of the reported realTime (microseconds)
+	u_int64_t runTimeSum; //sum of the reported runTime (microseconds)
+	u_int64_t waitTimeSum; //sum of the waitTime reported by the client (microseconds, version 2 only)
+	u_int64_t guestCpuMaxSum; //sum of the reported SW_GuestTime.cpuTimeMax (nanoseconds)
+	u_int64_t guestCpuSpreadSum; //sum of the reported SW_GuestTime.cpuTimeSpread (nanoseconds)
+	u_int32_t latencyMax;
+	u_int32_t lastToReport; //periods in which this client was the last one the barrier waited for
+	u_int32_t late; //reports for periods that were already over
+	u_int32_t duplicates; //reports received more than once
+	u_int32_t retransmits; //run permissions resent to the client
+	u_int32_t clientResent; //packets the client reports to have resent (version 2 only)
+	u_int32_t guestReports; //reports in time that carried a SW_GuestTime
+	u_int32_t guests; //number of guests in the last SW_GuestTime
+	u_int16_t clientId;
+	u_int8_t clientType;
+	u_int8_t shm; //client uses the shared memory transport
+	u_int8_t version; //wire protocol version the client registered with
+	u_int8_t reserved[3];
+	u_int32_t latencyHist[STATS_BUCKETS]; //completion latency (microseconds)
+	u_int32_t ratioHist[STATS_BUCKETS]; //realTime/runTime (percent)
+};
+
+//the histogram bucket of a value
+inline int stats_bucket(u_int64_t value) {
+	if (value == 0)
+		return 0;
+	int b = 64 - __builtin_clzll(value);
+	return (b < STATS_BUCKETS) ? b : STATS_BUCKETS-1;
+}
+
+#endif /*STATS_H_*/
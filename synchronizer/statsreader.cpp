@@ -0,0 +1,135 @@
+/*
+ * Reads the statistics trace file written by the synchronizer server
+ * (srv_stats_file, see stats.h) and prints the overall slowdown factor and
+ * the clients that held up the barrier the most.
+ *
+ * usage: statsreader <trace file> [number of clients to show]
+ */
+
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+//upper bound of a histogram bucket
+u_int64_t bucketLimit(int bucket) {
+	return (bucket == 0) ? 0 : ((u_int64_t) 1 << bucket) - 1;
+}
+
+//the upper bound of the bucket containing the given percentile
+u_int64_t percentile(const u_int32_t* hist, double p) {
+
+	u_int64_t total=0;
+	for (int b=0; b<STATS_BUCKETS; b++)
+		total+=hist[b];
+	if (total==0)
+		return 0;
+
+	u_int64_t seen=0;
+	for (int b=0; b<STATS_BUCKETS; b++) {
+		seen+=hist[b];
+		if (seen >= p*total)
+			return bucketLimit(b);
+	}
+	return bucketLimit(STATS_BUCKETS-1);
+}
+
+//the clients that were waited for most often come first
+bool slowerThan(const STATS_Client& a, const STATS_Client& b) {
+
+	if (a.lastToReport != b.lastToReport)
+		return a.lastToReport > b.lastToReport;
+	u_int64_t meanA = a.reports ? a.latencySum/a.reports : 0;
+	u_int64_t meanB = b.reports ? b.latencySum/b.reports : 0;
+	return meanA > meanB;
+}
+
+bool readSnapshot(FILE* file, STATS_Snapshot& snapshot, std::vector<STATS_Client>& clients) {
+
+	if (fread(&snapshot, sizeof(snapshot), 1, file) != 1)
+		return false;
+	clients.resize(snapshot.clients);
+	if (snapshot.clients > 0 && fread(&clients[0], sizeof(STATS_Client), snapshot.clients, file) != snapshot.clients)
+		return false;
+	return true;
+}
+
+int main(int argc, char **argv) {
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <trace file> [number of clients to show]\n", argv[0]);
+		return 1;
+	}
+	int show = (argc > 2) ? atoi(argv[2]) : 10;
+
+	FILE* file=fopen(argv[1], "rb");
+	if (file==NULL) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	STATS_FileHeader header;
+	if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != STATS_MAGIC) {
+		fprintf(stderr, "%s is no statistics trace file\n", argv[1]);
+		return 1;
+	}
+	if (header.version != STATS_VERSION || header.buckets != STATS_BUCKETS || header.clientSize != sizeof(STATS_Client)) {
+		fprintf(stderr, "%s has an unsupported format (version %u)\n", argv[1], header.version);
+		return 1;
+	}
+
+	//only the last two snapshots are needed: the counters are cumulative
+	STATS_Snapshot current, snapshot, previous = STATS_Snapshot();
+	std::vector<STATS_Client> currentClients, clients;
+	int snapshots=0;
+	memset(&snapshot, 0, sizeof(snapshot));
+	while (readSnapshot(file, current, currentClients)) {
+		previous=snapshot;
+		snapshot=current;
+		clients.swap(currentClients);
+		snapshots++;
+	}
+	fclose(file);
+
+	if (snapshots==0) {
+		printf("No snapshots yet.\n");
+		return 0;
+	}
+
+	printf("Period %u, %u clients, %llu run permissions resent\n", snapshot.periodId, snapshot.clients,
+			(unsigned long long) snapshot.retransmissions);
+	printf("Wall clock time: %.3f s, virtual time: %.3f s\n", snapshot.wallTime/1e6, snapshot.virtualTime/1e6);
+	if (snapshot.virtualTime > 0)
+		printf("Slowdown factor: %.2f\n", (double) snapshot.wallTime/snapshot.virtualTime);
+	if (snapshots > 1 && snapshot.virtualTime > previous.virtualTime)
+		printf("Slowdown factor since the previous snapshot: %.2f\n",
+				(double) (snapshot.wallTime-previous.wallTime)/(snapshot.virtualTime-previous.virtualTime));
+
+	std::sort(clients.begin(), clients.end(), slowerThan);
+	if (show > (int) clients.size())
+		show = clients.size();
+
+	printf("\nSlowest clients (latency: run permission sent -> report received):\n");
+	printf("%6s %5s %3s %4s %10s %8s %10s %10s %10s %10s %8s %10s %6s %6s %8s %8s %6s %8s %9s\n",
+			"client", "type", "ver", "shm", "reports", "last%", "lat.mean", "lat.p99", "lat.max", "real/run",
+			"ratio.p99", "wait.mean", "late", "dup", "resent", "c.resent", "guests", "g.cpu%", "g.spread%");
+	for (int i=0; i<show; i++) {
+		STATS_Client& c=clients[i];
+		double lastShare = c.reports ? 100.0*c.lastToReport/c.reports : 0;
+		double meanLatency = c.reports ? (double) c.latencySum/c.reports : 0;
+		double ratio = c.runTimeSum ? (double) c.realTimeSum/c.runTimeSum : 0;
+		double meanWait = c.reports ? (double) c.waitTimeSum/c.reports : 0;
+		//CPU time of the busiest guest and the spread across the guests, relative to the mean runTime
+		double meanRunNs = c.reports ? 1000.0*c.runTimeSum/c.reports : 0;
+		double guestCpu = (c.guestReports && meanRunNs > 0) ? 100.0*c.guestCpuMaxSum/c.guestReports/meanRunNs : 0;
+		double guestSpread = (c.guestReports && meanRunNs > 0) ? 100.0*c.guestCpuSpreadSum/c.guestReports/meanRunNs : 0;
+		printf("%6u %5u %3u %4s %10llu %7.1f%% %8.0fus %8lluus %8uus %10.2f %7llu%% %8.0fus %6u %6u %8u %8u %6u %7.1f%% %8.1f%%\n",
+				c.clientId, c.clientType, c.version, c.shm ? "yes" : "no", (unsigned long long) c.reports, lastShare,
+				meanLatency, (unsigned long long) percentile(c.latencyHist, 0.99), c.latencyMax, ratio,
+				(unsigned long long) percentile(c.ratioHist, 0.99), meanWait, c.late, c.duplicates, c.retransmits,
+				c.clientResent, c.guests, guestCpu, guestSpread);
+	}
+	return 0;
+}
@@ -1,10 +1,13 @@
 #ifndef SYNCHRONIZATION_H_
 #define SYNCHRONIZATION_H_
-#include <cstdlib>
 #include <stdio.h>
 #include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <endian.h>
 /**
  *
  * This file contains important structs that are used for the communication between the xen-synchronizer (in server
@@ -17,6 +20,9 @@
  *   c) a server permits the clients to run for a time period X (PacketType=2)
  *   d) a client reports to a server that it has finished execution of period X (PacketType=3)
  *
+ * It is the only definition of the protocol: the synchronizer, slicetime-libvirt and the ns-3
+ * SyncClient all include it, so it has to stay valid C as well as C++.
+ *
  */
 
 
@@ -30,19 +36,20 @@
 #define CLIENT_TYPE_LOCAL_XDOMAIN 0
 #define CLIENT_TYPE_REMOTE_XDOMAIN 1
 #define CLIENT_TYPE_REMOTE_SIMULATION 2
+#define CLIENT_TYPE_RELAY 3 //a relay synchronizer that reports for a whole subtree of clients
 #define CLIENT_TYPE_TEST 133
 #define CLIENT_TYPE_OTHER 254
 #define CLIENT_TYPE_UNKNOWN 255
 
 #define CLIENT_DESCR_LENGTH 100 //length of client description in byte
 
-struct COM_RegisterClient {
+typedef struct COM_RegisterClient {
 
 	u_int16_t clientID; //the id of the client that wishes to register. must be unique!
 	u_int8_t clientType; // Type of client: 0 = locally managed Xen Client, 1 = remotely managed  Xen client, 2 = remote simulation client, 254 = other, 255 = unknown
 	char client_Description[CLIENT_DESCR_LENGTH]; //arbitrary client description.
 
-};
+} COM_RegisterClient;
 
 /*
  * unregisters a client from the synchronization server
@@ -53,11 +60,11 @@ struct COM_RegisterClient {
 #define UNREGISTER_REASON_OUT_OF_SYNC 1
 #define UNREGISTER_REASON_OTHER 2
 
-struct COM_UnregisterClient {
+typedef struct COM_UnregisterClient {
 
 	u_int16_t clientID; //the id of the client to unregister
 	u_int8_t reason; //the reason why a client unregisters, shoudl correspond to constant
-};
+} COM_UnregisterClient;
 
 /*
  * tell all clients that they're allowed to execute a certain amount of virtual time
@@ -77,13 +84,13 @@ struct COM_UnregisterClient {
  * as well as in the synchronizer
  * 
  */
-struct COM_RunPermission {
+typedef struct COM_RunPermission {
 
 	u_int32_t periodId; // used to identify the periods
 	u_int32_t runTime;  //the runtime the clients are allowed to continue their execution in MICROSECONDS!!! 
 
 
-};
+} COM_RunPermission;
 
 
 /*
@@ -93,13 +100,84 @@ struct COM_RunPermission {
  *  in order to avoid deadlocking (if a finished packet gets lost)
  */
 
-struct COM_Finished {
+typedef struct COM_Finished {
 	 u_int32_t periodId; //the id of the period whose execution has been finished;
 	 u_int32_t runTime; //the virtual runtime that was assigned in this period (microseconds)
 	 u_int32_t realTime; //the time actually needed for executing this period (microseconds)=> useful for statistics!
 	 u_int16_t clientId;
 
-};
+} COM_Finished;
+
+/*
+ *  optional extension of COM_Finished: a client that knows its pending events
+ *  appends this struct to its COM_Finished (same packet type, longer payload).
+ *
+ *  The server grants the next period up to the earliest time at which any client
+ *  could produce something visible to the others (nextEvent + lookahead), so idle
+ *  stretches are skipped in one period (conservative synchronization).
+ *  Clients that do not append it are assumed to be active all the time.
+ */
+
+#define NEXTEVENT_NONE 0xFFFFFFFF //no event pending
+
+typedef struct COM_NextEvent {
+	 u_int32_t nextEvent; //virtual time from the end of the finished period to the client's next event (microseconds)
+	 u_int32_t lookahead; //minimum delay before an event of the client becomes visible to others (microseconds)
+} COM_NextEvent;
+
+/*
+ *  shared memory transport for clients on the same host as the server
+ *
+ *  A client appends COM_ShmRequest to its COM_RegisterClient (same packet type,
+ *  longer payload). If the server runs with a shared memory page (srv_shm_name),
+ *  it answers with a COM_ShmGrant naming the page and the client's slot in it;
+ *  otherwise it ignores the request and the client keeps using UDP.
+ *
+ *  Page layout: a COM_ShmHeader followed by one COM_ShmSlot per possible client.
+ *  All values are in host byte order.
+ *  - run permissions: the server increments runSeq, writes periodId and runTime,
+ *    increments runSeq again and wakes the futex on runSeq, so runSeq is odd while
+ *    the permission is written (seqlock). Clients wait on runSeq and only accept a
+ *    permission read while runSeq was even and did not change.
+ *  - finished: the client writes its slot, then finishedPeriod (last), increments
+ *    doorbell and wakes the futex on doorbell, on which the server waits.
+ *  Unregistering still takes place over UDP.
+ */
+
+#define SHM_MAGIC 0x53544d31 //"STM1"
+#define SHM_NAME_LENGTH 64
+
+typedef struct COM_ShmRequest {
+	u_int32_t magic; //SHM_MAGIC, tells the request from trailing bytes
+} COM_ShmRequest;
+
+typedef struct COM_ShmGrant {
+	u_int16_t clientId;
+	u_int16_t slot; //index of the client's COM_ShmSlot
+	char shmName[SHM_NAME_LENGTH]; //name for shm_open()
+} COM_ShmGrant;
+
+#define SHM_FINISHED_NEXTEVENT 1 //nextEvent and lookahead of the slot are valid
+
+typedef struct COM_ShmHeader {
+	u_int32_t magic; //SHM_MAGIC
+	u_int32_t slots; //number of COM_ShmSlots following the header
+	u_int32_t runSeq; //futex word, odd while a run permission is written
+	u_int32_t periodId;
+	u_int32_t runTime;
+	u_int32_t doorbell; //futex word, incremented by the clients after reporting
+	u_int8_t pad[40]; //keep the slots on their own cache lines
+} COM_ShmHeader;
+
+typedef struct COM_ShmSlot {
+	u_int32_t finishedPeriod; //the period reported as finished, written last
+	u_int32_t runTime;
+	u_int32_t realTime;
+	u_int32_t nextEvent;
+	u_int32_t lookahead;
+	u_int32_t flags; //SHM_FINISHED_*
+	u_int8_t pad[40];
+} COM_ShmSlot;
 
 //definition of packet type ids (should correspond to introductionary comment above!)
 
@@ -107,6 +185,7 @@ struct COM_Finished {
 #define PACKETTYPE_UNREGISTER 1 //used to unregister a client - note: we could use tcp for this as well.
 #define PACKETTYPE_RUNPERMISSION 2 //used to announce that the clients can continue with their execution. UDP-Broadcast
 #define PACKETTYPE_FINISHED 3 //used by clients to announce they finished execution of a period. UDP-Unicast
+#define PACKETTYPE_SHMGRANT 4 //tells a client to use the shared memory page. UDP-Unicast
 
 
 /*
@@ -114,15 +193,210 @@ struct COM_Finished {
  *
  */
 
-struct COM_SyncPacket {
+typedef struct COM_SyncPacket {
 
 	u_int32_t seqNr; //a seqNr to distinguish the packets
 	u_int8_t  packetType; //contains packet type information
 	//u_int16_t length; //length of data
 	u_int8_t data[]; //should contain one of the COM_* Structs 
 
-};
+} COM_SyncPacket;
+
+
+
+/*
+ *  Version 2 of the wire format
+ *
+ *  The packets above (version 1) carry neither a version nor a length, and their
+ *  layout depends on the padding the compiler adds to the structs. A version 2
+ *  datagram starts with a SW_Header followed by one or more messages. Each
+ *  message is a SW_Tlv (type and length of the value) followed by the value,
+ *  padded to a multiple of 4 bytes. Several messages can share one datagram,
+ *  e.g. a Finished with the NextEvent and the ClientStats of the same client.
+ *
+ *  All structs are packed with a fixed size, all multi-byte fields are in network
+ *  byte order. Receivers skip message types they do not know, so messages can
+ *  be added without breaking older receivers.
+ *
+ *  The server accepts both versions. It answers every client in the version the
+ *  client registered with and sends version 2 run permissions as soon as no
+ *  version 1 client is registered. Clients accept run permissions of both versions.
+ *  A datagram is taken as version 2 if sw_valid() holds for it (version 1 sequence
+ *  numbers would have to reach 0x53540000 to start like that).
+ */
+
+#define SW_MAGIC 0x5354 //"ST"
+#define SW_VERSION 2
+#define SW_MAX_DATAGRAM 1472 //fits into a single ethernet frame
+
+typedef struct SW_Header {
+	uint16_t magic; //SW_MAGIC
+	uint8_t version; //SW_VERSION
+	uint8_t flags; //reserved, 0
+	uint32_t seqNr; //a seqNr to distinguish the packets
+	uint16_t length; //bytes of messages following the header
+	uint16_t reserved;
+} __attribute__((packed)) SW_Header;
+
+typedef struct SW_Tlv {
+	uint8_t type; //SW_MSG_*
+	uint8_t flags; //reserved, 0
+	uint16_t length; //length of the value (without padding)
+} __attribute__((packed)) SW_Tlv;
+
+#define SW_MSG_REGISTER 1 //SW_Register
+#define SW_MSG_UNREGISTER 2 //SW_Unregister
+#define SW_MSG_RUNPERMISSION 3 //SW_RunPermission
+#define SW_MSG_FINISHED 4 //SW_Finished
+#define SW_MSG_NEXTEVENT 5 //SW_NextEvent, only together with a SW_Finished
+#define SW_MSG_SHMGRANT 6 //SW_ShmGrant
+#define SW_MSG_CLIENTSTATS 7 //SW_ClientStats, only together with a SW_Finished
+#define SW_MSG_GUESTTIME 8 //SW_GuestTime, only together with a SW_Finished
+
+#define SW_REGISTER_SHM 1 //the client asks for the shared memory transport
+
+typedef struct SW_Register {
+	uint16_t clientId;
+	uint8_t clientType; //CLIENT_TYPE_*
+	uint8_t flags; //SW_REGISTER_*
+	char description[]; //up to CLIENT_DESCR_LENGTH-1 bytes, the rest of the value
+} __attribute__((packed)) SW_Register;
+
+typedef struct SW_Unregister {
+	uint16_t clientId;
+	uint8_t reason; //UNREGISTER_REASON_*
+	uint8_t reserved;
+} __attribute__((packed)) SW_Unregister;
+
+typedef struct SW_RunPermission {
+	uint32_t periodId;
+	uint32_t runTime; //microseconds
+} __attribute__((packed)) SW_RunPermission;
+
+typedef struct SW_Finished {
+	uint32_t periodId;
+	uint32_t runTime; //microseconds
+	uint32_t realTime; //microseconds
+	uint16_t clientId;
+	uint16_t reserved;
+} __attribute__((packed)) SW_Finished;
+
+typedef struct SW_NextEvent {
+	uint32_t nextEvent; //as in COM_NextEvent
+	uint32_t lookahead;
+} __attribute__((packed)) SW_NextEvent;
+
+typedef struct SW_ShmGrant {
+	uint16_t clientId;
+	uint16_t slot; //index of the client's COM_ShmSlot
+	char shmName[]; //up to SHM_NAME_LENGTH-1 bytes, the rest of the value
+} __attribute__((packed)) SW_ShmGrant;
+
+typedef struct SW_ClientStats {
+	uint32_t waitTime; //time the client waited for the run permission of the finished period (microseconds)
+	uint32_t resent; //packets the client resent since it registered
+} __attribute__((packed)) SW_ClientStats;
+
+/*
+ * CPU time the guests of a client (e.g. the VMs the libvirt client suspends)
+ * actually consumed in the finished period. It tells a host whose guests got
+ * too little CPU, whatever the wall clock time of the period was.
+ */
+typedef struct SW_GuestTime {
+	uint64_t cpuTimeMax; //CPU time of the guest that consumed the most (nanoseconds)
+	uint64_t cpuTimeSpread; //difference to the guest that consumed the least (nanoseconds)
+	uint32_t guests; //number of guests measured
+	uint32_t reserved;
+} __attribute__((packed)) SW_GuestTime;
+
+//the sizes of the structs are part of the format
+typedef char SW_sizeCheck[(sizeof(SW_Header)==12 && sizeof(SW_Tlv)==4 && sizeof(SW_Register)==4
+		&& sizeof(SW_Unregister)==4 && sizeof(SW_RunPermission)==8 && sizeof(SW_Finished)==16
+		&& sizeof(SW_NextEvent)==8 && sizeof(SW_ShmGrant)==4 && sizeof(SW_ClientStats)==8
+		&& sizeof(SW_GuestTime)==24) ? 1 : -1];
+
+//byte order of the 64 bit fields
+static inline uint64_t sw_hton64(uint64_t value) {
+	return htobe64(value);
+}
+
+static inline uint64_t sw_ntoh64(uint64_t value) {
+	return be64toh(value);
+}
+
+/*
+ * starts a datagram without messages in buf (SW_MAX_DATAGRAM bytes)
+ */
+static inline void sw_begin(uint8_t *buf, uint32_t seqNr) {
+	SW_Header *header = (SW_Header*) buf;
+	header->magic = htons(SW_MAGIC);
+	header->version = SW_VERSION;
+	header->flags = 0;
+	header->seqNr = htonl(seqNr);
+	header->length = 0;
+	header->reserved = 0;
+}
+
+/*
+ * appends a message with a value of length bytes to the datagram in buf
+ * and returns the zeroed value, NULL if the datagram is full
+ */
+static inline void *sw_add(uint8_t *buf, uint8_t type, uint16_t length) {
+	SW_Header *header = (SW_Header*) buf;
+	size_t used = ntohs(header->length);
+	size_t padded = (length + 3) & ~3;
+	if (sizeof(SW_Header) + used + sizeof(SW_Tlv) + padded > SW_MAX_DATAGRAM)
+		return NULL;
+	SW_Tlv *tlv = (SW_Tlv*) (buf + sizeof(SW_Header) + used);
+	tlv->type = type;
+	tlv->flags = 0;
+	tlv->length = htons(length);
+	memset(tlv + 1, 0, padded);
+	header->length = htons(used + sizeof(SW_Tlv) + padded);
+	return tlv + 1;
+}
+
+//the number of bytes to send of the datagram in buf
+static inline size_t sw_size(const uint8_t *buf) {
+	return sizeof(SW_Header) + ntohs(((const SW_Header*) buf)->length);
+}
+
+//sets the sequence number of the datagram in buf (e.g. before resending it)
+static inline void sw_setSeqNr(uint8_t *buf, uint32_t seqNr) {
+	((SW_Header*) buf)->seqNr = htonl(seqNr);
+}
+
+//true if the len bytes in buf are a version 2 datagram
+static inline int sw_valid(const uint8_t *buf, size_t len) {
+	const SW_Header *header = (const SW_Header*) buf;
+	return len >= sizeof(SW_Header) && ntohs(header->magic) == SW_MAGIC
+			&& header->version == SW_VERSION && sw_size(buf) == len;
+}
+
+/*
+ * returns the message following prev (the first one if prev is NULL) of the
+ * valid datagram in buf, NULL at the end. The value lies completely within the datagram.
+ */
+static inline const SW_Tlv *sw_next(const uint8_t *buf, const SW_Tlv *prev) {
+	const uint8_t *end = buf + sw_size(buf);
+	const uint8_t *p = (prev == NULL) ? buf + sizeof(SW_Header)
+			: (const uint8_t*) (prev + 1) + ((ntohs(prev->length) + 3) & ~3);
+	if (p + sizeof(SW_Tlv) > end)
+		return NULL;
+	const SW_Tlv *tlv = (const SW_Tlv*) p;
+	if ((const uint8_t*) (tlv + 1) + ntohs(tlv->length) > end)
+		return NULL;
+	return tlv;
+}
+
+//the value of a message and its length
+static inline const void *sw_value(const SW_Tlv *tlv) {
+	return tlv + 1;
+}
 
+static inline size_t sw_length(const SW_Tlv *tlv) {
+	return ntohs(tlv->length);
+}
 
 
 #endif /*SYNCHRONIZATION_H_*/
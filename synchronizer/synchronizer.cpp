@@ -1,11 +1,21 @@
 #include "configuration.h"
 #include "synchronization.h"
 #include "synchronizer.h"
+#include "clienttable.h"
 #include <iostream>
 #include <stdio.h>
 #include <limits.h>
+#include <math.h>
 #include <time.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <ifaddrs.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -15,16 +25,40 @@ Configuration cf(CONFIGFILE_NAME);
 std::string mode;
 int sock;
 
-bool srv_clientRegistered[MAX_CLIENTS]; //stores if a client with a certain id is registered
-int srv_clientType[MAX_CLIENTS]; //stores the clients' types
-int srv_recClientCounter; //a counter for the number of currently registered clients
-int srv_period[MAX_CLIENTS]; //stores the period of the clients. needed to determine if all clients have finishted
+ClientTable srv_clients; //the registered clients with their types, descriptions and last reported periods
+int srv_outstanding; //number of registered clients that have not yet reported the current period
+u_int32_t srv_periodMaxRealTime; //largest realTime reported for the current period
+u_int32_t srv_periodHorizon; //earliest nextEvent+lookahead reported for the current period (0: unknown)
+bool srv_started = false; //set once the first run permission has been sent
 int srv_currentPeriod = 1;
 int srv_maxPeriod = 0;
 
+int srv_workerThreads = 1; //number of receive threads (each one with its own SO_REUSEPORT socket)
+int srv_recvBatch = SRV_DEFAULT_RECV_BATCH; //max. number of datagrams fetched with one recvmmsg() call
+int srv_sockets[SRV_MAX_WORKERS];
+bool srv_stopped = false;
+
+//protects all srv_* state. It is taken once per received batch, not once per packet
+pthread_mutex_t srv_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 int seqNr = 0;
 std::string srv_brdcast_address;
 
+//fan-out of the run permissions (see srv_sendRunPermission())
+int srv_fanout = FANOUT_BROADCAST;
+struct sockaddr_in srv_destination; //broadcast address or multicast group
+uint8_t srv_rpPacket[SW_MAX_DATAGRAM]; //preformatted run permission
+struct iovec srv_rpIovec; //points to srv_rpPacket, shared by all messages
+int srv_legacyClients = 0; //registered clients speaking version 1 of the wire format
+struct mmsghdr* srv_fanoutMsgs; //one message per client slot for unicasts
+
+//relay mode: the relay registers as one client at its parent synchronizer and
+//runs the barrier of its own subtree of clients like a server
+int relay_sock = -1; //socket towards the parent synchronizer
+struct sockaddr_in relay_upstream; //address of the parent synchronizer
+int relay_clientId; //id with which the relay is registered at its parent
+bool relay_registered = false;
+
 std::string client_sync_server;
 int server_port;
 int client_port;
@@ -33,9 +67,52 @@ int srv_min_clients;
 
 u_int32_t srv_barrierunTime;
 
+//adaptive slice length (see srv_adaptRunTime())
+bool srv_adaptive = false;
+u_int32_t srv_minInterval; //bounds for the adapted runTime (microseconds)
+u_int32_t srv_maxInterval;
+double srv_adaptGrow; //factor applied to the runTime while all clients keep up
+double srv_adaptShrink; //factor applied to the runTime if the slowest client's realTime spikes
+double srv_adaptFastRatio; //realTime/runTime ratio up to which a period counts as quick
+double srv_adaptSpikeRatio; //a ratio this much above the average counts as spike
+double srv_avgRatio = 0; //moving average of the realTime/runTime ratio of the slowest client
+
+//lookahead: grant periods up to the next event the clients announced
+bool srv_lookahead = false;
+u_int32_t srv_maxGrant; //upper bound for such a period (microseconds)
+
+//loss recovery: the run permission is resent to every client that did not report
+//its period within the retransmission timeout (see srv_retransmit())
+int srv_timerfd = -1;
+u_int32_t srv_minRto; //bounds of the retransmission timeout (microseconds)
+u_int32_t srv_maxRto;
+u_int32_t srv_rto; //timeout of the current period, doubled after every retransmission
+double srv_srtt = 0; //smoothed round trip time, i.e. period duration minus compute time (microseconds)
+double srv_rttvar = 0;
+double srv_computeRatio = 0; //realTime/runTime of the slowest client in the last sampled period
+int srv_periodSentId = 0; //the period the timer is running for
+u_int64_t srv_periodSentAt; //when its run permission was sent first
+u_int64_t srv_deadline; //when the timer expires
+bool srv_periodResent = false; //periods with retransmissions give no rtt sample (Karn)
+u_int64_t srv_retransmissions = 0;
+
+//shared memory transport for clients on this host (see synchronization.h)
+COM_ShmHeader* srv_shmHeader = NULL;
+COM_ShmSlot* srv_shmSlots;
+size_t srv_shmLen;
+std::string srv_shmName;
+std::vector<int> srv_shmOwner; //id of the client using a shm slot, -1 if free
+int srv_shmClients = 0; //number of clients using the shared memory page
+
+//statistics per client, written to a trace file (see stats.h)
+std::string srv_statsFile;
+int srv_statsInterval; //milliseconds between two snapshots
+u_int64_t srv_startedAt; //when the first run permission was sent
+u_int64_t srv_virtualTime = 0; //sum of the runTime of all completed periods
+pthread_cond_t srv_statsCond = PTHREAD_COND_INITIALIZER; //signalled when the server stops
+
 struct COM_RunPermission srv_runpermission;
 
-std::string srv_ClientDescription[MAX_CLIENTS];
 int client_period = -1; //-1 denots not started
 /*------------------------------------------------------------------------------------------
  * main server behaviour
@@ -43,74 +120,836 @@ int client_period = -1; //-1 denots not started
  *
  */
 
-/**
- * This function handles registration packets delivered to a server
- *
- * If a client registers, first a couple of checks are performed in order to prevent
- * double registration or registration at a synchronizer that is in fact running in client mode
- *
- * Afterwards, the data is simply stored in adequate data structures.
+/*
+ * monotonic clock in microseconds
+ */
+u_int64_t srv_now() {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u_int64_t) ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+/*
+ * (re)arms the retransmission timer to expire after the given number of microseconds
+ */
+void srv_armTimer(u_int32_t timeout) {
+
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = timeout/1000000;
+	its.it_value.tv_nsec = (timeout%1000000)*1000;
+	if (timeout==0)
+		its.it_value.tv_nsec = 1; //a zero value would disarm the timer
+	srv_deadline = srv_now() + timeout;
+	timerfd_settime(srv_timerfd, 0, &its, NULL);
+}
+
+/*
+ * the retransmission timeout for a period of the given length: the time the
+ * slowest client is expected to compute plus srtt + 4*rttvar (as in TCP).
+ * Until the first sample is taken, srv_maxRto is used.
+ */
+u_int32_t srv_computeRto(u_int32_t runTime) {
+
+	if (srv_srtt==0)
+		return srv_maxRto;
+
+	double rto = srv_computeRatio*runTime + srv_srtt + 4*srv_rttvar;
+	if (rto < srv_minRto) rto=srv_minRto;
+	if (rto > srv_maxRto) rto=srv_maxRto;
+	return (u_int32_t) rto;
+}
+
+/*
+ * the barrier of the current period completed: take an rtt sample unless
+ * the run permission had to be resent
+ */
+void srv_sampleRtt() {
+
+	if (srv_periodResent || srv_periodSentId!=srv_currentPeriod)
+		return;
+
+	u_int32_t runTime=ntohl(srv_runpermission.runTime);
+	double elapsed=srv_now()-srv_periodSentAt;
+	double rtt=elapsed-srv_periodMaxRealTime;
+	if (rtt < 0) rtt=0;
+	srv_computeRatio=(runTime > 0) ? (double) srv_periodMaxRealTime / runTime : 0;
+
+	if (srv_srtt==0) {
+		srv_srtt=(rtt > 0) ? rtt : 1;
+		srv_rttvar=rtt/2;
+	} else {
+		srv_rttvar=0.75*srv_rttvar + 0.25*fabs(srv_srtt-rtt);
+		srv_srtt=0.875*srv_srtt + 0.125*rtt;
+	}
+}
+
+/*
+ * futex operations on a word in the shared memory page (not process private)
+ */
+void futex_wait(u_int32_t* word, u_int32_t value) {
+	syscall(SYS_futex, word, FUTEX_WAIT, value, NULL, NULL, 0);
+}
+
+void futex_wake(u_int32_t* word) {
+	syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/*
+ * creates the shared memory page if srv_shm_name is configured
+ */
+int srv_initShm() {
+
+	srv_shmName = cf.getAsString("SERVER", "srv_shm_name");
+	if (srv_shmName=="")
+		return 0;
+	if (srv_shmName.size() >= SHM_NAME_LENGTH) {
+		fprintf(stderr, "srv_shm_name is too long\n");
+		return -1;
+	}
+
+	int slots = cf.getAsInt("SERVER", "srv_shm_slots", 64);
+	if (slots < 1) slots = 1;
+	if (slots > 65535) slots = 65535;
+	srv_shmLen = sizeof(COM_ShmHeader) + slots*sizeof(COM_ShmSlot);
+
+	//a page left over by a crashed server must not be reused
+	shm_unlink(srv_shmName.c_str());
+	int fd = shm_open(srv_shmName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0666);
+	if (fd < 0 || ftruncate(fd, srv_shmLen) != 0) {
+		fprintf(stderr, "shared memory %s: %s\n", srv_shmName.c_str(), strerror(errno));
+		return -1;
+	}
+	void* page = mmap(NULL, srv_shmLen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (page == MAP_FAILED) {
+		fprintf(stderr, "mmap(): %s\n", strerror(errno));
+		return -1;
+	}
+
+	memset(page, 0, srv_shmLen);
+	srv_shmHeader = (COM_ShmHeader*) page;
+	srv_shmSlots = (COM_ShmSlot*) ((uint8_t*) page + sizeof(COM_ShmHeader));
+	srv_shmHeader->slots = slots;
+	srv_shmHeader->magic = SHM_MAGIC;
+	srv_shmOwner.assign(slots, -1);
+
+	printf("Shared memory transport: %s (%i slots)\n", srv_shmName.c_str(), slots);
+	return 0;
+}
+
+/*
+ * true if the address belongs to this host, i.e. the client can map the page
+ */
+bool srv_isLocalAddress(struct in_addr addr) {
+
+	if ((ntohl(addr.s_addr) >> 24) == 127)
+		return true;
+
+	struct ifaddrs* ifas;
+	if (getifaddrs(&ifas) != 0)
+		return false;
+	bool local=false;
+	for (struct ifaddrs* ifa=ifas; ifa!=NULL && !local; ifa=ifa->ifa_next)
+		if (ifa->ifa_addr!=NULL && ifa->ifa_addr->sa_family==AF_INET)
+			local=(((struct sockaddr_in*) ifa->ifa_addr)->sin_addr.s_addr==addr.s_addr);
+	freeifaddrs(ifas);
+	return local;
+}
+
+/*
+ * gives a registered client a slot in the shared memory page (if it has none yet)
+ * and tells it so
+ */
+void srv_shmGrant(int slot, struct sockaddr_in* from) {
+
+	if (srv_shmHeader==NULL)
+		return;
+	if (!srv_isLocalAddress(from->sin_addr)) {
+		printf("Client %i is not on this host, it uses UDP\n", srv_clients.id(slot));
+		return;
+	}
+
+	if (srv_clients.shmSlot(slot) < 0) {
+		int s=0;
+		while (s < (int) srv_shmHeader->slots && srv_shmOwner[s] >= 0)
+			s++;
+		if (s == (int) srv_shmHeader->slots) {
+			printf("No free shared memory slot, client %i uses UDP\n", srv_clients.id(slot));
+			return;
+		}
+		srv_shmOwner[s]=srv_clients.id(slot);
+		srv_shmSlots[s].finishedPeriod=0;
+		srv_clients.shmSlot(slot)=s;
+		srv_shmClients++;
+	}
+
+	//the grant is sent in the version the client registered with
+	uint8_t buffer[SW_MAX_DATAGRAM];
+	size_t length;
+	seqNr++;
+	if (srv_clients.version(slot)==SW_VERSION) {
+		size_t nameLength=strnlen(srv_shmName.c_str(), SHM_NAME_LENGTH-1);
+		sw_begin(buffer, seqNr);
+		SW_ShmGrant* grant=(SW_ShmGrant*) sw_add(buffer, SW_MSG_SHMGRANT, sizeof(SW_ShmGrant)+nameLength);
+		grant->clientId=htons(srv_clients.id(slot));
+		grant->slot=htons(srv_clients.shmSlot(slot));
+		memcpy(grant->shmName, srv_shmName.c_str(), nameLength);
+		length=sw_size(buffer);
+	} else {
+		struct COM_SyncPacket *packet=(struct COM_SyncPacket*) buffer;
+		COM_ShmGrant* grant=(COM_ShmGrant*) &packet->data;
+		length=sizeof(COM_SyncPacket)+sizeof(COM_ShmGrant);
+		memset(buffer, 0, length);
+		packet->seqNr=htonl(seqNr);
+		packet->packetType=PACKETTYPE_SHMGRANT;
+		grant->clientId=htons(srv_clients.id(slot));
+		grant->slot=htons(srv_clients.shmSlot(slot));
+		strncpy(grant->shmName, srv_shmName.c_str(), SHM_NAME_LENGTH-1);
+	}
+
+	int bytes_sent = sendto(sock, buffer, length, 0, (struct sockaddr*) from, sizeof(struct sockaddr_in));
+	if(bytes_sent < 0) printf("Error sending packet: %s\n", strerror(errno) );
+}
+
+/*
+ * frees the shared memory slot of a client that unregisters
+ */
+void srv_shmRelease(int slot) {
+
+	int s=srv_clients.shmSlot(slot);
+	if (s >= 0) {
+		srv_shmOwner[s]=-1;
+		srv_clients.shmSlot(slot)=-1;
+		srv_shmClients--;
+	}
+}
+
+/*
+ * publishes the current run permission in the shared memory page
+ */
+void srv_shmPublish() {
+
+	//runSeq is odd while the run permission is written (seqlock)
+	__sync_fetch_and_add(&srv_shmHeader->runSeq, 1);
+	*(volatile u_int32_t*)&srv_shmHeader->periodId=ntohl(srv_runpermission.periodId);
+	*(volatile u_int32_t*)&srv_shmHeader->runTime=ntohl(srv_runpermission.runTime);
+	__sync_fetch_and_add(&srv_shmHeader->runSeq, 1);
+	futex_wake(&srv_shmHeader->runSeq);
+}
+
+/*
+ * sets up the fan-out of the run permissions: the destination of broadcasts
+ * and multicasts and the message array for unicasts. All messages share the
+ * single preformatted packet srv_rpPacket.
+ */
+int srv_initFanout() {
+
+	std::string fanout = cf.getAsString("SERVER", "srv_fanout", "broadcast");
+	if (fanout=="broadcast")
+		srv_fanout=FANOUT_BROADCAST;
+	else if (fanout=="multicast")
+		srv_fanout=FANOUT_MULTICAST;
+	else if (fanout=="unicast")
+		srv_fanout=FANOUT_UNICAST;
+	else {
+		fprintf(stderr, "Unknown srv_fanout: %s\n", fanout.c_str());
+		return -1;
+	}
+
+	memset(&srv_destination, 0, sizeof(srv_destination));
+	srv_destination.sin_family = AF_INET;
+	srv_destination.sin_addr.s_addr = inet_addr(srv_brdcast_address.c_str());
+	srv_destination.sin_port = htons(client_port);
+
+	if (srv_fanout==FANOUT_MULTICAST) {
+		unsigned char ttl = cf.getAsInt("SERVER", "srv_multicast_ttl", 1);
+		if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) != 0)
+			printf("IP_MULTICAST_TTL could not be set: %s\n", strerror(errno));
+	}
+
+	memset(srv_rpPacket, 0, sizeof(srv_rpPacket));
+	srv_rpIovec.iov_base=srv_rpPacket;
+	srv_rpIovec.iov_len=0;
+
+	srv_fanoutMsgs = (struct mmsghdr*) calloc(srv_clients.capacity(), sizeof(struct mmsghdr));
+	if (srv_fanoutMsgs == NULL) {
+		fprintf(stderr, "srv_initFanout(): out of memory\n");
+		return -1;
+	}
+	for (int i=0; i<srv_clients.capacity(); i++) {
+		srv_fanoutMsgs[i].msg_hdr.msg_iov=&srv_rpIovec;
+		srv_fanoutMsgs[i].msg_hdr.msg_iovlen=1;
+		srv_fanoutMsgs[i].msg_hdr.msg_namelen=sizeof(struct sockaddr_in);
+	}
+
+	printf("Sending run permissions by %s\n", fanout.c_str());
+	return 0;
+}
+
+/*
+ * writes a new sequence number and the current run permission into srv_rpPacket.
+ * Version 2 clients understand both formats, so version 1 is used as long as
+ * a version 1 client is registered.
+ */
+void srv_formatRunPermission() {
+
+	seqNr++;
+	if (srv_legacyClients > 0) {
+		struct COM_SyncPacket *packet=(struct COM_SyncPacket*) srv_rpPacket;
+		packet->seqNr=htonl(seqNr);
+		packet->packetType=PACKETTYPE_RUNPERMISSION;
+		memcpy(&(packet->data),&srv_runpermission,sizeof(COM_RunPermission));
+		srv_rpIovec.iov_len=sizeof(COM_SyncPacket)+sizeof(COM_RunPermission);
+	} else {
+		sw_begin(srv_rpPacket, seqNr);
+		SW_RunPermission* rp=(SW_RunPermission*) sw_add(srv_rpPacket, SW_MSG_RUNPERMISSION, sizeof(SW_RunPermission));
+		rp->periodId=srv_runpermission.periodId;
+		rp->runTime=srv_runpermission.runTime;
+		srv_rpIovec.iov_len=sw_size(srv_rpPacket);
+	}
+}
+
+/*
+ * sends srv_rpPacket to the addresses of the first count entries of srv_fanoutMsgs
+ */
+void srv_sendFanout(int count) {
+
+	for (int done=0; done<count; ) {
+		int batch = (count-done < SRV_SENDMMSG_MAX) ? count-done : SRV_SENDMMSG_MAX;
+		int sent = sendmmsg(sock, srv_fanoutMsgs+done, batch, 0);
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			//skip the message that failed, the retransmission timer covers it
+			printf("Error sending packet: %s\n", strerror(errno) );
+			sent = 1;
+		}
+		done += sent;
+	}
+}
+
+/* this sends the current runpermission
+ *   invoked either if all clients finished their curred barrier
+ *   or if a client registers while the emulation is running
+ * and starts the retransmission timer of the period
  */
 void srv_sendRunPermission() {
 
 	//printf("Sending RunPermission: periodId: %i,runtime: %i\n", ntohl(srv_runpermission.periodId), ntohl(srv_runpermission.runTime));
-	//first of all, mutual exclusion for safety reasons :)
 
-	int psize = sizeof(COM_SyncPacket) + sizeof(srv_runpermission);
+	srv_formatRunPermission();
 
-	struct COM_SyncPacket *packet=(struct COM_SyncPacket*) malloc(psize);
-	seqNr++;
-	packet->seqNr=htonl(seqNr);
-	packet->packetType=PACKETTYPE_RUNPERMISSION;
-	//packet->length=htons(sizeof(COM_RunPermission));
-	memcpy(&(packet->data),&srv_runpermission,sizeof(COM_RunPermission));
+	if (srv_shmHeader!=NULL)
+		srv_shmPublish();
 
-	struct sockaddr_in destination;
+	if (srv_fanout==FANOUT_UNICAST) {
+		int count=0;
+		for (int slot=0; slot<srv_clients.size(); slot++)
+			if (srv_clients.shmSlot(slot) < 0)
+				srv_fanoutMsgs[count++].msg_hdr.msg_name=&srv_clients.address(slot);
+		srv_sendFanout(count);
+	} else if (srv_shmClients < srv_clients.size()) {
+		int bytes_sent = sendto(sock, srv_rpPacket, srv_rpIovec.iov_len, 0,(struct sockaddr*) &srv_destination, sizeof(struct sockaddr_in) );
+		if(bytes_sent < 0) printf("Error sending packet: %s\n", strerror(errno) );
+	}
 
-	destination.sin_family = AF_INET;
-	destination.sin_addr.s_addr = inet_addr(srv_brdcast_address.c_str());
-	destination.sin_port = htons(client_port);
+	if (!srv_started)
+		srv_startedAt = srv_now();
+	srv_started = true;
+
+	int period=ntohl(srv_runpermission.periodId);
+	if (period!=srv_periodSentId) {
+		srv_periodSentId=period;
+		srv_periodSentAt=srv_now();
+		srv_periodResent=false;
+		srv_rto=srv_computeRto(ntohl(srv_runpermission.runTime));
+	} else
+		srv_periodResent=true;
+	srv_armTimer(srv_rto);
+}
 
-	int bytes_sent = sendto(sock, packet, psize, 0,(struct sockaddr*) &destination, sizeof(struct sockaddr_in) );
-	if(bytes_sent < 0) printf("Error sending packet: %s\n", strerror(errno) );
-	//free packet memory
-	free(packet);
+/*
+ * the retransmission timer expired: resend the run permission to every client
+ * that has not reported the current period yet (a lost run permission lets the
+ * client start, a client whose finished packet was lost resends it) and back off
+ */
+void srv_retransmit() {
+
+	if (!srv_started || srv_outstanding==0 || srv_now() < srv_deadline)
+		return;
+
+	srv_formatRunPermission();
+
+	int resent=0;
+	for (int slot=0; slot<srv_clients.size(); slot++) {
+		//nothing gets lost in shared memory
+		if (srv_clients.period(slot)>=srv_currentPeriod || srv_clients.shmSlot(slot)>=0)
+			continue;
+		srv_clients.stats(slot).retransmits++;
+		srv_fanoutMsgs[resent++].msg_hdr.msg_name=&srv_clients.address(slot);
+	}
+	srv_sendFanout(resent);
+	srv_retransmissions+=resent;
+
+	printf("Period %i: no report after %u us, run permission resent to %i client(s)\n",
+			srv_currentPeriod, srv_rto, resent);
+
+	srv_periodResent=true;
+	srv_rto=(2*(u_int64_t) srv_rto > srv_maxRto) ? srv_maxRto : 2*srv_rto;
+	srv_armTimer(srv_rto);
+}
+
+/*
+ * waits for the retransmission timer
+ */
+void* srv_timerLoop(void* arg) {
+
+	while (true) {
+		u_int64_t expirations;
+		int r = read(srv_timerfd, &expirations, sizeof(expirations));
+
+		pthread_mutex_lock(&srv_mutex);
+		if (srv_stopped) {
+			pthread_mutex_unlock(&srv_mutex);
+			break;
+		}
+		if (r == (int) sizeof(expirations))
+			srv_retransmit();
+		pthread_mutex_unlock(&srv_mutex);
+	}
+	return NULL;
+}
+
+/*
+ * prints the loss statistics of one client
+ */
+void srv_printLossStats(int slot) {
+
+	STATS_Client& st=srv_clients.stats(slot);
+	printf("Client %i: %u run permission(s) resent, %u late and %u duplicate report(s)\n",
+			srv_clients.id(slot), st.retransmits, st.late, st.duplicates);
+}
+
+/*
+ * accounts a report that arrived in time
+ */
+void srv_recordReport(int slot, u_int32_t runTime, u_int32_t realTime) {
+
+	STATS_Client& st=srv_clients.stats(slot);
+	u_int64_t latency=(srv_periodSentId==srv_currentPeriod) ? srv_now()-srv_periodSentAt : 0;
+
+	st.reports++;
+	st.latencySum+=latency;
+	if (latency > st.latencyMax)
+		st.latencyMax=(latency > UINT_MAX) ? UINT_MAX : latency;
+	st.latencyHist[stats_bucket(latency)]++;
+
+	st.realTimeSum+=realTime;
+	st.runTimeSum+=runTime;
+	if (runTime > 0)
+		st.ratioHist[stats_bucket((u_int64_t) realTime*100/runTime)]++;
+}
+
+/*
+ * writes a snapshot of the statistics to the trace file every srv_statsInterval
+ * milliseconds and a last one when the server stops. The snapshot is copied
+ * under srv_mutex and written without holding it.
+ */
+void* srv_statsLoop(void* arg) {
+
+	FILE* file=(FILE*) arg;
+	std::vector<uint8_t> buffer;
+
+	pthread_mutex_lock(&srv_mutex);
+	bool last=false;
+	while (!last) {
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += srv_statsInterval/1000;
+		until.tv_nsec += (srv_statsInterval%1000)*1000000;
+		if (until.tv_nsec >= 1000000000) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000;
+		}
+		while (!srv_stopped && pthread_cond_timedwait(&srv_statsCond, &srv_mutex, &until) != ETIMEDOUT)
+			;
+		last=srv_stopped;
+
+		int clients=srv_clients.size();
+		buffer.resize(sizeof(STATS_Snapshot) + clients*sizeof(STATS_Client));
+		STATS_Snapshot* snapshot=(STATS_Snapshot*) &buffer[0];
+		snapshot->wallTime=srv_started ? srv_now()-srv_startedAt : 0;
+		snapshot->virtualTime=srv_virtualTime;
+		snapshot->retransmissions=srv_retransmissions;
+		snapshot->periodId=srv_currentPeriod;
+		snapshot->clients=clients;
+		STATS_Client* records=(STATS_Client*) (snapshot+1);
+		for (int slot=0; slot<clients; slot++) {
+			records[slot]=srv_clients.stats(slot);
+			records[slot].clientType=srv_clients.type(slot);
+			records[slot].shm=(srv_clients.shmSlot(slot) >= 0);
+		}
+		pthread_mutex_unlock(&srv_mutex);
+
+		if (fwrite(&buffer[0], buffer.size(), 1, file) != 1 || fflush(file) != 0)
+			printf("Error writing statistics: %s\n", strerror(errno));
+
+		pthread_mutex_lock(&srv_mutex);
+	}
+	pthread_mutex_unlock(&srv_mutex);
+	return NULL;
+}
+
+/*
+ * opens the trace file (if srv_stats_file is configured)
+ */
+FILE* srv_openStatsFile() {
+
+	srv_statsFile = cf.getAsString("SERVER", "srv_stats_file");
+	srv_statsInterval = cf.getAsInt("SERVER", "srv_stats_interval", 1000);
+	if (srv_statsInterval < 1) srv_statsInterval = 1;
+	if (srv_statsFile=="")
+		return NULL;
+
+	FILE* file=fopen(srv_statsFile.c_str(), "wb");
+	if (file==NULL) {
+		fprintf(stderr, "Could not open %s: %s\n", srv_statsFile.c_str(), strerror(errno));
+		return NULL;
+	}
+	STATS_FileHeader header;
+	header.magic=STATS_MAGIC;
+	header.version=STATS_VERSION;
+	header.buckets=STATS_BUCKETS;
+	header.clientSize=sizeof(STATS_Client);
+	fwrite(&header, sizeof(header), 1, file);
+
+	printf("Writing statistics to %s every %i ms\n", srv_statsFile.c_str(), srv_statsInterval);
+	return file;
+}
+
+/*
+ * Adapts the runTime of the next period to the realTime the slowest client
+ * needed for the period that just finished (multiplicative increase and decrease):
+ * - the runTime grows while the slowest client needs no more than
+ *   srv_adaptFastRatio times the runTime
+ * - it shrinks if the ratio spikes above srv_adaptSpikeRatio times its average
+ * Periods in which no client reported a realTime leave the runTime unchanged.
+ */
+void srv_adaptRunTime() {
+
+	u_int32_t lastRunTime=ntohl(srv_runpermission.runTime);
+	if (srv_periodMaxRealTime==0 || lastRunTime==0)
+		return;
+
+	double ratio=(double) srv_periodMaxRealTime / lastRunTime;
+	double next=srv_barrierunTime;
+
+	if (srv_avgRatio > 0 && ratio > srv_adaptSpikeRatio*srv_avgRatio && ratio > srv_adaptFastRatio)
+		next*=srv_adaptShrink;
+	else if (ratio <= srv_adaptFastRatio)
+		next*=srv_adaptGrow;
+
+	//exponentially weighted, like the RTT estimation of TCP
+	srv_avgRatio = (srv_avgRatio > 0) ? 0.875*srv_avgRatio + 0.125*ratio : ratio;
+
+	if (next < srv_minInterval) next=srv_minInterval;
+	if (next > srv_maxInterval) next=srv_maxInterval;
+	srv_barrierunTime=(u_int32_t) next;
+}
+
+/*
+ * All registered clients reported the current period: step to the next one.
+ * Every registered client is outstanding again until it reports the new period.
+ */
+void srv_advancePeriod() {
+
+	if (srv_adaptive)
+		srv_adaptRunTime();
+
+	//if every client announced its next event, nothing can happen before the horizon
+	u_int32_t runTime=srv_barrierunTime;
+	if (srv_lookahead && srv_periodHorizon > runTime)
+		runTime = (srv_periodHorizon < srv_maxGrant) ? srv_periodHorizon : srv_maxGrant;
+
+	srv_currentPeriod++;
+	srv_outstanding=srv_clients.size();
+	srv_periodMaxRealTime=0;
+	srv_periodHorizon=NEXTEVENT_NONE;
+
+	srv_runpermission.periodId=htonl(srv_currentPeriod);
+	srv_runpermission.runTime=htonl(runTime);
+	srv_sendRunPermission();
+}
+
+/*------------------------------------------------------------------------------------------
+ * relay behaviour
+ *------------------------------------------------------------------------------------------
+ */
+
+/*
+ * sends a version 2 datagram to the parent synchronizer
+ */
+void relay_sendPacket(uint8_t* buffer) {
+
+	int bytes_sent = sendto(relay_sock, buffer, sw_size(buffer), 0,
+			(struct sockaddr*) &relay_upstream, sizeof(struct sockaddr_in));
+	if(bytes_sent < 0) printf("Error sending packet to parent: %s\n", strerror(errno) );
+}
+
+/*
+ * the local subtree is ready: register at the parent or, if the relay is
+ * already running, get the new clients started
+ */
+void relay_clientsReady() {
 
+	if (relay_registered) {
+		if (srv_started)
+			srv_sendRunPermission();
+		return;
+	}
+
+	char description[CLIENT_DESCR_LENGTH];
+	int descriptionLength=snprintf(description, CLIENT_DESCR_LENGTH, "relay (%i clients)", srv_clients.size());
+	if (descriptionLength > CLIENT_DESCR_LENGTH-1)
+		descriptionLength=CLIENT_DESCR_LENGTH-1;
+
+	uint8_t buffer[SW_MAX_DATAGRAM];
+	sw_begin(buffer, ++seqNr);
+	SW_Register* reg=(SW_Register*) sw_add(buffer, SW_MSG_REGISTER, sizeof(SW_Register)+descriptionLength);
+	reg->clientId=htons(relay_clientId);
+	reg->clientType=CLIENT_TYPE_RELAY;
+	memcpy(reg->description, description, descriptionLength);
+
+	printf("Registering at parent synchronizer as client %i\n", relay_clientId);
+	relay_sendPacket(buffer);
+	relay_registered=true;
+}
+
+/*
+ * the whole subtree finished the current period: report it as one client.
+ * The slowest client of the subtree determines the reported realTime, the
+ * earliest announced event of the subtree is passed on as its next event.
+ */
+void relay_reportFinished() {
+
+	uint8_t buffer[SW_MAX_DATAGRAM];
+	sw_begin(buffer, ++seqNr);
+	SW_Finished* fin=(SW_Finished*) sw_add(buffer, SW_MSG_FINISHED, sizeof(SW_Finished));
+	fin->periodId=htonl(srv_currentPeriod);
+	fin->runTime=srv_runpermission.runTime;
+	fin->realTime=htonl(srv_periodMaxRealTime);
+	fin->clientId=htons(relay_clientId);
+	SW_NextEvent* next=(SW_NextEvent*) sw_add(buffer, SW_MSG_NEXTEVENT, sizeof(SW_NextEvent));
+	next->nextEvent=htonl(srv_periodHorizon);
+	relay_sendPacket(buffer);
+}
+
+/*
+ * a run permission for a new period arrived from the parent: pass it on to the subtree
+ */
+void relay_startPeriod(COM_RunPermission* rp) {
+
+	//the subtree uses the period ids of the parent
+	srv_currentPeriod=ntohl(rp->periodId);
+	srv_outstanding=srv_clients.size();
+	srv_periodMaxRealTime=0;
+	srv_periodHorizon=NEXTEVENT_NONE;
+
+	srv_runpermission=*rp;
+	srv_sendRunPermission();
+
+	//nobody to wait for
+	if (srv_outstanding==0)
+		relay_reportFinished();
+}
+
+/*
+ * receives the run permissions of the parent synchronizer
+ */
+void* relay_upstreamLoop(void* arg) {
+
+	uint8_t buffer[SRV_RECV_BUFSIZE];
+	struct sockaddr_in from;
+	socklen_t fromlen;
+
+	while (true) {
+		fromlen=sizeof(from);
+		int bytes_received = recvfrom(relay_sock, buffer, sizeof(buffer), 0, (struct sockaddr*) &from, &fromlen);
+
+		//on a shared segment the own run permissions of the relay arrive here as well
+		if (bytes_received > 0 && from.sin_port==htons(server_port) && srv_isLocalAddress(from.sin_addr))
+			continue;
+
+		pthread_mutex_lock(&srv_mutex);
+		if (srv_stopped) {
+			pthread_mutex_unlock(&srv_mutex);
+			break;
+		}
+
+		//the parent sends version 1 run permissions while it has version 1 clients
+		COM_RunPermission rp;
+		bool received=false;
+		COM_SyncPacket* packet=(COM_SyncPacket*) buffer;
+		if (bytes_received > 0 && sw_valid(buffer, bytes_received)) {
+			for (const SW_Tlv* tlv=sw_next(buffer, NULL); tlv!=NULL; tlv=sw_next(buffer, tlv)) {
+				if (tlv->type==SW_MSG_RUNPERMISSION && sw_length(tlv)>=sizeof(SW_RunPermission)) {
+					const SW_RunPermission* srp=(const SW_RunPermission*) sw_value(tlv);
+					rp.periodId=srp->periodId;
+					rp.runTime=srp->runTime;
+					received=true;
+				}
+			}
+		} else if (bytes_received >= (int) (sizeof(COM_SyncPacket)+sizeof(COM_RunPermission))
+				&& packet->packetType==PACKETTYPE_RUNPERMISSION) {
+			memcpy(&rp, &packet->data, sizeof(rp));
+			received=true;
+		}
+
+		if (received) {
+			//run permissions are resent, only a new period counts. If the
+			//current one is resent although the subtree reported, the report got lost
+			int period=ntohl(rp.periodId);
+			if (!srv_started || period > srv_currentPeriod)
+				relay_startPeriod(&rp);
+			else if (period==srv_currentPeriod && srv_outstanding==0)
+				relay_reportFinished();
+		}
+		pthread_mutex_unlock(&srv_mutex);
+	}
+
+	return NULL;
+}
+
+/*
+ * sets up the socket towards the parent synchronizer
+ */
+int relay_init() {
+
+	relay_clientId = cf.getAsInt("RELAY", "relay_client_id");
+	std::string upstreamServer = cf.getAsString("RELAY", "relay_upstream_server");
+	int upstreamPort = cf.getAsInt("RELAY", "relay_upstream_port", server_port);
+	int listenPort = cf.getAsInt("RELAY", "relay_upstream_listen_port");
+
+	//the clients of the relay receive its own run permissions on client_port
+	if (listenPort==0 || listenPort==client_port) {
+		fprintf(stderr, "relay_upstream_listen_port has to be set and differ from client_port (%i)\n", client_port);
+		return -1;
+	}
+
+	relay_upstream.sin_family = AF_INET;
+	relay_upstream.sin_addr.s_addr = inet_addr(upstreamServer.c_str());
+	relay_upstream.sin_port = htons(upstreamPort);
+
+	relay_sock = socket(PF_INET,SOCK_DGRAM,IPPROTO_IP);
+	if (relay_sock < 0) {
+		fprintf(stderr, "socket(): %s\n",strerror(errno));
+		return -1;
+	}
+
+	//the parent broadcasts its run permissions, other relays may listen on the same host
+	int val_on=1;
+	setsockopt(relay_sock, SOL_SOCKET, SO_REUSEADDR, &val_on, sizeof(val_on));
+
+	struct sockaddr_in sa;
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = INADDR_ANY;
+	sa.sin_port = htons(listenPort);
+
+	printf("Relay: parent synchronizer %s:%i, listening for run permissions on port %i\n",
+			upstreamServer.c_str(), upstreamPort, listenPort);
+
+	if (bind(relay_sock, (struct sockaddr *)&sa, sizeof(struct sockaddr)) < 0) {
+		fprintf(stderr, "binding failed: bind(): %s\n",strerror(errno));
+		return -1;
+	}
+
+	//a parent with srv_fanout = multicast sends to a group
+	std::string group = cf.getAsString("RELAY", "relay_upstream_group");
+	if (group!="") {
+		struct ip_mreq mreq;
+		mreq.imr_multiaddr.s_addr = inet_addr(group.c_str());
+		mreq.imr_interface.s_addr = INADDR_ANY;
+		if (setsockopt(relay_sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0) {
+			fprintf(stderr, "joining multicast group %s failed: %s\n", group.c_str(), strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
 }
 
-void handle_pkt_register(COM_RegisterClient* reg) {
+/*
+ * the barrier of the current period is complete
+ */
+void srv_barrierComplete() {
+
+	srv_sampleRtt();
+	srv_virtualTime+=ntohl(srv_runpermission.runTime);
+
+	if (mode=="relay")
+		relay_reportFinished();
+	else
+		srv_advancePeriod();
+}
+
+/**
+ * This function handles registration packets delivered to a server
+ *
+ * If a client registers, first a couple of checks are performed in order to prevent
+ * double registration or registration at a synchronizer that is in fact running in client mode
+ *
+ * Afterwards, the data is simply stored in adequate data structures.
+ */
+void handle_pkt_register(COM_RegisterClient* reg, struct sockaddr_in* from, bool wantsShm, int version) {
 
 	//safety check: return at once if we're not a server!
-	printf("Register received: id: %i, type: %i, description: %s\n",
-	ntohs(reg->clientID), reg->clientType, reg->client_Description);
+	printf("Register received: id: %i, type: %i, version: %i, description: %s\n",
+	ntohs(reg->clientID), reg->clientType, version, reg->client_Description);
 
-	if (mode!="server")
+	if (mode!="server" && mode!="relay")
 		return;
 	int clientId=ntohs(reg->clientID);
 
-	if (srv_clientRegistered[clientId]==true) {
+	if (srv_clients.find(clientId) >= 0) {
 		printf("This Client ID has already been registered. Ignoring\n");
+		srv_clients.address(srv_clients.find(clientId))=*from;
+		//the grant may have been lost
+		if (wantsShm)
+			srv_shmGrant(srv_clients.find(clientId), from);
 	} else {
 
-		if (clientId>MAX_CLIENTS-1) {
-			printf("clientID %i exceeds MAX_ID. Ignoring. \n", clientId);
+		int slot=srv_clients.add(clientId);
+		if (slot < 0) {
+			printf("Client table is full (%i clients). Ignoring. \n", srv_clients.capacity());
 			return;
 		}
 
-		srv_clientRegistered[clientId]=true;
-		srv_clientType[clientId]=ntohs(reg->clientType);
-		srv_ClientDescription[clientId]=std::string(reg->client_Description);
-		//new Clients start at current Period, of course!
-		srv_period[clientId]=srv_currentPeriod;
-		srv_recClientCounter++;
+		srv_clients.type(slot)=reg->clientType;
+		srv_clients.version(slot)=version;
+		srv_clients.stats(slot).version=version;
+		if (version < SW_VERSION)
+			srv_legacyClients++;
+		srv_clients.address(slot)=*from;
+		srv_clients.description(slot)=std::string(reg->client_Description, strnlen(reg->client_Description, CLIENT_DESCR_LENGTH));
+		//new clients join the barrier of the current period, they are
+		//outstanding until they report it as finished
+		srv_clients.period(slot)=srv_currentPeriod-1;
+		srv_outstanding++;
+		if (wantsShm)
+			srv_shmGrant(slot, from);
 		printf("Client registered.\nTotal Number of registered clients: %i\n",
-				srv_recClientCounter);
+				srv_clients.size());
 
 
 		//invoke sending of a run permission in order to have new clients get started...
     // but only after the minimum number of clients is registered
-		if (srv_recClientCounter >= srv_min_clients)
-      srv_sendRunPermission();
+		if (srv_clients.size() >= srv_min_clients) {
+			if (mode=="relay")
+				relay_clientsReady();
+			else
+				srv_sendRunPermission();
+		}
 
 	}
 
@@ -127,51 +966,53 @@ void handle_pkt_unregisterClient(COM_UnregisterClient* ureg) {
 	 * safety checks
 	 *
 	 */
-	if (mode!="server")
+	if (mode!="server" && mode!="relay")
 		return;
 
 	int clientId=ntohs(ureg->clientID);
 
-	if (clientId>MAX_CLIENTS-1)
-		return;
-
-	if (srv_clientRegistered[clientId]==false)
+	int slot=srv_clients.find(clientId);
+	if (slot < 0)
 		return;
 
 	/*
 	 * main unregister
 	 */
 
-	srv_clientRegistered[clientId]=false;
-	srv_clientType[clientId]=99;
-	srv_ClientDescription[clientId]="";
-	srv_recClientCounter--;
-	printf("Client unregistered: id=%i\n", srv_recClientCounter);
+	bool reported=(srv_clients.period(slot)==srv_currentPeriod);
+	srv_printLossStats(slot);
+	srv_shmRelease(slot);
+	if (srv_clients.version(slot) < SW_VERSION)
+		srv_legacyClients--;
+	srv_clients.remove(clientId);
+	printf("Client unregistered: id=%i\n", clientId);
 	printf("Reason: %i\n", ureg->reason);
-	printf("Total Number of registered clients: %i\n", srv_recClientCounter);
+	printf("Total Number of registered clients: %i\n", srv_clients.size());
+
+	//the barrier must not wait for a client that left before reporting
+	//(a relay has to report even if its subtree is empty now)
+	if (!reported) {
+		srv_outstanding--;
+		if (srv_started && srv_outstanding==0 && (srv_clients.size()>0 || mode=="relay"))
+			srv_barrierComplete();
+	}
 
 }
 
-/* this sends the current runpermission
- *   invoked either if all clients finished their curred barrier
- *   or through a pthread for periodic retransmission
- */
-
 /*
  * If a finish paket is received, first check if the client has already notified the
  * server of this
  */
 
-void handle_pkt_finished(COM_Finished* fin) {
+void handle_pkt_finished(COM_Finished* fin, COM_NextEvent* next, const SW_ClientStats* clientStats,
+		const SW_GuestTime* guestTime, struct sockaddr_in* from) {
 
 	int clientId=ntohs(fin->clientId);
 	int clientPeriodId=ntohl(fin->periodId);
-	int runtime=ntohl(fin->runTime);
-	int realtime=ntohl(fin->realTime);
+	u_int32_t runtime=ntohl(fin->runTime);
+	u_int32_t realtime=ntohl(fin->realTime);
 //	printf("Received Finished MSG: client=%i,periodId=%u,runTime=%u,realTime=%u (hex: %X)\n",
 //			clientId, clientPeriodId, runtime, realtime,realtime);
-	//printf("Received Finished MSG: client=%i,periodId=%u,runTime=%u,realTime=%u\n",
-	//		clientId, clientPeriodId, runtime, realtime);
 
 	/*
 	 * check for valid data, otherwise return.
@@ -182,156 +1023,493 @@ void handle_pkt_finished(COM_Finished* fin) {
 		return;
 	}
 
-	if (clientId>MAX_CLIENTS-1) {
-		printf("Invalid clientID. Returning.\n");
+	int slot=srv_clients.find(clientId);
+	if (slot < 0) {
+		printf("This clientID is not registered! Returning.\n");
 		return;
 	}
 
-	if (srv_clientRegistered[clientId]==false) {
-		printf("This clientID is not registered! Returning.\n");
+	srv_clients.address(slot)=*from;
+	if (clientStats!=NULL)
+		srv_clients.stats(slot).clientResent=ntohl(clientStats->resent);
+
+	if (clientPeriodId<srv_clients.period(slot)) {
+		printf("Late / finished period (higher period is has been previously reported) Returning.\n");
+		srv_clients.stats(slot).late++;
 		return;
 	}
 
-	if (clientPeriodId<srv_period[clientId]) {
-		printf("Late / finished period (higher period is has been previously reported) Returning.\n");
+	//duplicates and reports of periods that are already over
+	//do not change the state of the barrier
+	if (clientPeriodId==srv_clients.period(slot)) {
+		srv_clients.stats(slot).duplicates++;
+		return;
+	}
+	if (clientPeriodId!=srv_currentPeriod) {
+		srv_clients.stats(slot).late++;
 		return;
 	}
 
 	/*
 	 * Main behaviour:
-	 * 2) store the actual periodId in buffer
-	 * 3) check if all registered clients received the current barrier
-	 * 4) if so, send next announcement.
+	 * 1) store the actual periodId in buffer
+	 * 2) one client less to wait for
+	 * 3) if that was the last one, send next announcement.
 	 */
+	srv_clients.period(slot)=clientPeriodId;
+	srv_outstanding--;
+	srv_recordReport(slot, runtime, realtime);
+	if (clientStats!=NULL)
+		srv_clients.stats(slot).waitTimeSum+=ntohl(clientStats->waitTime);
+	if (guestTime!=NULL) {
+		STATS_Client& st=srv_clients.stats(slot);
+		st.guestReports++;
+		st.guestCpuMaxSum+=sw_ntoh64(guestTime->cpuTimeMax);
+		st.guestCpuSpreadSum+=sw_ntoh64(guestTime->cpuTimeSpread);
+		st.guests=ntohl(guestTime->guests);
+	}
+	if (realtime>srv_periodMaxRealTime)
+		srv_periodMaxRealTime=realtime;
+
+	//clients that do not announce their next event may do something at any time
+	u_int32_t horizon=0;
+	if (next!=NULL) {
+		u_int64_t h=(u_int64_t) ntohl(next->nextEvent) + ntohl(next->lookahead);
+		horizon=(h > NEXTEVENT_NONE) ? NEXTEVENT_NONE : (u_int32_t) h;
+	}
+	if (horizon<srv_periodHorizon)
+		srv_periodHorizon=horizon;
+
+	if (srv_outstanding==0) {
+		srv_clients.stats(slot).lastToReport++;
+		srv_barrierComplete();
+	}
+
+}
+
+/*
+ * Handles the messages of a version 2 datagram. They are converted to the
+ * version 1 structs, so that both versions share the packet handlers.
+ * A Finished is handled after the NextEvent, ClientStats and GuestTime of the same datagram.
+ */
+void srv_handleWirePacket(uint8_t* buffer, struct sockaddr_in* from) {
+
+	COM_Finished fin;
+	COM_NextEvent next;
+	SW_ClientStats clientStats;
+	SW_GuestTime guestTime;
+	bool hasFinished=false, hasNext=false, hasStats=false, hasGuestTime=false;
+
+	for (const SW_Tlv* tlv=sw_next(buffer, NULL); tlv!=NULL; tlv=sw_next(buffer, tlv)) {
+
+		const void* value=sw_value(tlv);
+		size_t length=sw_length(tlv);
+
+		if (tlv->type==SW_MSG_REGISTER && length>=sizeof(SW_Register)) {
+
+			const SW_Register* sreg=(const SW_Register*) value;
+			COM_RegisterClient reg;
+			memset(&reg, 0, sizeof(reg));
+			reg.clientID=sreg->clientId;
+			reg.clientType=sreg->clientType;
+			size_t descriptionLength=length-sizeof(SW_Register);
+			if (descriptionLength > CLIENT_DESCR_LENGTH-1)
+				descriptionLength=CLIENT_DESCR_LENGTH-1;
+			memcpy(reg.client_Description, sreg->description, descriptionLength);
+			handle_pkt_register(&reg, from, sreg->flags & SW_REGISTER_SHM, SW_VERSION);
+
+		} else if (tlv->type==SW_MSG_UNREGISTER && length>=sizeof(SW_Unregister)) {
+
+			const SW_Unregister* sureg=(const SW_Unregister*) value;
+			COM_UnregisterClient ureg;
+			ureg.clientID=sureg->clientId;
+			ureg.reason=sureg->reason;
+			handle_pkt_unregisterClient(&ureg);
 
-	//step 1
-	srv_period[clientId]=clientPeriodId;
-	//step 2
-	bool finished=true;
-	for (int i=0; i<MAX_CLIENTS; i++) {
-		if (srv_clientRegistered[i]==true) {
-			finished=finished&&(srv_period[i]==srv_currentPeriod);
-			if (finished==false)
-				break;
+		} else if (tlv->type==SW_MSG_FINISHED && length>=sizeof(SW_Finished)) {
+
+			const SW_Finished* sfin=(const SW_Finished*) value;
+			fin.periodId=sfin->periodId;
+			fin.runTime=sfin->runTime;
+			fin.realTime=sfin->realTime;
+			fin.clientId=sfin->clientId;
+			hasFinished=true;
+
+		} else if (tlv->type==SW_MSG_NEXTEVENT && length>=sizeof(SW_NextEvent)) {
+
+			const SW_NextEvent* snext=(const SW_NextEvent*) value;
+			next.nextEvent=snext->nextEvent;
+			next.lookahead=snext->lookahead;
+			hasNext=true;
+
+		} else if (tlv->type==SW_MSG_CLIENTSTATS && length>=sizeof(SW_ClientStats)) {
+
+			memcpy(&clientStats, value, sizeof(clientStats));
+			hasStats=true;
+
+		} else if (tlv->type==SW_MSG_GUESTTIME && length>=sizeof(SW_GuestTime)) {
+
+			memcpy(&guestTime, value, sizeof(guestTime));
+			hasGuestTime=true;
 		}
+		//unknown messages are skipped
 	}
 
-	if (finished==false) {
+	if (hasFinished)
+		handle_pkt_finished(&fin, hasNext ? &next : NULL, hasStats ? &clientStats : NULL,
+				hasGuestTime ? &guestTime : NULL, from);
+}
+
+/*
+ * Dispatches one received datagram to the adequate packet handler.
+ * Must be called with srv_mutex held.
+ */
+void srv_handlePacket(uint8_t* buffer, int length, struct sockaddr_in* from) {
 
-		//printf("Not all clients have reported to be finished yet");
+	if (length > 0 && sw_valid(buffer, length)) {
+		srv_handleWirePacket(buffer, from);
 		return;
+	}
 
-	} else {
-		//printf("All clients have finished the current period\n");
-		//printf("Stepping further.");
+	if (length < (int) sizeof(COM_SyncPacket)) {
+		printf("\n\n Truncated packet received \n\n");
+		return;
+	}
 
-		//increase current period;
-		srv_currentPeriod++;
-		//printf("Next PeriodId: %i, Runtime=%i\n", srv_currentPeriod,
-		//		srv_barrierunTime);
+	COM_SyncPacket* packet=(COM_SyncPacket*) buffer;
+	int payload=length-sizeof(COM_SyncPacket);
 
-		//increase runpermission struct for transmission
+	//Packet handling
+	//Determine Packet Type
+	//Call adequate packet handler by creating pointer to packet payload
+	//Note: We simply deal with packets sent to a server.
+	//Everything else is simply disregarded
 
-		srv_runpermission.periodId=htonl(srv_currentPeriod);
-		srv_runpermission.runTime=htonl(srv_barrierunTime);
-		srv_sendRunPermission();
+	if (packet->packetType==PACKETTYPE_REGISTER && payload>=(int) sizeof(COM_RegisterClient)) {
 
-	}
+		printf("\n\n handling register packet now \n\n");
+		bool wantsShm=false;
+		if (payload>=(int) (sizeof(COM_RegisterClient)+sizeof(COM_ShmRequest))) {
+			COM_ShmRequest* req=(COM_ShmRequest*) (packet->data + sizeof(COM_RegisterClient));
+			wantsShm=(ntohl(req->magic)==SHM_MAGIC);
+		}
+		handle_pkt_register((COM_RegisterClient*) &packet->data, from, wantsShm, 1);
+
+	} else if (packet->packetType==PACKETTYPE_UNREGISTER && payload>=(int) sizeof(COM_UnregisterClient)) {
+
+		printf("\n\n handling UNregister packet now \n\n");
+		handle_pkt_unregisterClient((COM_UnregisterClient*) &packet->data);
 
-	return;
+	} else if (packet->packetType==PACKETTYPE_FINISHED && payload>=(int) sizeof(COM_Finished)) {
 
+		COM_NextEvent* next=NULL;
+		if (payload>=(int) (sizeof(COM_Finished)+sizeof(COM_NextEvent)))
+			next=(COM_NextEvent*) (packet->data + sizeof(COM_Finished));
+		handle_pkt_finished((COM_Finished*) &packet->data, next, NULL, NULL, from);
+
+	}
+	else{
+
+		printf("\n\n Unknown packet received \n\n");
+	}
 }
 
-int mainServer() {
-	/*
-	 *  initialize data structures
-	 */
+/*
+ * stops the server once max_period is reached: wakes up all threads, blocking
+ * recvmmsg() calls return on shutdown. Must be called with srv_mutex held.
+ */
+void srv_checkMaxPeriod() {
 
-	srv_recClientCounter=0;
-	for (int k=0; k<MAX_CLIENTS; k++) {
+	if (srv_stopped || srv_maxPeriod <= 0 || srv_currentPeriod < srv_maxPeriod)
+		return;
 
-		srv_clientRegistered[k]=0;
-		srv_clientType[k]=CLIENT_TYPE_UNKNOWN;
-		srv_period[k]=0;
-		srv_ClientDescription[k]="";
+	srv_stopped = true;
+	for (int i=0; i<srv_workerThreads; i++)
+		shutdown(srv_sockets[i], SHUT_RD);
+	if (relay_sock >= 0)
+		shutdown(relay_sock, SHUT_RD);
+	srv_armTimer(0);
+	pthread_cond_signal(&srv_statsCond);
+	if (srv_shmHeader!=NULL) {
+		__sync_fetch_and_add(&srv_shmHeader->doorbell, 1);
+		futex_wake(&srv_shmHeader->doorbell);
 	}
-	srv_barrierunTime = cf.getAsInt("SERVER", "srv_barrier_interval");
-	srv_brdcast_address = cf.getAsString("SERVER", "srv_brdcast_address");
+}
 
-	srv_maxPeriod = cf.getAsInt("SERVER", "max_period");
+/*
+ * takes the reports of the clients using the shared memory page.
+ * Must be called with srv_mutex held.
+ */
+void srv_shmCollect() {
+
+	for (int s=0; s<(int) srv_shmHeader->slots; s++) {
+		if (srv_shmOwner[s] < 0)
+			continue;
+		COM_ShmSlot* shmSlot=&srv_shmSlots[s];
+		int finished=*(volatile u_int32_t*) &shmSlot->finishedPeriod;
+		if (finished!=srv_currentPeriod)
+			continue;
+		int slot=srv_clients.find(srv_shmOwner[s]);
+		if (slot < 0 || srv_clients.period(slot)==srv_currentPeriod)
+			continue;
+		//the slot is complete once finishedPeriod is written
+		__sync_synchronize();
+
+		//hand it to the same code as the UDP reports
+		COM_Finished fin;
+		fin.periodId=htonl(finished);
+		fin.runTime=htonl(shmSlot->runTime);
+		fin.realTime=htonl(shmSlot->realTime);
+		fin.clientId=htons(srv_shmOwner[s]);
+		COM_NextEvent next;
+		next.nextEvent=htonl(shmSlot->nextEvent);
+		next.lookahead=htonl(shmSlot->lookahead);
+		handle_pkt_finished(&fin, (shmSlot->flags & SHM_FINISHED_NEXTEVENT) ? &next : NULL, NULL, NULL, &srv_clients.address(slot));
+	}
+}
 
-	srv_runpermission.periodId=htonl(srv_currentPeriod);
-	srv_runpermission.runTime=htonl(srv_barrierunTime);
+/*
+ * waits for the clients ringing the doorbell of the shared memory page
+ */
+void* srv_shmLoop(void* arg) {
 
-	//std::string srv_bind_ip = cf.getAsString("SERVER","srv_bind_ip");
-	//printf("Binding Server to this ip: %s\n",srv_bind_ip.c_str());
+	while (true) {
+		u_int32_t seen=*(volatile u_int32_t*) &srv_shmHeader->doorbell;
 
-	//bind stuff
-	struct sockaddr_in sa;
-	sock = socket(PF_INET,SOCK_DGRAM,IPPROTO_IP);
+		pthread_mutex_lock(&srv_mutex);
+		if (srv_stopped) {
+			pthread_mutex_unlock(&srv_mutex);
+			break;
+		}
+		srv_shmCollect();
+		srv_checkMaxPeriod();
+		pthread_mutex_unlock(&srv_mutex);
+
+		futex_wait(&srv_shmHeader->doorbell, seen);
+	}
+	return NULL;
+}
 
-	printf("Binding socket to port: %i\n", server_port);
+/*
+ * creates a socket bound to the server port. If more than one worker is used,
+ * SO_REUSEPORT lets the kernel spread the clients over the workers' sockets.
+ */
+int srv_createSocket() {
 
+	int s = socket(PF_INET,SOCK_DGRAM,IPPROTO_IP);
+	if (s < 0) {
+		fprintf(stderr, "socket(): %s\n",strerror(errno));
+		return -1;
+	}
+
+	struct sockaddr_in sa;
 	sa.sin_family = AF_INET;
 	sa.sin_addr.s_addr = INADDR_ANY;
 	sa.sin_port = htons(server_port);
 
 	//enable broadcasting on socket
 	int val_on=1;
-	int sock_brdcast=setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &val_on, sizeof(val_on));
-	if (sock_brdcast==0) {
-		printf("Successfully enabled Broadcasting over socket\n");
-	} else {
+	int sock_brdcast=setsockopt(s, SOL_SOCKET, SO_BROADCAST, &val_on, sizeof(val_on));
+	if (sock_brdcast!=0)
 		printf("Datagramm Broadcasting could not be enabled! Error code: %i\n",sock_brdcast);
-	}
 
-	int bound = bind(sock, (struct sockaddr *)&sa, sizeof(struct sockaddr));
+	if (srv_workerThreads > 1 && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &val_on, sizeof(val_on)) != 0)
+		printf("SO_REUSEPORT could not be enabled: %s\n", strerror(errno));
+
+	int bound = bind(s, (struct sockaddr *)&sa, sizeof(struct sockaddr));
 	if (bound < 0)
 		fprintf(stderr, "binding failed: bind(): %s\n",strerror(errno));
 
-	uint8_t buffer[32000];
+	return s;
+}
 
-	//initialize pthread for periodic retransmission!
+/*
+ * receive loop of one worker: fetch up to srv_recvBatch datagrams with a single
+ * recvmmsg() call and process the whole batch under one lock acquisition
+ */
+void* srv_workerLoop(void* arg) {
+
+	int wsock = *(int*) arg;
+
+	uint8_t* buffers = (uint8_t*) malloc(srv_recvBatch * SRV_RECV_BUFSIZE);
+	struct mmsghdr* msgs = (struct mmsghdr*) calloc(srv_recvBatch, sizeof(struct mmsghdr));
+	struct iovec* iovecs = (struct iovec*) calloc(srv_recvBatch, sizeof(struct iovec));
+	struct sockaddr_in* addrs = (struct sockaddr_in*) calloc(srv_recvBatch, sizeof(struct sockaddr_in));
+	if (buffers == NULL || msgs == NULL || iovecs == NULL || addrs == NULL) {
+		fprintf(stderr, "srv_workerLoop(): out of memory\n");
+		exit(1);
+	}
+
+	for (int i=0; i<srv_recvBatch; i++) {
+		iovecs[i].iov_base = buffers + i*SRV_RECV_BUFSIZE;
+		iovecs[i].iov_len = SRV_RECV_BUFSIZE;
+		msgs[i].msg_hdr.msg_iov = &iovecs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &addrs[i];
+	}
 
 	while (true) {
-		int bytes_received = recv (sock, buffer, 32000, 0);
-		//printf ("Data received, length: %i\n", bytes_received);
-		COM_SyncPacket packet;
-		memcpy(&packet, &buffer, bytes_received);
-		//printf("Packet type: %i\n", packet.packetType);
-		//printf("Packet SeqNr: %i\n", ntohl(packet.seqNr));
+		for (int i=0; i<srv_recvBatch; i++)
+			msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+
+		//block for the first datagram, then take whatever else is already queued
+		int received = recvmmsg(wsock, msgs, srv_recvBatch, MSG_WAITFORONE, NULL);
+
+		pthread_mutex_lock(&srv_mutex);
+		if (srv_stopped) {
+			pthread_mutex_unlock(&srv_mutex);
+			break;
+		}
+		if (received < 0) {
+			pthread_mutex_unlock(&srv_mutex);
+			if (errno != EINTR)
+				printf("Error receiving packets: %s\n", strerror(errno));
+			continue;
+		}
+
+		for (int i=0; i<received; i++)
+			srv_handlePacket((uint8_t*) iovecs[i].iov_base, msgs[i].msg_len, &addrs[i]);
+
+		srv_checkMaxPeriod();
+		pthread_mutex_unlock(&srv_mutex);
+	}
 
-		//Packet handling
-		//Determine Packet Type
-		//Call adequate packet handler by creating pointer to packet payload
-		//Note: We simply deal with packets sent to a server.
-		//Everything else is simply disregarded
+	free(addrs);
+	free(iovecs);
+	free(msgs);
+	free(buffers);
+	return NULL;
+}
 
-		if (packet.packetType==PACKETTYPE_REGISTER) {
+int mainServer() {
+	/*
+	 *  initialize data structures
+	 */
 
-			printf("\n\n handling register packet now \n\n");
-			handle_pkt_register((COM_RegisterClient*) &packet.data);
+	int maxClients = cf.getAsInt("SERVER", "srv_max_clients", MAX_CLIENTS);
+	if (maxClients < 1 || maxClients > MAX_CLIENTS) maxClients = MAX_CLIENTS;
+	srv_clients.init(maxClients);
+	srv_outstanding=0;
+	srv_periodMaxRealTime=0;
+	srv_periodHorizon=NEXTEVENT_NONE;
+	srv_barrierunTime = cf.getAsInt("SERVER", "srv_barrier_interval");
+	srv_brdcast_address = cf.getAsString("SERVER", "srv_brdcast_address");
 
-		} else if (packet.packetType==PACKETTYPE_UNREGISTER) {
+	srv_maxPeriod = cf.getAsInt("SERVER", "max_period");
 
-			printf("\n\n handling UNregister packet now \n\n");
-			handle_pkt_unregisterClient((COM_UnregisterClient*) &packet.data);
+	srv_adaptive = cf.getAsInt("SERVER", "srv_adaptive_interval", 0) != 0;
+	srv_minInterval = cf.getAsInt("SERVER", "srv_min_interval", srv_barrierunTime);
+	srv_maxInterval = cf.getAsInt("SERVER", "srv_max_interval", srv_barrierunTime);
+	if (srv_minInterval < 1) srv_minInterval = 1;
+	if (srv_maxInterval < srv_minInterval) srv_maxInterval = srv_minInterval;
+	srv_adaptGrow = cf.getAsDouble("SERVER", "srv_adapt_grow", 1.25);
+	srv_adaptShrink = cf.getAsDouble("SERVER", "srv_adapt_shrink", 0.5);
+	srv_adaptFastRatio = cf.getAsDouble("SERVER", "srv_adapt_fast_ratio", 1.5);
+	srv_adaptSpikeRatio = cf.getAsDouble("SERVER", "srv_adapt_spike_ratio", 2.0);
+	if (srv_adaptive)
+		printf("Adaptive barrier interval: %u - %u microseconds\n", srv_minInterval, srv_maxInterval);
+
+	srv_lookahead = cf.getAsInt("SERVER", "srv_lookahead", 0) != 0;
+	srv_maxGrant = cf.getAsInt("SERVER", "srv_max_grant", 1000000);
+
+	srv_maxRto = cf.getAsInt("SERVER", "srv_rebroadcast_period", 2000000);
+	srv_minRto = cf.getAsInt("SERVER", "srv_min_rto", 200);
+	if (srv_minRto < 1) srv_minRto = 1;
+	if (srv_maxRto < srv_minRto) srv_maxRto = srv_minRto;
+	srv_rto = srv_maxRto;
+
+	srv_timerfd = timerfd_create(CLOCK_MONOTONIC, 0);
+	if (srv_timerfd < 0) {
+		fprintf(stderr, "timerfd_create(): %s\n",strerror(errno));
+		return 1;
+	}
 
-		} else if (packet.packetType==PACKETTYPE_FINISHED) {
+	srv_workerThreads = cf.getAsInt("SERVER", "srv_worker_threads", 1);
+	if (srv_workerThreads < 1) srv_workerThreads = 1;
+	if (srv_workerThreads > SRV_MAX_WORKERS) srv_workerThreads = SRV_MAX_WORKERS;
+	srv_recvBatch = cf.getAsInt("SERVER", "srv_recv_batch", SRV_DEFAULT_RECV_BATCH);
+	if (srv_recvBatch < 1) srv_recvBatch = 1;
 
-			//printf("\n\n handling finished packet now \n\n");
-			handle_pkt_finished((COM_Finished*) &packet.data);
+	srv_runpermission.periodId=htonl(srv_currentPeriod);
+	srv_runpermission.runTime=htonl(srv_barrierunTime);
 
-		}
-		else{
+	//std::string srv_bind_ip = cf.getAsString("SERVER","srv_bind_ip");
+	//printf("Binding Server to this ip: %s\n",srv_bind_ip.c_str());
 
-			printf("\n\n Unknown packet received \n\n");
-		}
-		if ((srv_maxPeriod > 0) && (srv_currentPeriod >= srv_maxPeriod)) break;
+	printf("Binding %i socket(s) to port: %i\n", srv_workerThreads, server_port);
+
+	for (int i=0; i<srv_workerThreads; i++) {
+		srv_sockets[i] = srv_createSocket();
+		if (srv_sockets[i] < 0)
+			return 1;
+	}
+	//run permissions are always sent through the first socket
+	sock = srv_sockets[0];
+	if (srv_initFanout() < 0)
+		return 1;
+	if (srv_initShm() < 0)
+		return 1;
+
+	pthread_t relayThread;
+	if (mode=="relay") {
+		if (relay_init() < 0)
+			return 1;
+		pthread_create(&relayThread, NULL, relay_upstreamLoop, NULL);
+		//a relay without required clients registers at once
+		if (srv_min_clients <= 0)
+			relay_clientsReady();
+	}
 
+	pthread_t timerThread;
+	pthread_create(&timerThread, NULL, srv_timerLoop, NULL);
+	pthread_t shmThread;
+	if (srv_shmHeader!=NULL)
+		pthread_create(&shmThread, NULL, srv_shmLoop, NULL);
+	pthread_t statsThread;
+	FILE* statsFile=srv_openStatsFile();
+	if (statsFile!=NULL)
+		pthread_create(&statsThread, NULL, srv_statsLoop, statsFile);
+
+	pthread_t workers[SRV_MAX_WORKERS];
+	for (int i=1; i<srv_workerThreads; i++)
+		pthread_create(&workers[i], NULL, srv_workerLoop, &srv_sockets[i]);
+
+	srv_workerLoop(&srv_sockets[0]);
+
+	for (int i=1; i<srv_workerThreads; i++)
+		pthread_join(workers[i], NULL);
+	for (int i=0; i<srv_workerThreads; i++)
+		close(srv_sockets[i]);
+	pthread_join(timerThread, NULL);
+	close(srv_timerfd);
+	if (srv_shmHeader!=NULL) {
+		pthread_join(shmThread, NULL);
+		munmap(srv_shmHeader, srv_shmLen);
+		shm_unlink(srv_shmName.c_str());
+	}
+	if (statsFile!=NULL) {
+		pthread_join(statsThread, NULL);
+		fclose(statsFile);
+	}
+
+	if (mode=="relay") {
+		pthread_join(relayThread, NULL);
+
+		uint8_t buffer[SW_MAX_DATAGRAM];
+		sw_begin(buffer, ++seqNr);
+		SW_Unregister* ureg=(SW_Unregister*) sw_add(buffer, SW_MSG_UNREGISTER, sizeof(SW_Unregister));
+		ureg->clientId=htons(relay_clientId);
+		ureg->reason=UNREGISTER_REASON_REGULAR;
+		relay_sendPacket(buffer);
+		close(relay_sock);
 	}
 
 	printf("Server stopped after period %i\n", srv_currentPeriod);
+	printf("Run permissions resent: %llu (srtt %.0f us, rttvar %.0f us)\n",
+			(unsigned long long) srv_retransmissions, srv_srtt, srv_rttvar);
+	for (int slot=0; slot<srv_clients.size(); slot++)
+		if (srv_clients.stats(slot).retransmits > 0 || srv_clients.stats(slot).late > 0 || srv_clients.stats(slot).duplicates > 0)
+			srv_printLossStats(slot);
 	return 0;
 }
 
@@ -616,6 +1794,9 @@ int main(int argc, char **argv) {
 		} else if (std::string(argv[1])=="client") {
 			printf("Overriding config setting: Running in client mode\n");
 			mode="client";
+		} else if (std::string(argv[1])=="relay") {
+			printf("Overriding config setting: Running in relay mode\n");
+			mode="relay";
 		}
 	}
 	int exit_code=255;
@@ -623,6 +1804,10 @@ int main(int argc, char **argv) {
 		printf("System running in server mode\n");
 		exit_code=mainServer();
 
+	} else if (mode=="relay") {
+		printf("System running in relay mode\n");
+		exit_code=mainServer();
+
 	} else if (mode=="client") {
 
 		printf("System running in client mode\n");
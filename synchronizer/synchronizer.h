@@ -2,6 +2,16 @@
 #define SIMESYNCHRONIZER_H_
 
 #define CONFIGFILE_NAME "config.sync"
-#define MAX_CLIENTS 100
+#define MAX_CLIENTS 65536 //client ids are 16 bit, so this is also the largest possible number of clients
+
+#define SRV_MAX_WORKERS 64 //upper bound for srv_worker_threads
+#define SRV_DEFAULT_RECV_BATCH 32 //default for srv_recv_batch
+#define SRV_RECV_BUFSIZE 2048 //receive buffer per datagram, larger than any sync packet
+
+//fan-out of the run permissions (srv_fanout)
+#define FANOUT_BROADCAST 0 //one packet to srv_brdcast_address
+#define FANOUT_MULTICAST 1 //one packet to the multicast group srv_brdcast_address
+#define FANOUT_UNICAST 2 //one packet to every registered client, sent with sendmmsg()
+#define SRV_SENDMMSG_MAX 1024 //max. number of messages passed to one sendmmsg() call (UIO_MAXIOV)
 
 #endif /*SIMESYNCHRONIZER_H_*/
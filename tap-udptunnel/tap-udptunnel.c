@@ -0,0 +1,796 @@
+/*
+ * tap-udptunnel: connects a tap device to a SyncTunnelBridge of a remote ns-3
+ * simulation
+ *
+ * Every ethernet frame read from the tap device is sent to the simulation as a
+ * TunPacket (see SyncBridgeCom::TunPacket in sync-tunnel-bridge.h) and the
+ * frames of the TunPackets received from the simulation are written to the tap
+ * device:
+ *
+ *   struct TunPacket {
+ *     int32_t flowid;  // the flow id, 16 bits in network byte order
+ *     int32_t len;     // the length of data, 16 bits in network byte order
+ *     char data[];     // the ethernet frame
+ *   };
+ *
+ * Each queue of the tap device (-q, IFF_MULTI_QUEUE) is served by two threads
+ * with a UDP socket of its own, all bound to the local port with SO_REUSEPORT.
+ * The frames are sent and received in batches with sendmmsg()/recvmmsg().
+ *
+ * With -v the tap device prepends a virtio_net_hdr (IFF_VNET_HDR) and may hand
+ * over TCP segments of up to 64 KB (TSO/GSO) and frames with a partial
+ * checksum, which saves the kernel the segmentation and checksumming. The
+ * frames are segmented and checksummed here, right into the send buffers, since
+ * the simulation expects ordinary ethernet frames.
+ *
+ * With -c the frames are coalesced into bundles of up to 64 KB once the
+ * simulation has accepted to do so: a bundle is a TunPacket header with the
+ * flow id 0xffff and the number of TunPackets as length, followed by the
+ * TunPackets, each at a multiple of 4 bytes. The daemon offers it with a bundle
+ * holding an empty TunPacket of its flow and coalesces as soon as it receives a
+ * bundle with a TunPacket of its flow. Bundles are always accepted.
+ *
+ * With -b no tap device is used: the data path is benchmarked over the loopback
+ * interface against an echoing peer and the frame rate and the round trip
+ * latency are reported.
+ */
+
+#define _GNU_SOURCE  // recvmmsg, sendmmsg
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <getopt.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+#include <linux/virtio_net.h>
+
+#define TUN_HEADER 8            // size of the TunPacket header
+#define MAX_FRAME 65535         // largest frame the 16 bit length can describe
+#define MAX_BATCH 64
+#define MAX_QUEUES 16
+#define SLOT_SIZE 2048          // send buffer of one frame (segments fit, see tx_slot)
+#define TUN_BUNDLE 0xffff       // flow id of a bundle of TunPackets
+#define BUNDLE_ALIGN 4          // the TunPackets of a bundle start at multiples of this
+#define BUNDLE_SIZE 65507       // largest bundle (the largest UDP payload)
+
+// configuration
+int numQueues = 1;
+int batchSize = 32;
+int vnetHdr = 0;
+int coalesce = 0;
+volatile int peerCoalesces = 0;   // a bundle with our flow was received
+uint16_t flowid;
+struct sockaddr_in remote;
+struct sockaddr_in local;
+
+// frames to send with one sendmmsg call; while coalescing they are put into the
+// bundle, which is sent as the last message
+typedef struct tx_batch {
+    int count;
+    uint64_t flushes;
+    struct mmsghdr msgs[MAX_BATCH + 1];
+    struct iovec iovecs[MAX_BATCH + 1];
+    uint8_t *bufs[MAX_BATCH];
+    uint8_t *bundle;
+    int bundleCount, bundleSize;
+    int bundling;               // where tx_slot() put the current frame
+} tx_batch;
+
+// the TunPackets of a received datagram, a single one or a bundle
+typedef struct frame_iter {
+    const uint8_t *buf;
+    int size, pos, left, bundle;
+} frame_iter;
+
+// a queue of the tap device with its socket and its statistics
+typedef struct tunnel_queue {
+    int index;
+    int tap;
+    int sock;
+    pthread_t to_udp, to_tap;
+    tx_batch tx;
+    uint64_t frames_out;                              // tap -> simulation
+    uint64_t frames_in, batches_in;                   // simulation -> tap
+    uint64_t gso_frames, dropped;
+} tunnel_queue;
+
+tunnel_queue queues[MAX_QUEUES];
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void die(const char *what) {
+    perror(what);
+    exit(1);
+}
+
+/////////////////////////////////////////////////////
+// Sockets and the tap device
+/////////////////////////////////////////////////////
+
+static void resolve(const char *host, const char *port, struct sockaddr_in *sa) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0 || res == NULL) {
+        printf("Could not resolve %s:%s\n", host, port);
+        exit(1);
+    }
+    memcpy(sa, res->ai_addr, sizeof(*sa));
+    freeaddrinfo(res);
+}
+
+// a UDP socket bound to the local address; the sockets of all queues share it
+static int open_socket(const struct sockaddr_in *addr, int reuse) {
+    int on = 1, size = 4 * 1024 * 1024;
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+        die("socket");
+    if (reuse && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+        die("SO_REUSEPORT");
+    // bursts of segmented GSO frames need room
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    if (bind(sock, (const struct sockaddr *) addr, sizeof(*addr)) < 0)
+        die("bind");
+    return sock;
+}
+
+// opens one queue of the tap device (the first call creates the device)
+static int open_tap(const char *name) {
+    struct ifreq ifr;
+    int fd = open("/dev/net/tun", O_RDWR);
+    if (fd < 0)
+        die("/dev/net/tun");
+
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    if (numQueues > 1)
+        ifr.ifr_flags |= IFF_MULTI_QUEUE;
+    if (vnetHdr)
+        ifr.ifr_flags |= IFF_VNET_HDR;
+    strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+    if (ioctl(fd, TUNSETIFF, &ifr) < 0)
+        die("TUNSETIFF");
+
+    // let the kernel hand over TCP segments and partial checksums
+    if (vnetHdr && ioctl(fd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6) < 0)
+        die("TUNSETOFFLOAD");
+
+    return fd;
+}
+
+/////////////////////////////////////////////////////
+// Sending: batches of TunPackets
+/////////////////////////////////////////////////////
+
+static void tx_init(tx_batch *b, const struct sockaddr_in *dest) {
+    int i;
+    memset(b, 0, sizeof(*b));
+    for (i = 0; i < MAX_BATCH; i++) {
+        b->bufs[i] = malloc(SLOT_SIZE);
+        if (b->bufs[i] == NULL)
+            die("malloc");
+        b->iovecs[i].iov_base = b->bufs[i];
+        b->msgs[i].msg_hdr.msg_iov = &b->iovecs[i];
+        b->msgs[i].msg_hdr.msg_iovlen = 1;
+        b->msgs[i].msg_hdr.msg_name = (void *) dest;
+        b->msgs[i].msg_hdr.msg_namelen = sizeof(*dest);
+    }
+    if (coalesce) {
+        b->bundle = malloc(BUNDLE_SIZE);
+        if (b->bundle == NULL)
+            die("malloc");
+        b->bundleSize = TUN_HEADER;
+    }
+}
+
+static void write_header(uint8_t *buf, uint16_t id, uint16_t len) {
+    memset(buf, 0, TUN_HEADER);
+    id = htons(id);
+    memcpy(buf, &id, 2);
+    len = htons(len);
+    memcpy(buf + 4, &len, 2);
+}
+
+static void tx_flush(tx_batch *b, int sock) {
+    int sent = 0, r;
+
+    // the bundle goes last: the frames in the slots were queued before coalescing started
+    if (b->bundleCount > 0) {
+        write_header(b->bundle, TUN_BUNDLE, b->bundleCount);
+        b->iovecs[b->count].iov_base = b->bundle;
+        b->iovecs[b->count].iov_len = b->bundleSize;
+        b->msgs[b->count].msg_hdr.msg_iov = &b->iovecs[b->count];
+        b->msgs[b->count].msg_hdr.msg_iovlen = 1;
+        b->msgs[b->count].msg_hdr.msg_name = b->msgs[0].msg_hdr.msg_name;
+        b->msgs[b->count].msg_hdr.msg_namelen = b->msgs[0].msg_hdr.msg_namelen;
+        b->count++;
+    }
+    while (sent < b->count) {
+        r = sendmmsg(sock, b->msgs + sent, b->count - sent, 0);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("sendmmsg");
+            break;
+        }
+        sent += r;
+    }
+    if (b->bundleCount > 0) {
+        b->bundleCount = 0;
+        b->bundleSize = TUN_HEADER;
+    }
+    b->count = 0;
+    b->flushes++;
+}
+
+// whether the next frame is coalesced (peerCoalesces is set by the receiving
+// thread, so this is decided once per frame in tx_slot())
+static int tx_bundling(void) {
+    return coalesce && peerCoalesces;
+}
+
+// frames waiting in the batch
+static int tx_pending(tx_batch *b) {
+    return b->count + b->bundleCount;
+}
+
+// the buffer for the next frame of at most SLOT_SIZE - TUN_HEADER bytes
+// (flushes the batch if it is full)
+static uint8_t *tx_slot(tx_batch *b, int sock) {
+    b->bundling = tx_bundling();
+    if (b->bundling) {
+        if (b->bundleSize + SLOT_SIZE > BUNDLE_SIZE)
+            tx_flush(b, sock);
+        return b->bundle + b->bundleSize + TUN_HEADER;
+    }
+    if (b->count == batchSize)
+        tx_flush(b, sock);
+    return b->bufs[b->count] + TUN_HEADER;
+}
+
+// completes the TunPacket of the frame written into tx_slot()
+static void tx_commit(tx_batch *b, int len) {
+    if (b->bundling) {
+        write_header(b->bundle + b->bundleSize, flowid, len);
+        b->bundleSize = (b->bundleSize + TUN_HEADER + len + BUNDLE_ALIGN - 1) & ~(BUNDLE_ALIGN - 1);
+        b->bundleCount++;
+        return;
+    }
+    write_header(b->bufs[b->count], flowid, len);
+    b->iovecs[b->count].iov_base = b->bufs[b->count];
+    b->iovecs[b->count].iov_len = TUN_HEADER + len;
+    b->count++;
+}
+
+// offers the simulation to coalesce the frames of our flow
+static void send_offer(int sock, const struct sockaddr_in *dest) {
+    uint8_t offer[2 * TUN_HEADER];
+    write_header(offer, TUN_BUNDLE, 1);
+    write_header(offer + TUN_HEADER, flowid, 0);
+    if (sendto(sock, offer, sizeof(offer), 0, (const struct sockaddr *) dest, sizeof(*dest)) < 0)
+        perror("sendto");
+}
+
+/////////////////////////////////////////////////////
+// Receiving: TunPackets and bundles
+/////////////////////////////////////////////////////
+
+static void iter_init(frame_iter *it, const uint8_t *buf, int size) {
+    uint16_t id, n;
+    it->buf = buf;
+    it->size = size;
+    it->pos = 0;
+    it->left = 1;
+    it->bundle = 0;
+    if (size >= TUN_HEADER) {
+        memcpy(&id, buf, 2);
+        memcpy(&n, buf + 4, 2);
+        if (ntohs(id) == TUN_BUNDLE) {
+            it->bundle = 1;
+            it->left = ntohs(n);
+            it->pos = TUN_HEADER;
+        }
+    }
+}
+
+// the next TunPacket: 1 if there is one, 0 at the end and -1 if the rest is malformed
+static int iter_next(frame_iter *it, uint16_t *id, const uint8_t **data, uint16_t *len) {
+    if (it->left == 0)
+        return 0;
+    it->left--;
+    if (it->size - it->pos < TUN_HEADER) {
+        it->left = 0;
+        return -1;
+    }
+    memcpy(id, it->buf + it->pos, 2);
+    memcpy(len, it->buf + it->pos + 4, 2);
+    *id = ntohs(*id);
+    *len = ntohs(*len);
+    if (*len > it->size - it->pos - TUN_HEADER) {
+        it->left = 0;
+        return -1;
+    }
+    *data = it->buf + it->pos + TUN_HEADER;
+    it->pos = (it->pos + TUN_HEADER + *len + BUNDLE_ALIGN - 1) & ~(BUNDLE_ALIGN - 1);
+    return 1;
+}
+
+/////////////////////////////////////////////////////
+// Checksums and segmentation of GSO frames
+/////////////////////////////////////////////////////
+
+static uint32_t csum_add(uint32_t sum, const uint8_t *data, int len) {
+    while (len > 1) {
+        sum += (data[0] << 8) | data[1];
+        data += 2;
+        len -= 2;
+    }
+    if (len)
+        sum += data[0] << 8;
+    return sum;
+}
+
+static uint16_t csum_fold(uint32_t sum) {
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return htons((uint16_t) ~sum);
+}
+
+// completes a partial checksum (VIRTIO_NET_HDR_F_NEEDS_CSUM): the field holds the
+// sum of the pseudo header already
+static void complete_csum(uint8_t *frame, int len, int start, int offset) {
+    uint16_t c;
+    if (start + offset + 2 > len)
+        return;
+    c = csum_fold(csum_add(0, frame + start, len - start));
+    memcpy(frame + start + offset, &c, 2);
+}
+
+// TCP checksum of a segment with the pseudo header of its IP header
+static void tcp_csum(uint8_t *frame, int l3, int l4, int len, int ipv6) {
+    uint32_t sum = 0;
+    int tcplen = len - l4;
+    uint16_t c = 0;
+    memcpy(frame + l4 + 16, &c, 2);
+    if (ipv6)
+        sum = csum_add(sum, frame + l3 + 8, 32);
+    else
+        sum = csum_add(sum, frame + l3 + 12, 8);
+    sum += IPPROTO_TCP + tcplen;
+    sum = csum_add(sum, frame + l4, tcplen);
+    c = csum_fold(sum);
+    memcpy(frame + l4 + 16, &c, 2);
+}
+
+/*
+ * Splits a TCP frame handed over with TSO (IPv4 or IPv6) into segments of at
+ * most gso_size payload bytes, which are written right into the send batch.
+ */
+static void gso_segment(tunnel_queue *q, tx_batch *b, const struct virtio_net_hdr *vh,
+                        const uint8_t *frame, int len) {
+    int ipv6 = (vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) == VIRTIO_NET_HDR_GSO_TCPV6;
+    int l3 = 14, l4 = vh->csum_start, hdrlen, payload, off, i, seglen;
+    uint32_t seq, seqn;
+    uint16_t id = 0, v;
+
+    if (l4 + 20 > len) {
+        q->dropped++;
+        return;
+    }
+    hdrlen = l4 + ((frame[l4 + 12] >> 4) * 4);
+    payload = len - hdrlen;
+    if (hdrlen > len || vh->gso_size == 0 || hdrlen + vh->gso_size > SLOT_SIZE - TUN_HEADER) {
+        q->dropped++;
+        return;
+    }
+    memcpy(&seq, frame + l4 + 4, 4);
+    seq = ntohl(seq);
+    if (!ipv6) {
+        memcpy(&id, frame + l3 + 4, 2);
+        id = ntohs(id);
+    }
+
+    for (off = 0, i = 0; off < payload; off += vh->gso_size, i++) {
+        uint8_t *seg = tx_slot(b, q->sock);
+        uint8_t *tcp = seg + l4;
+        seglen = payload - off < vh->gso_size ? payload - off : vh->gso_size;
+        memcpy(seg, frame, hdrlen);
+        memcpy(seg + hdrlen, frame + hdrlen + off, seglen);
+
+        // IP header: length, id and checksum
+        if (ipv6) {
+            v = htons(hdrlen - l3 - 40 + seglen);
+            memcpy(seg + l3 + 4, &v, 2);
+        } else {
+            v = htons(hdrlen - l3 + seglen);
+            memcpy(seg + l3 + 2, &v, 2);
+            v = htons(id + i);
+            memcpy(seg + l3 + 4, &v, 2);
+            v = 0;
+            memcpy(seg + l3 + 10, &v, 2);
+            v = csum_fold(csum_add(0, seg + l3, (seg[l3] & 0x0f) * 4));
+            memcpy(seg + l3 + 10, &v, 2);
+        }
+
+        // TCP header: sequence number, flags (FIN and PSH only in the last,
+        // CWR only in the first segment) and checksum
+        seqn = htonl(seq + off);
+        memcpy(tcp + 4, &seqn, 4);
+        if (off + seglen < payload)
+            tcp[13] &= ~0x09;
+        if (i > 0)
+            tcp[13] &= ~0x80;
+        tcp_csum(seg, l3, l4, hdrlen + seglen, ipv6);
+
+        tx_commit(b, hdrlen + seglen);
+        q->frames_out++;
+    }
+    q->gso_frames++;
+}
+
+/////////////////////////////////////////////////////
+// Threads of a queue
+/////////////////////////////////////////////////////
+
+// reads frames from the tap queue and sends them to the simulation
+static void *tap_to_udp(void *arg) {
+    tunnel_queue *q = arg;
+    tx_batch *b = &q->tx;
+    uint8_t *frame = malloc(MAX_FRAME + sizeof(struct virtio_net_hdr));
+    int hdr = vnetHdr ? sizeof(struct virtio_net_hdr) : 0;
+    struct pollfd pfd;
+    int len;
+
+    if (frame == NULL)
+        die("malloc");
+    tx_init(b, &remote);
+    pfd.fd = q->tap;
+    pfd.events = POLLIN;
+
+    for ( ; ; ) {
+        // block for the first frame, then take what is queued up to a batch
+        if (tx_pending(b) == 0 && poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            die("poll");
+        len = read(q->tap, frame, MAX_FRAME + hdr);
+        if (len < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                die("read tap");
+            if (tx_pending(b) > 0)
+                tx_flush(b, q->sock);
+            continue;
+        }
+        if (len <= hdr)
+            continue;
+
+        if (hdr) {
+            struct virtio_net_hdr *vh = (struct virtio_net_hdr *) frame;
+            if (vh->gso_type != VIRTIO_NET_HDR_GSO_NONE) {
+                gso_segment(q, b, vh, frame + hdr, len - hdr);
+                continue;
+            }
+            if (vh->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)
+                complete_csum(frame + hdr, len - hdr, vh->csum_start, vh->csum_offset);
+        }
+        if (len - hdr > SLOT_SIZE - TUN_HEADER) {
+            q->dropped++;
+            continue;
+        }
+        memcpy(tx_slot(b, q->sock), frame + hdr, len - hdr);
+        tx_commit(b, len - hdr);
+        q->frames_out++;
+        if (b->count == batchSize)
+            tx_flush(b, q->sock);
+    }
+    return NULL;
+}
+
+// receives TunPackets from the simulation and writes their frames to the tap queue
+static void *udp_to_tap(void *arg) {
+    tunnel_queue *q = arg;
+    struct mmsghdr msgs[MAX_BATCH];
+    struct iovec iovecs[MAX_BATCH];
+    struct virtio_net_hdr vh;
+    struct iovec out[2];
+    int i, n;
+
+    memset(msgs, 0, sizeof(msgs));
+    memset(&vh, 0, sizeof(vh));
+    for (i = 0; i < batchSize; i++) {
+        iovecs[i].iov_base = malloc(MAX_FRAME + TUN_HEADER);
+        if (iovecs[i].iov_base == NULL)
+            die("malloc");
+        iovecs[i].iov_len = MAX_FRAME + TUN_HEADER;
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    out[0].iov_base = &vh;
+    out[0].iov_len = sizeof(vh);
+
+    for ( ; ; ) {
+        n = recvmmsg(q->sock, msgs, batchSize, MSG_WAITFORONE, NULL);
+        if (n < 0) {
+            if (errno != EINTR)
+                perror("recvmmsg");
+            continue;
+        }
+        q->batches_in++;
+        for (i = 0; i < n; i++) {
+            frame_iter it;
+            const uint8_t *data;
+            uint16_t id, len;
+            int r;
+            iter_init(&it, iovecs[i].iov_base, msgs[i].msg_len);
+            while ((r = iter_next(&it, &id, &data, &len)) != 0) {
+                if (r < 0 || id != flowid) {
+                    q->dropped++;
+                    continue;
+                }
+                // a bundle with our flow: the simulation coalesces it (an empty
+                // TunPacket is only the offer to do so)
+                if (it.bundle) {
+                    peerCoalesces = 1;
+                    if (len == 0)
+                        continue;
+                }
+                out[1].iov_base = (void *) data;
+                out[1].iov_len = len;
+                if (vnetHdr ? writev(q->tap, out, 2) < 0 : write(q->tap, data, len) < 0)
+                    q->dropped++;
+                else
+                    q->frames_in++;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void print_stats(void) {
+    int i;
+    for (i = 0; i < numQueues; i++) {
+        tunnel_queue *q = &queues[i];
+        printf("queue %d: out %llu frames in %llu batches (%llu GSO frames segmented), "
+               "in %llu frames in %llu batches, %llu dropped\n", i,
+               (unsigned long long) q->frames_out, (unsigned long long) q->tx.flushes,
+               (unsigned long long) q->gso_frames, (unsigned long long) q->frames_in,
+               (unsigned long long) q->batches_in, (unsigned long long) q->dropped);
+    }
+}
+
+/////////////////////////////////////////////////////
+// Loopback benchmark
+/////////////////////////////////////////////////////
+
+// echoes the TunPackets like a simulation which bridges the frames back
+static void *bench_echo(void *arg) {
+    int sock = *(int *) arg;
+    struct mmsghdr msgs[MAX_BATCH];
+    struct iovec iovecs[MAX_BATCH];
+    struct sockaddr_in from[MAX_BATCH];
+    int i, n;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < MAX_BATCH; i++) {
+        iovecs[i].iov_base = malloc(BUNDLE_SIZE);
+        iovecs[i].iov_len = BUNDLE_SIZE;
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    for ( ; ; ) {
+        for (i = 0; i < batchSize; i++) {
+            iovecs[i].iov_len = BUNDLE_SIZE;
+            msgs[i].msg_hdr.msg_name = &from[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+        }
+        n = recvmmsg(sock, msgs, batchSize, MSG_WAITFORONE, NULL);
+        if (n <= 0)
+            continue;
+        for (i = 0; i < n; i++)
+            iovecs[i].iov_len = msgs[i].msg_len;
+        sendmmsg(sock, msgs, n, 0);
+    }
+    return NULL;
+}
+
+static int cmp_int64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Sends count frames of size bytes from one socket to an echoing one, at most
+ * window frames outstanding, and reports the frame rate and the round trip times.
+ */
+static int benchmark(int count, int size, int window) {
+    int sock, peer, sent = 0, received = 0, lost = 0, i, n;
+    struct sockaddr_in a, p;
+    socklen_t alen = sizeof(a);
+    struct timeval tv = { 1, 0 };
+    int64_t *rtt = malloc(count * sizeof(int64_t)), start, elapsed, sum = 0;
+    struct mmsghdr msgs[MAX_BATCH];
+    struct iovec iovecs[MAX_BATCH];
+    pthread_t echo;
+    tx_batch b;
+
+    if (rtt == NULL)
+        die("malloc");
+    if (size < 14 + 8 || size > SLOT_SIZE - TUN_HEADER) {
+        printf("Frame size must be between 22 and %d bytes\n", SLOT_SIZE - TUN_HEADER);
+        return 1;
+    }
+
+    memset(&a, 0, sizeof(a));
+    a.sin_family = AF_INET;
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sock = open_socket(&a, 0);
+    peer = open_socket(&a, 0);
+    getsockname(peer, (struct sockaddr *) &p, &alen);
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    pthread_create(&echo, NULL, bench_echo, &peer);
+
+    // the echoing peer returns the bundles as they are
+    peerCoalesces = 1;
+    tx_init(&b, &p);
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < MAX_BATCH; i++) {
+        iovecs[i].iov_base = malloc(BUNDLE_SIZE);
+        iovecs[i].iov_len = BUNDLE_SIZE;
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    start = now_ns();
+    while (received + lost < count) {
+        // keep the window filled
+        while (sent < count && sent - received - lost < window) {
+            uint8_t *frame = tx_slot(&b, sock);
+            int64_t t = now_ns();
+            memset(frame, 0xff, 14);
+            memcpy(frame + 14, &t, 8);
+            tx_commit(&b, size);
+            sent++;
+            if (b.count == batchSize)
+                tx_flush(&b, sock);
+        }
+        tx_flush(&b, sock);
+
+        n = recvmmsg(sock, msgs, batchSize, MSG_WAITFORONE, NULL);
+        if (n <= 0) {
+            // the frames in flight are lost
+            lost = sent - received;
+            continue;
+        }
+        for (i = 0; i < n; i++) {
+            frame_iter it;
+            const uint8_t *data;
+            uint16_t id, len;
+            int64_t t;
+            iter_init(&it, iovecs[i].iov_base, msgs[i].msg_len);
+            while (iter_next(&it, &id, &data, &len) > 0 && received < count) {
+                memcpy(&t, data + 14, 8);
+                rtt[received++] = now_ns() - t;
+            }
+        }
+    }
+    elapsed = now_ns() - start;
+
+    qsort(rtt, received, sizeof(int64_t), cmp_int64);
+    for (i = 0; i < received; i++)
+        sum += rtt[i];
+    printf("%d frames of %d bytes in %s of %d (window %d): %.3f s, %.0f frames/s, %d lost\n",
+           count, size, coalesce ? "bundles, batches" : "batches", batchSize, window,
+           elapsed / 1e9, received / (elapsed / 1e9), lost);
+    if (received > 0)
+        printf("round trip time: min %.1f us, avg %.1f us, p99 %.1f us, max %.1f us\n",
+               rtt[0] / 1e3, sum / 1e3 / received, rtt[(int) (received * 0.99)] / 1e3,
+               rtt[received - 1] / 1e3);
+    return 0;
+}
+
+/////////////////////////////////////////////////////
+// main
+/////////////////////////////////////////////////////
+
+static void usage(const char *name) {
+    printf("Usage: %s [-q QUEUES] [-B BATCH] [-v] [-c] SERVER_IP LOCAL_PORT REMOTE_PORT FLOW_ID DEVICE\n"
+           "       %s -b [-B BATCH] [-c] [-n FRAMES] [-s SIZE] [-w WINDOW]\n", name, name);
+}
+
+int main(int argc, char *argv[]) {
+    int bench = 0, count = 1000000, size = 1000, window = 256, opt, i;
+    char port[8];
+    sigset_t mask;
+
+    while ((opt = getopt(argc, argv, "q:B:vcbn:s:w:")) != -1) {
+        switch (opt) {
+        case 'q':
+            numQueues = atoi(optarg);
+            break;
+        case 'B':
+            batchSize = atoi(optarg);
+            break;
+        case 'v':
+            vnetHdr = 1;
+            break;
+        case 'c':
+            coalesce = 1;
+            break;
+        case 'b':
+            bench = 1;
+            break;
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 's':
+            size = atoi(optarg);
+            break;
+        case 'w':
+            window = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (numQueues < 1 || numQueues > MAX_QUEUES || batchSize < 1 || batchSize > MAX_BATCH) {
+        printf("QUEUES must be between 1 and %d and BATCH between 1 and %d\n", MAX_QUEUES, MAX_BATCH);
+        return 1;
+    }
+    if (bench)
+        return benchmark(count, size, window);
+    if (argc - optind < 5) {
+        usage(argv[0]);
+        return 1;
+    }
+    argv += optind - 1;
+
+    resolve(argv[1], argv[3], &remote);
+    resolve("0.0.0.0", argv[2], &local);
+    flowid = (uint16_t) atoi(argv[4]);
+
+    // the statistics are printed when the daemon is stopped
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    for (i = 0; i < numQueues; i++) {
+        tunnel_queue *q = &queues[i];
+        q->index = i;
+        q->tap = open_tap(argv[5]);
+        fcntl(q->tap, F_SETFL, fcntl(q->tap, F_GETFL) | O_NONBLOCK);
+        q->sock = open_socket(&local, numQueues > 1);
+        pthread_create(&q->to_udp, NULL, tap_to_udp, q);
+        pthread_create(&q->to_tap, NULL, udp_to_tap, q);
+    }
+    if (coalesce)
+        send_offer(queues[0].sock, &remote);
+    snprintf(port, sizeof(port), "%d", ntohs(remote.sin_port));
+    printf("Tunnel %s: %d queue(s), flow %d to %s:%s%s%s\n", argv[5], numQueues, flowid,
+           inet_ntoa(remote.sin_addr), port, vnetHdr ? ", virtio header with TSO" : "",
+           coalesce ? ", coalescing offered" : "");
+
+    sigwait(&mask, &i);
+    print_stats();
+    return 0;
+}